@@ -26,5 +26,7 @@ WEAK int aud_backend_get_outputs(aud_output_dev* arr, int count);
 WEAK int aud_backend_configure_output(int output_id, int sample_rate, int channels, int format_size);
 WEAK int aud_backend_query_output_params(int output_id, int *sample_rate, int *channels, int *format_size);
 WEAK int aud_backend_queue_data(int output_id, const void* buf, int len);
+/* Blocks until all queued data has been played */
+WEAK int aud_backend_output_drain(int output_id);
 WEAK int aud_backend_output_play(int output_id, bool play);
 WEAK int aud_backend_set_output_volume(int output_id, float volume /* out of 100 */);
\ No newline at end of file
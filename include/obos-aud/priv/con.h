@@ -18,6 +18,10 @@
 #include <obos-aud/stream.h>
 
 #include <obos-aud/priv/mixer.h>
+#include <obos-aud/priv/socket.h>
+#include <obos-aud/priv/reactor.h>
+#include <obos-aud/priv/hash.h>
+#include <obos-aud/priv/packet.h>
 
 #include <stdint.h>
 #include <stdbool.h>
@@ -29,26 +33,50 @@ typedef struct obos_aud_stream_handle {
     mixer_output_device* dev;
     aud_stream_node* stream_node;
     uint16_t stream_id;
-    uint32_t refs; /* only to be referenced in a deferred OBOS_AUD_DATA packet */
-    bool should_free : 1;
+    /* one for the connection's table, plus one for every deferred packet or direct receive */
+    uint32_t refs;
+    /* set once the stream was closed, while references remain */
+    bool closed;
+    /* OBOS_AUD_DATA packets waiting for room in the stream, oldest first */
+    struct {
+        struct packet_node *head, *tail;
+    } deferred;
+    /* for streams opened with OBOS_AUD_OPEN_STREAM_CREDITS */
+    struct {
+        bool enabled;
+        size_t granted; /* bytes the client can still send */
+        size_t threshold; /* the smallest grant worth sending */
+    } credits;
+    /* the woken list of the reactor that owns the stream */
+    obos_aud_woken_streams* woken_streams;
+    /* set by the mixer thread, under woken_streams->lock */
+    bool woken;
+    struct obos_aud_stream_handle *next_woken;
+    /* keyed by stream_id, in the connection's stream_handles.by_id */
+    obos_aud_hash_node id_node;
     struct obos_aud_stream_handle *next, *prev;
 } obos_aud_stream_handle;
 
 typedef struct obos_aud_connection {
     int fd;
+    obos_aud_socket* sock;
     uint32_t client_id;
     float volume;
     struct {
         uint16_t next_stream_id;
         pthread_mutex_t lock;
         obos_aud_stream_handle *head, *tail;  
+        obos_aud_hash_table by_id;
     } stream_handles;
     char* name;
+    /* in g_connections.by_id and g_connections.by_fd */
+    obos_aud_hash_node id_node, fd_node;
     struct obos_aud_connection *next, *prev;
 } obos_aud_connection;
 
 extern struct obos_aud_connection_array {
     obos_aud_connection *head, *tail;
+    obos_aud_hash_table by_id, by_fd;
     pthread_mutex_t lock;
 } g_connections;
 
@@ -59,6 +87,7 @@ void obos_aud_process_stream_open(obos_aud_connection* client, aud_packet* pckt)
 void obos_aud_process_stream_close(obos_aud_connection* client, aud_packet* pckt);
 void obos_aud_process_stream_set_flags(obos_aud_connection* client, aud_packet* pckt);
 void obos_aud_process_stream_get_flags(obos_aud_connection* client, aud_packet* pckt);
+void obos_aud_process_stream_open_ring(obos_aud_connection* client, aud_packet* pckt);
 void obos_aud_process_stream_set_volume(obos_aud_connection* client, aud_packet* pckt);
 void obos_aud_process_output_set_volume(obos_aud_connection* client, aud_packet* pckt);
 void obos_aud_process_conn_set_volume(obos_aud_connection* client, aud_packet* pckt);
@@ -66,13 +95,33 @@ void obos_aud_process_stream_get_volume(obos_aud_connection* client, aud_packet*
 void obos_aud_process_output_get_volume(obos_aud_connection* client, aud_packet* pckt);
 void obos_aud_process_conn_get_volume(obos_aud_connection* client, aud_packet* pckt);
 void obos_aud_stream_close(obos_aud_connection* client, obos_aud_stream_handle* hnd, bool locked);
+/* Tears down the connection, but leaves closing its socket to the caller. */
 void obos_aud_process_disconnect(obos_aud_connection* client, aud_packet* pckt);
 void obos_aud_process_set_name(obos_aud_connection* client, aud_packet* pckt);
 void obos_aud_process_query_connections(obos_aud_connection* client, aud_packet* pckt);
-obos_aud_connection* obos_aud_process_initial_connection_request(int fd, aud_packet* pckt);
+obos_aud_connection* obos_aud_process_initial_connection_request(obos_aud_socket* sock, aud_packet* pckt);
 void obos_aud_process_output_device_query(obos_aud_connection* client, aud_packet* pckt);
 void obos_aud_process_output_device_query_parameters(obos_aud_connection* client, aud_packet* pckt);
 void obos_aud_process_output_set_buffer_samples(obos_aud_connection* client, aud_packet* pckt);
 void obos_aud_process_set_default_output(obos_aud_connection* client, aud_packet* pckt);
 
+/* Returns true if the packet was deferred until its stream has room, in which case it is not to be freed. */
+bool obos_aud_process_data(obos_aud_connection* client, struct packet_node* node);
+/* Same as obos_aud_process_data, for OBOS_AUD_DATAV. */
+bool obos_aud_process_datav(obos_aud_connection* client, struct packet_node* node);
+/*
+ * Reserves room in a stream for the audio of a DATA packet whose payload is
+ * received up to the stream id, so it can be received in place.
+ * Returns where the len bytes of audio go, or NULL if the packet has to be buffered instead.
+ */
+void* obos_aud_begin_direct_data(struct packet_node* node, size_t len, obos_aud_stream_handle** hnd);
+/* complete is false if the socket is closed before all of the audio arrived. */
+void obos_aud_end_direct_data(struct packet_node* node, obos_aud_stream_handle* hnd, bool complete);
+/* Pushes the deferred packets of every stream in the list. */
+void obos_aud_process_woken_streams(obos_aud_woken_streams* woken);
+
+void obos_aud_stream_handle_ref(obos_aud_stream_handle* hnd);
+/* Frees the handle once the last reference is dropped. */
+void obos_aud_stream_handle_unref(obos_aud_stream_handle* hnd);
+
 obos_aud_stream_handle* obos_aud_get_stream_by_id(obos_aud_connection* con, uint16_t stream_id);
@@ -0,0 +1,43 @@
+/*
+ * obos-aud/priv/hash.h
+ *
+ * This file is a part of the obos-aud project.
+ *
+ * Copyright (c) 2025 Omar Berrow
+ * SPDX License Identifier: MIT
+ */
+
+#pragma once
+
+#if !BUILDING_OBOS_AUD_SERVER
+#   error Not building obos-aud server!
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * An intrusive hash table keyed by 32-bit integers.
+ * Several nodes can share a key.
+ * Not thread-safe, callers are to hold whatever lock protects the table.
+ */
+typedef struct obos_aud_hash_node {
+    uint32_t key;
+    struct obos_aud_hash_node *next;
+} obos_aud_hash_node;
+
+typedef struct obos_aud_hash_table {
+    obos_aud_hash_node** buckets;
+    size_t nBuckets; /* always a power of two, or zero */
+    size_t nNodes;
+} obos_aud_hash_table;
+
+#define obos_aud_hash_entry(node, type, member) ((type*)((char*)(node) - offsetof(type, member)))
+
+void obos_aud_hash_insert(obos_aud_hash_table* table, obos_aud_hash_node* node, uint32_t key);
+void obos_aud_hash_remove(obos_aud_hash_table* table, obos_aud_hash_node* node);
+/* Returns the first node with key, or NULL. */
+obos_aud_hash_node* obos_aud_hash_find(const obos_aud_hash_table* table, uint32_t key);
+/* Returns the next node after 'node' with the same key, or NULL. */
+obos_aud_hash_node* obos_aud_hash_find_next(const obos_aud_hash_node* node);
+void obos_aud_hash_free(obos_aud_hash_table* table);
@@ -19,14 +19,29 @@
 #include <pthread.h>
 #include <stdbool.h>
 
+/*
+ * Streams sharing a sample rate are mixed together at that rate,
+ * and then resampled to the device rate once.
+ */
+typedef struct mixer_rate_group {
+    int sample_rate;
+    struct aud_stream_node *head, *tail;
+    size_t nNodes;
+    /* resamples the group's submix, which has as many channels as the device */
+    aud_resampler resampler;
+    struct mixer_rate_group *next, *prev;
+} mixer_rate_group;
+
 typedef struct aud_stream_node {
     aud_stream data;
     /* for averaging, not guaranteed to exist */
-    int16_t* input_samples_arr;
+    float* input_samples_arr;
     int sample_count;
     bool dead;
     int last_output_idx;
     struct obos_aud_connection* owner;
+    mixer_rate_group* group;
+    struct aud_stream_node *group_next, *group_prev;
     struct aud_stream_node *next, *prev;
 } aud_stream_node;
 
@@ -38,12 +53,19 @@ typedef struct mixer_output_device {
         pthread_mutex_t lock;
         pthread_cond_t evnt;
     } streams;
+    /* protected by streams.lock */
+    struct {
+        mixer_rate_group *head, *tail;
+    } groups;
     int input_channels;
     int sample_rate;
     int channels;
     int format_size;
     float volume;
     int buffer_samples;
+    /* sample rates the backend refused to switch to */
+    int rejected_sample_rates[8];
+    int nRejectedSampleRates;
     pthread_t worker;
 } mixer_output_device;
 
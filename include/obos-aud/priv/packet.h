@@ -0,0 +1,53 @@
+/*
+ * obos-aud/priv/packet.h
+ *
+ * This file is a part of the obos-aud project.
+ *
+ * Copyright (c) 2025 Omar Berrow
+ * SPDX License Identifier: MIT
+ */
+
+#pragma once
+
+#if !BUILDING_OBOS_AUD_SERVER
+#   error Not building obos-aud server!
+#endif
+
+#include <obos-aud/trans.h>
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Packets with payloads up to this size are recycled through per-thread pools. */
+#define OBOS_AUD_PACKET_POOL_MAX_PAYLOAD (64*1024)
+/* The most packets kept cached by each thread, per size class. */
+#define OBOS_AUD_PACKET_POOL_DEPTH 32
+
+struct obos_aud_socket;
+struct obos_aud_stream_handle;
+
+struct packet_node {
+    aud_packet pckt;
+    struct obos_aud_socket* sock;
+    /* set once an OBOS_AUD_DATA packet has been deferred */
+    struct obos_aud_stream_handle* stream;
+    /* set on the deferred pieces of an OBOS_AUD_DATAV packet, which is replied to once they are all written */
+    struct packet_node* batch;
+    /* for an OBOS_AUD_DATAV packet, the pieces still deferred, and whether any of them failed */
+    uint16_t nPieces;
+    bool failed;
+    struct packet_node *next, *prev;
+    /* the pool the node came from, or -1 */
+    int8_t size_class;
+};
+
+/* Returns a zeroed node, with pckt.payload pointing to payload_len bytes
+ * allocated along with it (or NULL if payload_len is zero).
+ * Returns NULL if the node can't be allocated. */
+struct packet_node* obos_aud_packet_alloc(size_t payload_len);
+/* Same as obos_aud_packet_alloc, but the payload is aligned as if it started
+ * packet_offset bytes into a packet aligned to OBOS_AUD_PAYLOAD_ALIGNMENT. */
+struct packet_node* obos_aud_packet_alloc_at(size_t payload_len, size_t packet_offset);
+/* Frees the node along with its payload. */
+void obos_aud_packet_free(struct packet_node* node);
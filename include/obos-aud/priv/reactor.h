@@ -0,0 +1,76 @@
+/*
+ * obos-aud/priv/reactor.h
+ *
+ * This file is a part of the obos-aud project.
+ *
+ * Copyright (c) 2025 Omar Berrow
+ * SPDX License Identifier: MIT
+ */
+
+#pragma once
+
+#if !BUILDING_OBOS_AUD_SERVER
+#   error Not building obos-aud server!
+#endif
+
+#include <obos-aud/priv/socket.h>
+#if OBOS_AUD_IO_URING
+#   include <obos-aud/priv/uring.h>
+#endif
+
+#include <stdbool.h>
+#include <pthread.h>
+
+/* The most reactor threads the server runs. */
+#define OBOS_AUD_MAX_REACTORS 16
+
+/*
+ * How much one socket gets dispatched each time round the loop, before the
+ * other sockets get their turn. At least one packet is always dispatched.
+ */
+#define OBOS_AUD_DISPATCH_QUOTA_PACKETS 32
+#define OBOS_AUD_DISPATCH_QUOTA_BYTES (256*1024)
+
+/*
+ * A socket isn't read from while this much of it is waiting to be dispatched,
+ * and is read from again once it is down to a quarter of both.
+ */
+#define OBOS_AUD_SOCKET_QUEUE_MAX_PACKETS 1024
+#define OBOS_AUD_SOCKET_QUEUE_MAX_BYTES (4*1024*1024)
+
+struct packet_node;
+struct obos_aud_stream_handle;
+
+/* Streams that have room for their deferred packets again. */
+typedef struct obos_aud_woken_streams {
+    struct obos_aud_stream_handle *head, *tail;
+    pthread_mutex_t lock;
+    /* signalled whenever a stream is added */
+    int event_fd;
+} obos_aud_woken_streams;
+
+/*
+ * One thread's event loop. Every socket, along with the connections on it,
+ * belongs to the reactor that accepted it, and is only touched by that
+ * reactor's thread. Only woken_streams is shared, with the mixer.
+ */
+typedef struct obos_aud_reactor {
+    int index;
+    pthread_t thread;
+    int epoll_fd;
+#if OBOS_AUD_IO_URING
+    obos_aud_uring ring;
+    bool use_uring;
+    /* set if the wake poll couldn't be queued while the submission queue was full */
+    bool wake_stalled;
+    /* sockets with operations that couldn't be queued while the submission queue was full */
+    struct obos_aud_socket* stalled;
+#endif
+    /* sockets with packets waiting to be dispatched, in the order they take turns */
+    struct obos_aud_socket_list ready;
+    /* sockets closed this time round the loop, freed at the end of it */
+    struct obos_aud_socket* released;
+    /* sockets that had packets queued since they were last flushed */
+    struct obos_aud_socket_list tx_pending;
+    obos_aud_woken_streams woken_streams;
+} obos_aud_reactor;
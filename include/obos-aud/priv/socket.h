@@ -0,0 +1,149 @@
+/*
+ * obos-aud/priv/socket.h
+ *
+ * This file is a part of the obos-aud project.
+ *
+ * Copyright (c) 2025 Omar Berrow
+ * SPDX License Identifier: MIT
+ */
+
+#pragma once
+
+#if !BUILDING_OBOS_AUD_SERVER
+#   error Not building obos-aud server!
+#endif
+
+#include <obos-aud/trans.h>
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <sys/uio.h>
+#include <sys/socket.h>
+
+/* A client with more than this many bytes of unsent replies is disconnected. */
+#define OBOS_AUD_SOCKET_MAX_BACKLOG (1024*1024)
+/* The most file descriptors that can be sent along with one packet. */
+#define OBOS_AUD_SOCKET_MAX_FDS 2
+
+struct packet_node;
+struct obos_aud_stream_handle;
+struct obos_aud_reactor;
+
+typedef struct obos_aud_tx_buffer {
+    size_t len, off;
+    /* sent with the first byte of the buffer, and closed once they are */
+    int fds[OBOS_AUD_SOCKET_MAX_FDS];
+    int nFds;
+    struct obos_aud_tx_buffer *next;
+    char data[];
+} obos_aud_tx_buffer;
+
+/* Room for the SCM_RIGHTS message of one packet. */
+typedef union obos_aud_tx_control {
+    char buf[CMSG_SPACE(sizeof(int)*OBOS_AUD_SOCKET_MAX_FDS)];
+    struct cmsghdr align;
+} obos_aud_tx_control;
+
+typedef struct obos_aud_socket {
+    int fd;
+    /* the reactor the socket belongs to */
+    struct obos_aud_reactor* reactor;
+    bool listener : 1;
+    /* the socket is closed once its queued replies are sent */
+    bool closing : 1;
+    /* the socket is to be closed without sending anything more */
+    bool dead : 1;
+    bool tx_pending : 1;
+    /* a unix: socket, which can be sent file descriptors */
+    bool local : 1;
+    /* not read from until its queue was dispatched down to a quarter of the limits */
+    bool throttled : 1;
+    /* the epoll events currently registered */
+    uint32_t events;
+    /* receive state of a partially read packet */
+    struct {
+        char buf[4096];
+        size_t start, len;
+        /* set once the packet's header was parsed */
+        struct packet_node* node;
+        size_t skip;
+        /* where the packet's payload starts, from the packet's header */
+        size_t data_offset;
+        size_t payload_off;
+        /* the payload length of a DATA packet which could be received straight into its stream */
+        size_t data_len;
+        /* set while a DATA packet's audio is being received into its stream */
+        struct obos_aud_stream_handle* direct;
+        char* direct_buf;
+        size_t direct_len, direct_off;
+    } rx;
+    /* packets from this socket waiting to be dispatched, oldest first */
+    struct {
+        struct packet_node *head, *tail;
+        size_t count;
+        /* the payload bytes of every queued packet */
+        size_t nBytes;
+    } queue;
+    struct {
+        obos_aud_tx_buffer *head, *tail;
+        size_t nBytes;
+    } tx;
+#if OBOS_AUD_IO_URING
+    struct {
+        /* operations the kernel still has, the socket is only freed once there are none */
+        int nPending;
+        bool recv_armed : 1;
+        /* a cancel of the recv was queued */
+        bool recv_cancelled : 1;
+        bool send_inflight : 1;
+        /* couldn't be queued while the submission queue was full, counted in nPending until retried */
+        bool recv_stalled : 1;
+        bool send_stalled : 1;
+        /* closed, and waiting for nPending to reach zero */
+        bool released : 1;
+        /* in the reactor's stalled list */
+        struct obos_aud_socket* next_stalled;
+        /* provided buffers received while throttled, oldest first, not given back until they are read */
+        struct {
+            struct uring_held_buffer *head, *tail;
+        } held;
+        struct msghdr msg;
+        struct iovec iov[16];
+        obos_aud_tx_control control;
+    } uring;
+#endif
+    /* in the reactor's tx_pending */
+    struct obos_aud_socket *next, *prev;
+    /* in the reactor's ready list, or its released list once closed */
+    struct obos_aud_socket *next_ready, *prev_ready;
+} obos_aud_socket;
+
+struct obos_aud_socket_list {
+    obos_aud_socket *head, *tail;
+};
+
+/*
+ * Queues a packet to be sent to the socket, and adds the socket to its reactor's tx_pending.
+ * If the socket's backlog is too big, it is marked dead and -1 is returned.
+ */
+int obos_aud_socket_transmit(obos_aud_socket* sock, aud_packet* pckt);
+/* Same as obos_aud_socket_transmit, but also sends nFds file descriptors, which the socket
+ * takes ownership of, even on failure. */
+int obos_aud_socket_transmit_fds(obos_aud_socket* sock, aud_packet* pckt, const int* fds, int nFds);
+/*
+ * Sends as much of the queued data as the socket will take without blocking.
+ * Returns false if the socket errored.
+ */
+bool obos_aud_socket_flush(obos_aud_socket* sock);
+void obos_aud_socket_remove_pending(obos_aud_socket* sock);
+/*
+ * Sets msg up to send up to nIov pieces of the queued data, stopping before
+ * any that has file descriptors to send, unless it is the first.
+ */
+void obos_aud_socket_tx_msg(obos_aud_socket* sock, struct msghdr* msg, struct iovec* iov, int nIov, obos_aud_tx_control* control);
+/* Drops nWritten bytes of sent data from the front of the queue. */
+void obos_aud_socket_tx_advance(obos_aud_socket* sock, size_t nWritten);
+/* Frees all queued data, and removes the socket from tx_pending. */
+void obos_aud_socket_discard(obos_aud_socket* sock);
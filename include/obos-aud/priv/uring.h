@@ -0,0 +1,69 @@
+/*
+ * obos-aud/priv/uring.h
+ *
+ * This file is a part of the obos-aud project.
+ *
+ * Copyright (c) 2025 Omar Berrow
+ * SPDX License Identifier: MIT
+ */
+
+#pragma once
+
+#if !BUILDING_OBOS_AUD_SERVER
+#   error Not building obos-aud server!
+#endif
+
+#if !OBOS_AUD_IO_URING
+#   error Not building with io_uring support!
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <linux/io_uring.h>
+
+/*
+ * Just enough of io_uring for the server loop, with one group of provided
+ * receive buffers. Only to be used from one thread.
+ */
+typedef struct obos_aud_uring {
+    int fd;
+    struct {
+        unsigned *head, *tail, *mask, *array;
+        unsigned entries;
+        /* sqes handed out but not yet submitted */
+        unsigned nQueued;
+        struct io_uring_sqe* sqes;
+    } sq;
+    struct {
+        unsigned *head, *tail, *mask;
+        struct io_uring_cqe* cqes;
+    } cq;
+    void *sq_map, *cq_map;
+    size_t sq_map_len, cq_map_len, sqes_len;
+    /* the provided buffers, in buffer group zero */
+    struct {
+        struct io_uring_buf_ring* ring;
+        size_t ring_len;
+        char* data;
+        unsigned count, size;
+    } bufs;
+} obos_aud_uring;
+
+/* Returns false if io_uring, or any of the features the server needs, is unavailable. */
+bool obos_aud_uring_init(obos_aud_uring* ring, unsigned entries, unsigned nBufs, unsigned buf_size);
+void obos_aud_uring_free(obos_aud_uring* ring);
+
+/* Returns a zeroed sqe, submitting what is queued if the ring is full. */
+struct io_uring_sqe* obos_aud_uring_get_sqe(obos_aud_uring* ring);
+/* Submits every queued sqe, and waits for at least wait_nr completions. */
+int obos_aud_uring_submit(obos_aud_uring* ring, unsigned wait_nr);
+/* Returns the oldest unseen completion, or NULL. */
+struct io_uring_cqe* obos_aud_uring_peek_cqe(obos_aud_uring* ring);
+void obos_aud_uring_cqe_seen(obos_aud_uring* ring);
+
+/* Returns provided buffer bid, as picked by the kernel for a receive. */
+void* obos_aud_uring_buffer(obos_aud_uring* ring, uint16_t bid);
+/* Gives a provided buffer back to the kernel. */
+void obos_aud_uring_recycle_buffer(obos_aud_uring* ring, uint16_t bid);
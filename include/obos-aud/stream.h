@@ -20,29 +20,116 @@ enum {
     OBOS_AUD_STREAM_FLAGS_PCM24_DECODE = (1<<2),
     OBOS_AUD_STREAM_FLAGS_ALAW_DECODE = (1<<3),
     OBOS_AUD_STREAM_FLAGS_F32_DECODE = (1<<4),
-    OBOS_AUD_STREAM_DECODE_MASK = 0x1f,
-    OBOS_AUD_STREAM_VALID_FLAG_MASK = 0x1f,
+    /* Decode data when it is pushed, and store it as one plane of float32 per channel.
+     * Can only be changed while the stream is empty. */
+    OBOS_AUD_STREAM_FLAGS_PLANAR_F32_STORAGE = (1<<5),
+    /* IMA ADPCM, see autrans_adpcm_encode. Decoded into PCM16 when pushed. */
+    OBOS_AUD_STREAM_FLAGS_ADPCM_DECODE = (1<<6),
+    OBOS_AUD_STREAM_DECODE_MASK = 0x5f,
+    OBOS_AUD_STREAM_VALID_FLAG_MASK = 0x7f,
 };
 
+/* The maximum amount of SET_FLAGS requests that can be queued behind buffered data. */
+#define OBOS_AUD_STREAM_MAX_PENDING_FORMATS 4
+
+typedef struct aud_resampler {
+    /* Two input frames (current, then next) which are interpolated between. */
+    float* frames;
+    int channels;
+    int nFrames;
+    float frac;
+} aud_resampler;
+/* Reads the next input frame into frame. Returns false if there is none yet. */
+typedef bool(*aud_resampler_source)(void* udata, float* frame);
+
+/*
+ * Streams store audio as it was sent by the client, in the client's
+ * sample rate and format. It is decoded and resampled to the device
+ * rate by the mixer as it is consumed.
+ * With OBOS_AUD_STREAM_FLAGS_PLANAR_F32_STORAGE, buffer instead holds
+ * one plane of decoded samples per channel, plane_stride floats apart,
+ * and ptr, in_ptr and size count frames rather than bytes.
+ */
 typedef struct aud_stream {
     void* buffer;
     size_t ptr;
     size_t in_ptr;
     size_t size;
+    size_t plane_stride;
     pthread_mutex_t mut;
     pthread_cond_t write_event; /* only set when the stream is empty! */
     int sample_rate;
     int channels;
     float volume;
-    uint32_t flags;
+    uint32_t flags; /* the format of any data pushed from now on */
+    uint32_t in_flags; /* the format of the data at in_ptr */
+    struct {
+        uint32_t flags;
+        size_t at; /* the offset in buffer where flags takes effect */
+    } pending_formats[OBOS_AUD_STREAM_MAX_PENDING_FORMATS];
+    int nPendingFormats;
+    /* with planar storage, the start of a frame cut off at the end of the last push */
+    uint8_t* partial;
+    size_t nPartial;
+    /* how much of a push too big for the buffer was stored before it had to be deferred */
+    size_t split_off;
+    struct autrans_adpcm_state* adpcm;
+    void* adpcm_buffer;
+    /* how much of an ADPCM push was decoded and stored before it had to be deferred */
+    size_t adpcm_off;
     struct mixer_output_device* dev;
+    /* Set when a non-blocking push fails, to the amount of free space it needs. Once
+     * the mixer frees that much, space_callback is called with the stream locked. */
+    size_t space_wanted;
+    void(*space_callback)(struct aud_stream* stream, void* udata);
+    void* space_udata;
+    /* set while a writer owns the space after ptr, see aud_stream_reserve */
+    bool reserved;
+    /* set by aud_stream_attach_ring, drained by the mixer as it reads */
+    struct {
+        struct aud_shm_ring* hdr;
+        /* kept apart from hdr, as the client can write to it */
+        const char* data;
+        uint32_t size;
+        size_t map_size;
+        int event_fd;
+    } ring;
 } aud_stream;
 
-void aud_stream_initialize(aud_stream* stream, int sample_rate, int dev_sample_rate, int channels);
-/* decoded_data is only returned if blocking is true and the operation would block */
-bool aud_stream_push(aud_stream* stream, const void* data, size_t len, bool blocking, const void** decoded_data, size_t* decoded_data_len);
-bool aud_stream_push_no_decode(aud_stream* stream, const void* data, size_t len, bool blocking);
+void aud_stream_initialize(aud_stream* stream, int sample_rate, int channels);
+void aud_stream_free(aud_stream* stream);
+bool aud_stream_push(aud_stream* stream, const void* data, size_t len, bool blocking);
+/* Reserves len contiguous bytes after the buffered data, for the caller to fill in without the lock held.
+ * Only streams that store data as it is pushed can be reserved.
+ * Returns NULL if the data doesn't fit right now. */
+void* aud_stream_reserve(aud_stream* stream, size_t len);
+/* Makes the next len bytes of the reserved space readable by the mixer. */
+void aud_stream_commit(aud_stream* stream, size_t len);
+void aud_stream_unreserve(aud_stream* stream);
+/* Returns how many bytes of input in the stream's current format fit in it right now. */
+size_t aud_stream_space(aud_stream* stream);
+/* Has space_callback called once len bytes of input fit in the stream, which might be right away.
+ * Returns false if they never can, in which case nothing is done. */
+bool aud_stream_want_space(aud_stream* stream, size_t len);
+/* Has the mixer take audio from a shared ring, mapped map_size bytes long at hdr, besides what is pushed.
+ * The stream owns the mapping and event_fd from then on, and frees them along with itself.
+ * Fails if the stream already has a ring, or doesn't store data as it is pushed. */
+bool aud_stream_attach_ring(aud_stream* stream, struct aud_shm_ring* hdr, size_t map_size, int event_fd);
 bool aud_stream_read(aud_stream* stream, void* data, size_t len, bool peek, bool blocking);
+/* Reads one frame at the stream's sample rate into out (stream->channels samples, in PCM16 range).
+ * Returns false if there is not enough buffered data. */
+bool aud_stream_read_frame(aud_stream* stream, float* out);
+/* Returns false if too many format changes are already queued,
+ * or if the storage mode was changed while the stream has data. */
+bool aud_stream_set_flags(aud_stream* stream, uint32_t flags);
+size_t aud_stream_sample_size(uint32_t flags);
 
 void aud_stream_lock(aud_stream* stream);
 void aud_stream_unlock(aud_stream* stream);
+
+void aud_resampler_initialize(aud_resampler* rs, int channels);
+void aud_resampler_free(aud_resampler* rs);
+/* Reads one frame at out_sample_rate into out, linearly interpolating between the frames
+ * read from source at in_sample_rate. Returns false if source ran out first, in which case
+ * the frames read so far are kept for the next call. */
+bool aud_resampler_read(aud_resampler* rs, int in_sample_rate, int out_sample_rate, aud_resampler_source source, void* udata, float* out);
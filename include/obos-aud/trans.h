@@ -17,6 +17,9 @@
 #include <obos-aud/output.h>
 
 #include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <pthread.h>
 
 /* PROTOCOL NOTE: Audio is to start playing on a stream after the first DATA packet is sent. */
 
@@ -42,6 +45,10 @@ enum aud_opcode {
     OBOS_AUD_QUERY_OUTPUT_PARAMETERS,
     OBOS_AUD_OUTPUT_SET_BUFFER_SAMPLES,
     OBOS_AUD_SET_DEFAULT_OUTPUT,
+    /* unix: connections only, see aud_shm_ring */
+    OBOS_AUD_STREAM_OPEN_RING,
+    /* DATA for several streams at once, see aud_datav_payload */
+    OBOS_AUD_DATAV,
 
     OBOS_AUD_REQUEST_REPLY_BEGIN = 0x1000,
     OBOS_AUD_INITIAL_CONNECTION_REPLY,
@@ -51,6 +58,7 @@ enum aud_opcode {
     OBOS_AUD_STREAM_GET_FLAGS_REPLY,
     OBOS_AUD_QUERY_CONNECTIONS_REPLY,
     OBOS_AUD_QUERY_OUTPUT_PARAMETERS_REPLY,
+    OBOS_AUD_STREAM_OPEN_RING_REPLY,
 
     /*
      * All status replies have no required payload,
@@ -64,6 +72,10 @@ enum aud_opcode {
     OBOS_AUD_STATUS_REPLY_DISCONNECTED,
     OBOS_AUD_STATUS_REPLY_STREAM_DEAD,
     OBOS_AUD_STATUS_REPLY_CEILING = 0x2fff,
+
+    /* Sent by the server on its own, not in reply to anything. */
+    OBOS_AUD_EVENT_BEGIN = 0x3000,
+    OBOS_AUD_STREAM_CREDIT,
 };
 
 #define OBOS_AUD_HEADER_MAGIC (0x0b05a7d1 /* obosaudi */)
@@ -79,6 +91,9 @@ typedef struct aud_header {
 
 /* CONSTANT!!! */
 #define OBOS_AUD_BASE_PROTOCOL_HEADER_SIZE (24)
+/* The biggest packet, header included, that the server accepts.
+ * It closes the connection of a client that sends a bigger one. */
+#define OBOS_AUD_MAX_PACKET_SIZE (16*1024*1024)
 
 /**************************************************/
 /* Reply structures */
@@ -90,8 +105,39 @@ typedef struct aud_initial_connection_reply {
 
 typedef struct aud_open_stream_reply {
     uint16_t stream_id;
+    /* the initial credits of a stream opened with OBOS_AUD_OPEN_STREAM_CREDITS, otherwise zero */
+    uint32_t credits;
 } PACK aud_open_stream_reply;
 
+typedef struct aud_stream_open_ring_reply {
+    /* the size to map the memfd with */
+    uint32_t map_size;
+} PACK aud_stream_open_ring_reply;
+
+/*
+ * The start of the memfd passed with OBOS_AUD_STREAM_OPEN_RING_REPLY,
+ * through SCM_RIGHTS, followed by an eventfd.
+ * The client writes audio at head, and the mixer takes it from tail, so
+ * it never goes through the socket. Both count bytes from the start of the
+ * stream, and wrap around at 2^32. Before waiting on the eventfd for room,
+ * the client sets writer_waiting, and checks tail again. The server then
+ * signals the eventfd once it has read more, or once the stream is closed.
+ */
+typedef struct aud_shm_ring {
+    uint32_t size; /* of the data, always a power of two */
+    uint32_t data_offset; /* from the start of the ring */
+    uint32_t dead; /* set once the stream is closed */
+    ALIGNAS(64) uint32_t head;
+    uint32_t writer_waiting;
+    ALIGNAS(64) uint32_t tail;
+} aud_shm_ring;
+
+typedef struct aud_stream_credit_payload {
+    uint16_t stream_id;
+    /* added to the credits the client already has */
+    uint32_t credits;
+} PACK aud_stream_credit_payload;
+
 typedef struct aud_stream_get_flags_reply {
     uint32_t flags;
 } aud_stream_get_flags_reply;
@@ -136,6 +182,22 @@ typedef struct aud_open_stream_payload {
     float volume;
 } PACK aud_open_stream_payload;
 
+enum {
+    /*
+     * Successful DATA packets on the stream are not replied to. Instead, the
+     * client is granted credits, in bytes of audio it may send, with the
+     * open stream reply and then with OBOS_AUD_STREAM_CREDIT as the stream plays.
+     * A DATA packet that exceeds the client's credits fails with OBOS_AUD_STATUS_REPLY_INVAL.
+     */
+    OBOS_AUD_OPEN_STREAM_CREDITS = (1<<0),
+};
+
+/* Sent in place of aud_open_stream_payload to pass options. */
+typedef struct aud_open_stream_ex_payload {
+    aud_open_stream_payload info;
+    uint32_t options;
+} PACK aud_open_stream_ex_payload;
+
 typedef struct aud_set_volume_payload {
     /* The type of this id depends on the opcode. */
     union {
@@ -163,6 +225,37 @@ typedef struct aud_data_payload {
     char data[];
 } PACK aud_data_payload;
 
+/*
+ * The server keeps every payload at the alignment it has from the start of its
+ * packet, modulo this. Padding a header, with data_offset, so that audio starts
+ * a multiple of this many bytes into the packet has it land aligned.
+ */
+#define OBOS_AUD_PAYLOAD_ALIGNMENT 64
+/* The data_offset that puts the audio of a DATA packet on an 'align' byte boundary. */
+#define OBOS_AUD_ALIGNED_DATA_OFFSET(align) \
+    (((OBOS_AUD_BASE_PROTOCOL_HEADER_SIZE + sizeof(aud_data_payload) + (align) - 1) / (align)) * (align) - sizeof(aud_data_payload))
+
+/* The most entries one OBOS_AUD_DATAV packet can have. */
+#define OBOS_AUD_DATAV_MAX_ENTRIES 64
+
+typedef struct aud_datav_entry {
+    uint16_t stream_id;
+    /* where the entry's audio starts, counted from the end of the entry table */
+    uint32_t offset;
+    uint32_t length;
+} PACK aud_datav_entry;
+
+/*
+ * Entries are written in order, as if each was its own DATA packet, but the
+ * packet gets one reply, whether or not its streams are in credit mode.
+ * If any entry is invalid, or is over its stream's credits, nothing is written.
+ */
+typedef struct aud_datav_payload {
+    uint16_t nEntries;
+    aud_datav_entry entries[];
+    /* followed by the audio of every entry */
+} PACK aud_datav_payload;
+
 typedef struct aud_stream_set_flags_payload {
     uint16_t stream_id;
     uint32_t flags;
@@ -172,6 +265,12 @@ typedef struct aud_stream_get_flags_payload {
     uint16_t stream_id;
 } PACK aud_stream_get_flags_payload;
 
+typedef struct aud_stream_open_ring_payload {
+    uint16_t stream_id;
+    /* rounded up to a power of two, zero picks a default */
+    uint32_t size;
+} PACK aud_stream_open_ring_payload;
+
 typedef struct aud_set_name_payload {
     uint8_t resv;
     char name[];
@@ -206,18 +305,162 @@ typedef struct aud_packet
         const void* cpayload;
     };
     uint32_t payload_len;
+
+    /* Where the payload starts in the packet, padding the header. Zero
+     * means right after it. Only used when transmitting, and not by the server. */
+    uint32_t data_offset;
 } aud_packet;
 
 /* All functions return -1 on error, and >0 on success */
 
 int autrans_transmit(int fd, aud_packet* pckt);
+/* Sends a packet whose payload is gathered from iov, without copying it. pckt->payload is
+ * ignored, and pckt->payload_len is set to the length of the payload. */
+int autrans_transmitv(int fd, aud_packet* pckt, const struct iovec* iov, int iovcnt);
+/* Fills in the on-wire header for pckt, allocating a transmission id if needed. */
+void autrans_make_header(aud_header* hdr, aud_packet* pckt);
+/* Packets that came in while a function here waited for the reply to its own request,
+ * such as OBOS_AUD_STREAM_CREDIT, are returned first, oldest first. */
 int autrans_receive(int fd, aud_packet* pckt, void* sockaddr, socklen_t *sockaddr_len);
+
+/* How much autrans_rx reads at once by default. */
+#define AUTRANS_RX_DEFAULT_SIZE (64*1024)
+/*
+ * Buffers what is received on a socket, so that several packets are parsed out of
+ * each read, and a small reply takes one syscall. Once a socket has one, all of its
+ * packets have to be received through it.
+ */
+typedef struct autrans_rx {
+    int fd;
+    char* buf;
+    size_t size, start, len;
+    /* file descriptors received along with the buffered data, oldest first */
+    int fds[4];
+    int nFds;
+} autrans_rx;
+/* size is how much is read at once, zero picks AUTRANS_RX_DEFAULT_SIZE. */
+int autrans_rx_init(autrans_rx* rx, int fd, size_t size);
+/* Frees the buffer, and closes the file descriptors never taken. The socket is left open. */
+void autrans_rx_free(autrans_rx* rx);
+/*
+ * Receives the next packet. Without storage, its payload points into the buffer,
+ * and is only good until the next call. Otherwise the payload goes into storage,
+ * and if it is more than storage_len bytes, the call fails with EMSGSIZE, leaving
+ * the packet to be received again.
+ */
+int autrans_rx_receive(autrans_rx* rx, aud_packet* pckt, void* storage, size_t storage_len);
+/* Takes up to max of the file descriptors received so far, and returns how many were taken. */
+int autrans_rx_take_fds(autrans_rx* rx, int* fds, int max);
+
+/*
+ * Requests submitted on an autrans_conn don't wait for their replies, so any
+ * number of them can be in flight at once. Replies are matched to requests by
+ * transmission id as they are received, by autrans_conn_dispatch or autrans_wait.
+ * A connection can be shared between threads: any of them can submit, and wait on
+ * their own requests, while one at a time receives for all of them.
+ */
+typedef struct autrans_request autrans_request;
+/*
+ * Called once a request is done. reply is NULL if the connection failed first,
+ * and its payload is only good until the callback returns. For packets that aren't
+ * replies to any request, such as OBOS_AUD_STREAM_CREDIT, req is NULL. It is called
+ * on whichever thread received the packet.
+ */
+typedef void(*autrans_callback)(autrans_request* req, const aud_packet* reply, void* udata);
+
+struct autrans_tx_chunk;
+
+typedef struct autrans_conn {
+    int fd;
+    uint32_t client_id;
+    /* the last transmission id given to a packet submitted without one */
+    uint32_t next_trans_id;
+    /* held while sending, so that packets from different threads aren't interleaved */
+    pthread_mutex_t send_lock;
+    /* protects the requests and receiving */
+    pthread_mutex_t lock;
+    /* broadcast when a request is done, or a thread is done receiving */
+    pthread_cond_t cond;
+    /* set while a thread is receiving on the connection's behalf */
+    bool receiving;
+    /* unused if buf is NULL, in which case nothing past the packet being received is read */
+    autrans_rx rx;
+    /* requests waiting on their replies, oldest first */
+    autrans_request *head, *tail;
+    /* called with the packets that aren't replies to a request, which are otherwise dropped */
+    autrans_callback on_event;
+    void* event_udata;
+    /* see autrans_conn_set_nonblocking */
+    bool nonblocking;
+    /* what non-blocking submits couldn't send yet, oldest first */
+    struct autrans_tx_chunk *tx_head, *tx_tail;
+} autrans_conn;
+
+/* rx_size is passed to autrans_rx_init. */
+int autrans_conn_init(autrans_conn* conn, int fd, uint32_t client_id, size_t rx_size);
+/* Fails the requests still in flight. The socket is left open. */
+void autrans_conn_free(autrans_conn* conn);
+/*
+ * Sends pckt with the connection's client id, and returns the request waiting on
+ * its reply, or NULL on error. If pckt has no transmission id, it is given the
+ * connection's next one. callback is optional. The request has to be freed
+ * with autrans_request_free, which can be done before it is done.
+ */
+autrans_request* autrans_submit(autrans_conn* conn, aud_packet* pckt, autrans_callback callback, void* udata);
+/* Same as autrans_submit, with the payload gathered from iov as in autrans_transmitv. */
+autrans_request* autrans_submitv(autrans_conn* conn, aud_packet* pckt, const struct iovec* iov, int iovcnt, autrans_callback callback, void* udata);
+/* Receives one packet, and completes the request it replies to. */
+int autrans_conn_dispatch(autrans_conn* conn);
+/* Dispatches packets until req is done, and returns autrans_request_status(req). */
+int autrans_wait(autrans_conn* conn, autrans_request* req);
+/*
+ * Puts the socket in non-blocking mode, for event loops. Submitting then never
+ * blocks, queueing whatever the socket won't take, and packets are received by
+ * autrans_conn_process, never by autrans_conn_dispatch or autrans_wait. The
+ * connection has to have a receive buffer.
+ */
+int autrans_conn_set_nonblocking(autrans_conn* conn, bool nonblocking);
+/* The poll(2) events to wait for on conn->fd, POLLIN, and POLLOUT while anything is queued. */
+int autrans_conn_events(autrans_conn* conn);
+/*
+ * Sends what it can of the queue, on POLLOUT, and receives and dispatches every
+ * packet it can, on POLLIN, without blocking. Fails all requests in flight if the
+ * connection fails.
+ */
+int autrans_conn_process(autrans_conn* conn, int revents);
+bool autrans_request_done(const autrans_request* req);
+/* NULL until the request is done, or if the connection failed. */
+const aud_packet* autrans_request_reply(const autrans_request* req);
+/* -1 if the request failed, or got an error status, and 0 otherwise. */
+int autrans_request_status(const autrans_request* req);
+void autrans_request_free(autrans_request* req);
+
 int autrans_initial_connection_request(int fd);
 int autrans_set_name(int fd, uint32_t client_id, const char* name);
 int autrans_stream_open(int fd, uint32_t client_id, const aud_open_stream_payload* payload, uint16_t* stream_id, uint32_t* stream_flags);
 // *flags is set to the real flags on return.
 int autrans_stream_flags(int socket, uint32_t client_id, uint16_t stream_id, uint32_t* flags);
 int autrans_stream_data(int socket, uint32_t client_id, uint16_t stream_id, const void* data, size_t len);
+/* Same as autrans_stream_data, with the audio gathered from iov. */
+int autrans_stream_datav(int socket, uint32_t client_id, uint16_t stream_id, const struct iovec* iov, int iovcnt);
+/* One piece of audio for autrans_stream_data_multi. */
+typedef struct autrans_stream_chunk {
+    uint16_t stream_id;
+    const void* data;
+    size_t len;
+} autrans_stream_chunk;
+/* Writes to up to OBOS_AUD_DATAV_MAX_ENTRIES streams with one OBOS_AUD_DATAV packet, and waits for its reply.
+ * Every chunk is sent aligned to OBOS_AUD_PAYLOAD_ALIGNMENT. */
+int autrans_stream_data_multi(int socket, uint32_t client_id, const autrans_stream_chunk* chunks, size_t count);
+/* Opens a stream with OBOS_AUD_OPEN_STREAM_CREDITS. *credits is set to the initial credits. */
+int autrans_stream_open_credited(int fd, uint32_t client_id, const aud_open_stream_payload* payload, uint16_t* stream_id, uint32_t* stream_flags, uint32_t* credits);
+int autrans_stream_close(int socket, uint32_t client_id, uint16_t stream_id);
+/* Waits for more credits on a credit-mode stream, and adds them to *credits.
+ * Credits received for other streams on the socket are kept until they are waited on.
+ * Fails if an earlier DATA packet failed. */
+int autrans_stream_wait_credits(int socket, uint32_t client_id, uint16_t stream_id, uint32_t* credits);
+/* Writes to a credit-mode stream without waiting for a reply, waiting for credits as needed. */
+int autrans_stream_data_credited(int socket, uint32_t client_id, uint16_t stream_id, const void* data, size_t len, uint32_t* credits);
 int autrans_stream_set_volume(int socket, uint32_t client_id, uint16_t stream_id, float volume);
 int autrans_stream_get_volume(int socket, uint32_t client_id, uint16_t stream_id, float* volume);
 int autrans_output_set_volume(int socket, uint32_t client_id, uint16_t output_id, float volume);
@@ -248,4 +491,71 @@ char* autrans_make_name(const char* name, bool take_basename);
 
 const char* autrans_opcode_to_string(uint32_t opcode);
 
+/* A stream's shared ring, as mapped by the client. */
+typedef struct autrans_ring {
+    aud_shm_ring* ring;
+    char* data;
+    size_t map_size;
+    int event_fd;
+} autrans_ring;
+
+/* Sets up a shared ring for the stream. Only works on unix: connections,
+ * and not for planar or ADPCM streams. */
+int autrans_stream_open_ring(int fd, uint32_t client_id, uint16_t stream_id, uint32_t size, autrans_ring* ring);
+/* Copies audio into the ring, waiting for room as needed.
+ * Fails with EPIPE once the stream is closed. */
+int autrans_ring_write(autrans_ring* ring, const void* data, size_t len);
+void autrans_ring_close(autrans_ring* ring);
+
+/* The latency autrans_writer_open picks if given zero, in ms. */
+#define AUTRANS_WRITER_DEFAULT_LATENCY 50
+/*
+ * Sends audio to a stream from a background thread, keeping only about latency_ms
+ * of it buffered by the server, going by the credits it grants. Writes of any size
+ * are buffered, blocking while the writer holds twice the latency.
+ */
+typedef struct autrans_writer autrans_writer;
+/*
+ * Opens a stream with OBOS_AUD_OPEN_STREAM_CREDITS to write to. The writer's thread
+ * receives from the socket until it is closed, so nothing else may in the meantime.
+ */
+autrans_writer* autrans_writer_open(int fd, uint32_t client_id, const aud_open_stream_payload* info, uint32_t* stream_flags, uint32_t latency_ms);
+uint16_t autrans_writer_stream_id(const autrans_writer* w);
+/* Fails once the writer's thread did, such as when the server rejected a write. */
+int autrans_writer_write(autrans_writer* w, const void* data, size_t len);
+/* Waits until everything written was sent, and then played by the server. */
+int autrans_writer_drain(autrans_writer* w);
+/* Stops the thread, dropping whatever wasn't sent yet. The stream and socket are left open. */
+void autrans_writer_close(autrans_writer* w);
+
+/*
+ * IMA/DVI ADPCM, as used by OBOS_AUD_STREAM_FLAGS_ADPCM_DECODE.
+ * Every sample is coded as a 4-bit nibble, low nibble first, with
+ * channels interleaved per sample. Coder state carries over from one
+ * DATA packet to the next, and starts out zeroed.
+ */
+typedef struct autrans_adpcm_state {
+    int channels;
+    int next_channel;
+    bool has_pending; /* encoder only */
+    uint8_t pending_sample;
+    struct {
+        int32_t predictor;
+        int32_t step_index;
+    } ch[];
+} autrans_adpcm_state;
+#define autrans_adpcm_state_size(channels) (sizeof(autrans_adpcm_state) + (channels)*sizeof(((autrans_adpcm_state*)0)->ch[0]))
+
+autrans_adpcm_state* autrans_adpcm_create(int channels);
+void autrans_adpcm_reset(autrans_adpcm_state* state);
+void autrans_adpcm_free(autrans_adpcm_state* state);
+/* out must have room for (nSamples+1)/2 bytes. An odd trailing sample is
+ * held back for the next call. Returns the amount of bytes written. */
+size_t autrans_adpcm_encode(autrans_adpcm_state* state, const int16_t* samples, size_t nSamples, uint8_t* out);
+/* Writes out any held back sample, padded with one extra sample.
+ * Only to be used at the end of a stream. Returns the amount of bytes written. */
+size_t autrans_adpcm_flush(autrans_adpcm_state* state, uint8_t* out);
+/* out must have room for len*2 samples. Returns the amount of samples written. */
+size_t autrans_adpcm_decode(autrans_adpcm_state* state, const uint8_t* data, size_t len, int16_t* out);
+
 #define OBOS_AUD_TCP_PORT 44630
\ No newline at end of file
@@ -0,0 +1,169 @@
+/*
+ * libautrans/adpcm.c
+ *
+ * Copyright (c) 2025 Omar Berrow
+ */
+
+#include <obos-aud/trans.h>
+#include <obos-aud/compiler.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+static const int16_t step_table[89] = {
+        7,     8,     9,    10,    11,    12,    13,    14,    16,    17,
+       19,    21,    23,    25,    28,    31,    34,    37,    41,    45,
+       50,    55,    60,    66,    73,    80,    88,    97,   107,   118,
+      130,   143,   157,   173,   190,   209,   230,   253,   279,   307,
+      337,   371,   408,   449,   494,   544,   598,   658,   724,   796,
+      876,   963,  1060,  1166,  1282,  1411,  1552,  1707,  1878,  2066,
+     2272,  2499,  2749,  3024,  3327,  3660,  4026,  4428,  4871,  5358,
+     5894,  6484,  7132,  7845,  8630,  9493, 10442, 11487, 12635, 13899,
+    15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767,
+};
+
+static const int8_t index_table[16] = {
+    -1, -1, -1, -1, 2, 4, 6, 8,
+    -1, -1, -1, -1, 2, 4, 6, 8,
+};
+
+autrans_adpcm_state* autrans_adpcm_create(int channels)
+{
+    if (channels <= 0)
+        return NULL;
+    autrans_adpcm_state* state = malloc(autrans_adpcm_state_size(channels));
+    if (!state)
+        return NULL;
+    state->channels = channels;
+    autrans_adpcm_reset(state);
+    return state;
+}
+
+void autrans_adpcm_reset(autrans_adpcm_state* state)
+{
+    state->next_channel = 0;
+    state->has_pending = false;
+    state->pending_sample = 0;
+    memset(state->ch, 0, state->channels*sizeof(*state->ch));
+}
+
+void autrans_adpcm_free(autrans_adpcm_state* state)
+{
+    free(state);
+}
+
+// Applies a code to the channel's predictor, and returns the new predictor.
+static int16_t apply_code(autrans_adpcm_state* state, int channel, uint8_t code)
+{
+    int32_t predictor = state->ch[channel].predictor;
+    int32_t index = state->ch[channel].step_index;
+    int32_t step = step_table[index];
+
+    int32_t diff = step >> 3;
+    if (code & 4)
+        diff += step;
+    if (code & 2)
+        diff += step >> 1;
+    if (code & 1)
+        diff += step >> 2;
+    predictor += (code & 8) ? -diff : diff;
+    if (predictor > INT16_MAX)
+        predictor = INT16_MAX;
+    else if (predictor < INT16_MIN)
+        predictor = INT16_MIN;
+
+    index += index_table[code];
+    if (index < 0)
+        index = 0;
+    else if (index > 88)
+        index = 88;
+
+    state->ch[channel].predictor = predictor;
+    state->ch[channel].step_index = index;
+    return predictor;
+}
+
+static uint8_t encode_sample(autrans_adpcm_state* state, int16_t sample)
+{
+    int channel = state->next_channel;
+    state->next_channel = (channel + 1) % state->channels;
+
+    int32_t diff = sample - state->ch[channel].predictor;
+    int32_t step = step_table[state->ch[channel].step_index];
+    uint8_t code = 0;
+    if (diff < 0)
+    {
+        code = 8;
+        diff = -diff;
+    }
+    if (diff >= step)
+    {
+        code |= 4;
+        diff -= step;
+    }
+    step >>= 1;
+    if (diff >= step)
+    {
+        code |= 2;
+        diff -= step;
+    }
+    step >>= 1;
+    if (diff >= step)
+        code |= 1;
+
+    // Track what the decoder will see.
+    apply_code(state, channel, code);
+    return code;
+}
+
+size_t autrans_adpcm_encode(autrans_adpcm_state* state, const int16_t* samples, size_t nSamples, uint8_t* out)
+{
+    size_t nWritten = 0;
+    size_t i = 0;
+    if (state->has_pending && nSamples)
+    {
+        out[nWritten++] = state->pending_sample | (encode_sample(state, samples[i++]) << 4);
+        state->has_pending = false;
+    }
+    for (; i + 1 < nSamples; i += 2)
+    {
+        uint8_t lo = encode_sample(state, samples[i]);
+        uint8_t hi = encode_sample(state, samples[i+1]);
+        out[nWritten++] = lo | (hi << 4);
+    }
+    if (i < nSamples)
+    {
+        // Hold the odd sample's code back until the next call.
+        state->pending_sample = encode_sample(state, samples[i]);
+        state->has_pending = true;
+    }
+    return nWritten;
+}
+
+size_t autrans_adpcm_flush(autrans_adpcm_state* state, uint8_t* out)
+{
+    if (!state->has_pending)
+        return 0;
+    // Pad with a zero code, which the decoder will still apply.
+    int channel = state->next_channel;
+    state->next_channel = (channel + 1) % state->channels;
+    apply_code(state, channel, 0);
+    out[0] = state->pending_sample;
+    state->has_pending = false;
+    return 1;
+}
+
+size_t autrans_adpcm_decode(autrans_adpcm_state* state, const uint8_t* data, size_t len, int16_t* out)
+{
+    size_t nSamples = 0;
+    for (size_t i = 0; i < len; i++)
+    {
+        for (int shift = 0; shift <= 4; shift += 4)
+        {
+            int channel = state->next_channel;
+            state->next_channel = (channel + 1) % state->channels;
+            out[nSamples++] = apply_code(state, channel, (data[i] >> shift) & 0xf);
+        }
+    }
+    return nSamples;
+}
@@ -13,12 +13,16 @@
 #include <obos-aud/compiler.h>
 
 #include <stdlib.h>
+#include <assert.h>
 #include <string.h>
 #include <unistd.h>
 #include <time.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
 
 #include <sys/param.h>
+#include <sys/mman.h>
 
 #include <sys/socket.h>
 #include <sys/un.h>
@@ -27,25 +31,18 @@
 static uint32_t next_trans_id()
 {
     static uint32_t iter = 0;
-    return ++iter;
+    return __atomic_add_fetch(&iter, 1, __ATOMIC_RELAXED);
 }
 
-int autrans_transmit(int fd, aud_packet* pckt)
+void autrans_make_header(aud_header* hdr, aud_packet* pckt)
 {
-    if (!pckt || fd <= 0)
-    {
-        errno = EINVAL;
-        return -1;
-    }
-
-    aud_header* hdr = malloc(pckt->payload_len+sizeof(*hdr));
-    assert(hdr);
     memset(hdr, 0, sizeof(*hdr));
 
     hdr->magic = aud_hton32(OBOS_AUD_HEADER_MAGIC);
     
-    hdr->size = aud_hton32(pckt->payload_len+sizeof(*hdr));
-    hdr->data_offset = aud_hton32(sizeof(*hdr));
+    uint32_t data_offset = MAX(pckt->data_offset, sizeof(*hdr));
+    hdr->size = aud_hton32(pckt->payload_len+data_offset);
+    hdr->data_offset = aud_hton32(data_offset);
 
     hdr->opcode = aud_hton32(pckt->opcode);
     
@@ -55,189 +52,1119 @@ int autrans_transmit(int fd, aud_packet* pckt)
         hdr->trans_id = aud_hton32(next_trans_id());
     pckt->transmission_id = hdr->trans_id;
     hdr->client_id = pckt->client_id;
+}
 
-    if (pckt->payload_len)
-        memcpy(hdr->payload, pckt->cpayload, pckt->payload_len);
+// Sent to pad headers out to their data_offset, and DATAV chunks out to their alignment.
+static const char s_zeroes[4096];
+
+// Fills in hdr, and sets msg up to send it, its padding, and iov. Returns the size of the
+// packet. msg->msg_iov is either local, which has room for 16, or has to be freed.
+static ssize_t packet_msg(aud_packet* pckt, aud_header* hdr, const struct iovec* iov, int iovcnt, struct iovec* local, struct msghdr* msg)
+{
+    if (!pckt || iovcnt < 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    size_t payload_len = 0;
+    for (int i = 0; i < iovcnt; i++)
+        payload_len += iov[i].iov_len;
+    size_t data_offset = MAX(pckt->data_offset, sizeof(aud_header));
+    if (payload_len > OBOS_AUD_MAX_PACKET_SIZE - data_offset || data_offset - sizeof(aud_header) > sizeof(s_zeroes))
+    {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    pckt->payload_len = payload_len;
+    autrans_make_header(hdr, pckt);
+
+    // The header and its padding go in front of the payload.
+    int nVec = iovcnt + 2;
+    struct iovec* vec = nVec <= 16 ? local : malloc(nVec*sizeof(*vec));
+    if (!vec)
+        return -1;
+    vec[0].iov_base = hdr;
+    vec[0].iov_len = sizeof(*hdr);
+    vec[1].iov_base = (void*)s_zeroes;
+    vec[1].iov_len = data_offset - sizeof(*hdr);
+    if (iovcnt)
+        memcpy(vec + 2, iov, iovcnt*sizeof(*iov));
+
+    memset(msg, 0, sizeof(*msg));
+    msg->msg_iov = vec;
+    msg->msg_iovlen = nVec;
+    return data_offset + payload_len;
+}
 
-    int nTransmitted = 0;
-    int nLeft = hdr->size;
+// Drops nSent bytes off the front of msg's iovecs.
+static void msg_advance(struct msghdr* msg, size_t nSent)
+{
+    while (msg->msg_iovlen && nSent >= msg->msg_iov->iov_len)
+    {
+        nSent -= msg->msg_iov->iov_len;
+        msg->msg_iov++;
+        msg->msg_iovlen--;
+    }
+    if (nSent)
+    {
+        msg->msg_iov->iov_base = (char*)msg->msg_iov->iov_base + nSent;
+        msg->msg_iov->iov_len -= nSent;
+    }
+}
 
-    while (nTransmitted != aud_hton32(hdr->size))
+// Sends len bytes from msg, and returns how many were. With MSG_DONTWAIT, this stops
+// once the socket is full, and what is left is in msg.
+static ssize_t send_msg(int fd, struct msghdr* msg, size_t len, int flags)
+{
+    size_t nSent = 0;
+    while (nSent < len)
     {
-        int ret = TEMP_FAILURE_RETRY(send(fd, ((char*)hdr) + nTransmitted, nLeft, 0));
+        ssize_t ret = TEMP_FAILURE_RETRY(sendmsg(fd, msg, flags));
         if (ret < 0)
         {
-            free(hdr);
-            return ret;
+            if ((flags & MSG_DONTWAIT) && (errno == EAGAIN || errno == EWOULDBLOCK))
+                break;
+            return -1;
         }
-        nTransmitted += ret;
-        nLeft -= ret;
+        nSent += ret;
+        msg_advance(msg, ret);
     }
-
-    free(hdr);
-    return nTransmitted;
+    return nSent;
 }
 
-int autrans_receive(int fd, aud_packet* pckt, void* sockaddr, socklen_t *sockaddr_len)
+int autrans_transmitv(int fd, aud_packet* pckt, const struct iovec* iov, int iovcnt)
 {
-    if (!pckt || fd <= 0)
+    if (fd <= 0)
     {
         errno = EINVAL;
         return -1;
     }
-    int err = 0;
+
     aud_header hdr = {};
-    uint32_t offset = 0;
+    struct iovec local[16];
+    struct msghdr msg = {};
+    ssize_t len = packet_msg(pckt, &hdr, iov, iovcnt, local, &msg);
+    if (len < 0)
+        return -1;
+    struct iovec* vec = msg.msg_iov;
+    ssize_t res = send_msg(fd, &msg, len, 0);
+    if (vec != local)
+        free(vec);
+    return res < 0 ? -1 : len;
+}
 
-    err = TEMP_FAILURE_RETRY(recvfrom(fd, &hdr, sizeof(hdr.magic)+sizeof(hdr.data_offset), MSG_WAITALL, sockaddr, sockaddr_len));
-    if (err < 0)
-        return err;
-    if (err == 0)
+int autrans_transmit(int fd, aud_packet* pckt)
+{
+    if (!pckt)
     {
-        errno = ECONNRESET;
+        errno = EINVAL;
         return -1;
     }
-    hdr.magic = aud_ntoh32(hdr.magic);
-    if (hdr.magic != OBOS_AUD_HEADER_MAGIC)
+    struct iovec iov = { .iov_base=(void*)pckt->cpayload, .iov_len=pckt->payload_len };
+    return autrans_transmitv(fd, pckt, &iov, pckt->payload_len ? 1 : 0);
+}
+
+typedef union rights_control {
+    char buf[CMSG_SPACE(sizeof(int)*4)];
+    struct cmsghdr align;
+} rights_control;
+
+// Moves the file descriptors received with msg into fds, closing any past max.
+static void take_rights(struct msghdr* msg, int* fds, int* nFds, int max)
+{
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg))
     {
-        errno = EINVAL;
-        return -1;
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+        size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (size_t i = 0; i < count; i++)
+        {
+            int curr = 0;
+            memcpy(&curr, CMSG_DATA(cmsg) + i*sizeof(int), sizeof(int));
+            if (*nFds < max)
+                fds[(*nFds)++] = curr;
+            else
+                close(curr);
+        }
+    }
+}
+
+// Receives the start of a packet, along with up to *nFds file descriptors sent with it.
+static int receive_start(int fd, void* buf, size_t len, void* sockaddr, socklen_t *sockaddr_len, int* fds, int* nFds)
+{
+    rights_control control;
+    struct iovec iov = {.iov_base=buf,.iov_len=len};
+    struct msghdr msg = {};
+    msg.msg_name = sockaddr;
+    msg.msg_namelen = sockaddr_len ? *sockaddr_len : 0;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    int max = 0;
+    if (fds)
+    {
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+        max = *nFds;
+        *nFds = 0;
     }
-    hdr.data_offset = aud_ntoh32(hdr.data_offset);
-    offset += sizeof(hdr.data_offset)+sizeof(hdr.magic);
+    int res = TEMP_FAILURE_RETRY(recvmsg(fd, &msg, MSG_WAITALL|MSG_CMSG_CLOEXEC));
+    if (res < 0)
+        return res;
+    if (sockaddr_len)
+        *sockaddr_len = msg.msg_namelen;
+    if (fds)
+        take_rights(&msg, fds, nFds, max);
+    return res;
+}
 
+// Byte swaps, and checks, a received header.
+static bool parse_header(aud_header* hdr, aud_packet* pckt)
+{
+    hdr->magic = aud_ntoh32(hdr->magic);
+    hdr->data_offset = aud_ntoh32(hdr->data_offset);
+    hdr->size = aud_ntoh32(hdr->size);
+    hdr->opcode = aud_ntoh32(hdr->opcode);
     // In no protocol version is the header
     // size less than this many bytes 
-    if (hdr.data_offset < OBOS_AUD_BASE_PROTOCOL_HEADER_SIZE)
+    if (hdr->magic != OBOS_AUD_HEADER_MAGIC || hdr->data_offset < OBOS_AUD_BASE_PROTOCOL_HEADER_SIZE || hdr->size < hdr->data_offset)
+    {
+        errno = EINVAL;
+        return false;
+    }
+    pckt->transmission_id = hdr->trans_id;
+    pckt->transmission_id_valid = true;
+    pckt->client_id = hdr->client_id;
+    pckt->opcode = hdr->opcode;
+    pckt->payload = NULL;
+    pckt->payload_len = hdr->size - hdr->data_offset;
+    return true;
+}
+
+static int receive(int fd, aud_packet* pckt, void* sockaddr, socklen_t *sockaddr_len, int* fds, int* nFds)
+{
+    if (!pckt || fd <= 0)
     {
         errno = EINVAL;
         return -1;
     }
 
-    // Read the base protocol fields.
-    err = TEMP_FAILURE_RETRY(recv(fd, ((char*)&hdr)+offset, OBOS_AUD_BASE_PROTOCOL_HEADER_SIZE-offset, MSG_WAITALL));
+    aud_header hdr = {};
+    int err = receive_start(fd, &hdr, sizeof(hdr), sockaddr, sockaddr_len, fds, nFds);
     if (err < 0)
         return err;
-    if (err == 0)
+    if (err != sizeof(hdr))
     {
         errno = ECONNRESET;
         return -1;
     }
-    hdr.size = aud_ntoh32(hdr.size);
-    hdr.opcode = aud_ntoh32(hdr.opcode);
-    pckt->transmission_id = hdr.trans_id;
-    pckt->transmission_id_valid = true;
-    pckt->client_id = hdr.client_id;
-    pckt->opcode = hdr.opcode;
+    if (!parse_header(&hdr, pckt))
+        return -1;
+    size_t skip = hdr.data_offset - sizeof(hdr);
+    if (!pckt->payload_len && !skip)
+        return 0;
+
+    // We currently do not know of any more header fields.
+    // They are skipped along with reading the payload.
+    char sink[64];
+    while (skip > sizeof(sink))
+    {
+        err = TEMP_FAILURE_RETRY(recv(fd, sink, sizeof(sink), MSG_WAITALL));
+        if (err <= 0)
+        {
+            if (err == 0)
+                errno = ECONNRESET;
+            return -1;
+        }
+        skip -= err;
+    }
 
-    if (!(hdr.size - hdr.data_offset))
+    if (pckt->payload_len)
     {
+        pckt->payload = malloc(pckt->payload_len);
+        if (!pckt->payload)
+            return -1;
+    }
+    struct iovec iov[2] = {
+        { .iov_base=sink, .iov_len=skip },
+        { .iov_base=pckt->payload, .iov_len=pckt->payload_len },
+    };
+    struct msghdr msg = {};
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    err = TEMP_FAILURE_RETRY(recvmsg(fd, &msg, MSG_WAITALL));
+    if (err < 0 || (size_t)err != skip + pckt->payload_len)
+    {
+        free(pckt->payload);
         pckt->payload = NULL;
         pckt->payload_len = 0;
-        return 0;
+        if (err >= 0)
+            errno = ECONNRESET;
+        return -1;
     }
-    offset += (OBOS_AUD_BASE_PROTOCOL_HEADER_SIZE-offset);
+    return 0;
+}
 
-    // We currently do not know of any more fields.
-    // Read the rest of the header, then the payload.
+// Packets that came in while a synchronous request waited for its reply, such as
+// OBOS_AUD_STREAM_CREDIT. autrans_receive returns them, oldest first, before reading more.
+typedef struct held_packet {
+    int fd;
+    aud_packet pckt;
+    struct held_packet *next;
+} held_packet;
+static struct {
+    held_packet *head, *tail;
+    pthread_mutex_t lock;
+} s_held_packets = {.lock=PTHREAD_MUTEX_INITIALIZER};
+
+// An autrans_callback for the packets that aren't replies to a request, with the socket as udata.
+static void hold_packet(autrans_request* req, const aud_packet* pckt, void* udata)
+{
+    held_packet* ent = calloc(1, sizeof(*ent));
+    assert(ent);
+    ent->fd = (int)(intptr_t)udata;
+    ent->pckt = *pckt;
+    if (pckt->payload_len)
+    {
+        ent->pckt.payload = malloc(pckt->payload_len);
+        assert(ent->pckt.payload);
+        memcpy(ent->pckt.payload, pckt->payload, pckt->payload_len);
+    }
+    else
+        ent->pckt.payload = NULL;
+    pthread_mutex_lock(&s_held_packets.lock);
+    if (s_held_packets.tail)
+        s_held_packets.tail->next = ent;
+    else
+        s_held_packets.head = ent;
+    s_held_packets.tail = ent;
+    pthread_mutex_unlock(&s_held_packets.lock);
+}
+
+// Unlinks ent, which comes after prev. s_held_packets.lock must be held.
+static void unlink_held_packet(held_packet* prev, held_packet* ent)
+{
+    if (prev)
+        prev->next = ent->next;
+    else
+        s_held_packets.head = ent->next;
+    if (s_held_packets.tail == ent)
+        s_held_packets.tail = prev;
+}
+
+// Takes the oldest packet held for the socket.
+static bool take_held_packet(int fd, aud_packet* pckt)
+{
+    pthread_mutex_lock(&s_held_packets.lock);
+    held_packet* prev = NULL;
+    held_packet* ent = s_held_packets.head;
+    for (; ent && ent->fd != fd; ent = ent->next)
+        prev = ent;
+    if (ent)
+        unlink_held_packet(prev, ent);
+    pthread_mutex_unlock(&s_held_packets.lock);
+    if (!ent)
+        return false;
+    *pckt = ent->pckt;
+    free(ent);
+    return true;
+}
+
+static void drop_held_packets(int fd, uint32_t client_id)
+{
+    pthread_mutex_lock(&s_held_packets.lock);
+    held_packet* prev = NULL;
+    for (held_packet* ent = s_held_packets.head; ent; )
+    {
+        held_packet* next = ent->next;
+        if (ent->fd == fd && ent->pckt.client_id == client_id)
+        {
+            unlink_held_packet(prev, ent);
+            free(ent->pckt.payload);
+            free(ent);
+        }
+        else
+            prev = ent;
+        ent = next;
+    }
+    pthread_mutex_unlock(&s_held_packets.lock);
+}
 
-    pckt->payload_len = hdr.size - hdr.data_offset; 
-    pckt->payload = malloc(pckt->payload_len);
+int autrans_receive(int fd, aud_packet* pckt, void* sockaddr, socklen_t *sockaddr_len)
+{
+    if (pckt && take_held_packet(fd, pckt))
+        return 0;
+    return receive(fd, pckt, sockaddr, sockaddr_len, NULL, NULL);
+}
 
-    if (hdr.data_offset - sizeof(hdr))
+// Reads until at least want bytes are buffered, making room for them as needed.
+static bool rx_fill(autrans_rx* rx, size_t want)
+{
+    if (rx->start == rx->len)
+        rx->start = rx->len = 0;
+    while (rx->len - rx->start < want)
     {
-        void* sink = malloc(hdr.data_offset - sizeof(hdr));
-        err = TEMP_FAILURE_RETRY(recv(fd, sink, hdr.data_offset - sizeof(hdr), MSG_WAITALL));
-        if (err < 0)
+        if (rx->start && rx->size - rx->start < want)
         {
-            free(sink);
-            free(pckt->payload);
-            pckt->payload = NULL;
-            pckt->payload_len = 0;
-            return err;
+            memmove(rx->buf, rx->buf + rx->start, rx->len - rx->start);
+            rx->len -= rx->start;
+            rx->start = 0;
         }
-        if (err == 0)
+        if (rx->size < want)
+        {
+            char* buf = realloc(rx->buf, want);
+            if (!buf)
+                return false;
+            rx->buf = buf;
+            rx->size = want;
+        }
+
+        rights_control control;
+        struct iovec iov = { .iov_base=rx->buf + rx->len, .iov_len=rx->size - rx->len };
+        struct msghdr msg = {};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+        ssize_t res = TEMP_FAILURE_RETRY(recvmsg(rx->fd, &msg, MSG_CMSG_CLOEXEC));
+        if (res < 0)
+            return false;
+        if (res == 0)
         {
-            free(sink);
-            free(pckt->payload);
-            pckt->payload = NULL;
-            pckt->payload_len = 0;
             errno = ECONNRESET;
+            return false;
+        }
+        take_rights(&msg, rx->fds, &rx->nFds, sizeof(rx->fds)/sizeof(*rx->fds));
+        rx->len += res;
+    }
+    return true;
+}
+
+int autrans_rx_init(autrans_rx* rx, int fd, size_t size)
+{
+    memset(rx, 0, sizeof(*rx));
+    rx->fd = fd;
+    rx->size = size ? size : AUTRANS_RX_DEFAULT_SIZE;
+    rx->buf = malloc(rx->size);
+    return rx->buf ? 0 : -1;
+}
+
+void autrans_rx_free(autrans_rx* rx)
+{
+    for (int i = 0; i < rx->nFds; i++)
+        close(rx->fds[i]);
+    free(rx->buf);
+    memset(rx, 0, sizeof(*rx));
+}
+
+int autrans_rx_receive(autrans_rx* rx, aud_packet* pckt, void* storage, size_t storage_len)
+{
+    if (!rx_fill(rx, sizeof(aud_header)))
+        return -1;
+    aud_header hdr = {};
+    memcpy(&hdr, rx->buf + rx->start, sizeof(hdr));
+    aud_packet res = {};
+    if (!parse_header(&hdr, &res))
+        return -1;
+    if (storage && res.payload_len > storage_len)
+    {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    if (!storage)
+    {
+        if (!rx_fill(rx, hdr.size))
+            return -1;
+        if (res.payload_len)
+            res.payload = rx->buf + rx->start + hdr.data_offset;
+        rx->start += hdr.size;
+        *pckt = res;
+        return 0;
+    }
+
+    // Whatever isn't buffered yet is received straight into storage.
+    if (!rx_fill(rx, hdr.data_offset))
+        return -1;
+    rx->start += hdr.data_offset;
+    size_t nCopy = MIN(rx->len - rx->start, res.payload_len);
+    memcpy(storage, rx->buf + rx->start, nCopy);
+    rx->start += nCopy;
+    while (nCopy < res.payload_len)
+    {
+        ssize_t nRead = TEMP_FAILURE_RETRY(recv(rx->fd, (char*)storage + nCopy, res.payload_len - nCopy, MSG_WAITALL));
+        if (nRead <= 0)
+        {
+            if (nRead == 0)
+                errno = ECONNRESET;
             return -1;
         }
-        free(sink);
+        nCopy += nRead;
     }
+    if (res.payload_len)
+        res.payload = storage;
+    *pckt = res;
+    return 0;
+}
 
-    err = TEMP_FAILURE_RETRY(recv(fd, pckt->payload, pckt->payload_len, MSG_WAITALL));
-    if (err < 0)
-        return err;
-    if (err == 0)
+int autrans_rx_take_fds(autrans_rx* rx, int* fds, int max)
+{
+    int n = MIN(max, rx->nFds);
+    memcpy(fds, rx->fds, n*sizeof(int));
+    memmove(rx->fds, rx->fds + n, (rx->nFds - n)*sizeof(int));
+    rx->nFds -= n;
+    return n;
+}
+
+// Takes the next packet out of the buffer, if all of it was received, with its payload
+// pointing into the buffer. Returns 1 if it did, 0 if more has to be read, and -1 on error.
+static int rx_take_buffered(autrans_rx* rx, aud_packet* pckt)
+{
+    if (rx->len - rx->start < sizeof(aud_header))
+        return 0;
+    aud_header hdr = {};
+    memcpy(&hdr, rx->buf + rx->start, sizeof(hdr));
+    aud_packet res = {};
+    if (!parse_header(&hdr, &res))
+        return -1;
+    if (rx->len - rx->start < hdr.size)
+        return 0;
+    if (res.payload_len)
+        res.payload = rx->buf + rx->start + hdr.data_offset;
+    rx->start += hdr.size;
+    *pckt = res;
+    return 1;
+}
+
+// Reads whatever the socket has, without blocking, making room as needed.
+static ssize_t rx_read_nonblock(autrans_rx* rx)
+{
+    if (rx->start == rx->len)
+        rx->start = rx->len = 0;
+    if (rx->len == rx->size)
+    {
+        if (rx->start)
+        {
+            memmove(rx->buf, rx->buf + rx->start, rx->len - rx->start);
+            rx->len -= rx->start;
+            rx->start = 0;
+        }
+        else
+        {
+            // One packet is bigger than the buffer.
+            char* buf = realloc(rx->buf, rx->size * 2);
+            if (!buf)
+                return -1;
+            rx->buf = buf;
+            rx->size *= 2;
+        }
+    }
+
+    rights_control control;
+    struct iovec iov = { .iov_base=rx->buf + rx->len, .iov_len=rx->size - rx->len };
+    struct msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    ssize_t res = TEMP_FAILURE_RETRY(recvmsg(rx->fd, &msg, MSG_DONTWAIT|MSG_CMSG_CLOEXEC));
+    if (res == 0)
     {
         errno = ECONNRESET;
         return -1;
     }
-    return 0;
+    if (res > 0)
+    {
+        take_rights(&msg, rx->fds, &rx->nFds, sizeof(rx->fds)/sizeof(*rx->fds));
+        rx->len += res;
+    }
+    return res;
 }
 
-int autrans_initial_connection_request(int fd)
+/* What a non-blocking connection has yet to send. */
+struct autrans_tx_chunk {
+    size_t len, off;
+    struct autrans_tx_chunk* next;
+    char data[];
+};
+
+struct autrans_request {
+    uint32_t transmission_id;
+    /* cleared once the request is done, after which it can be freed without it */
+    autrans_conn* conn;
+    bool done;
+    /* autrans_request_free was called before the request was done */
+    bool released;
+    /* the reply, with its payload copied out; opcode is zero if the connection failed */
+    aud_packet reply;
+    autrans_callback callback;
+    void* udata;
+    struct autrans_request *next, *prev;
+};
+
+static void conn_setup(autrans_conn* conn, int fd, uint32_t client_id)
 {
-    aud_packet pckt = {.opcode=OBOS_AUD_INITIAL_CONNECTION_REQUEST};
-    return autrans_transmit(fd, &pckt);
+    memset(conn, 0, sizeof(*conn));
+    conn->fd = fd;
+    conn->client_id = client_id;
+    pthread_mutex_init(&conn->lock, NULL);
+    pthread_mutex_init(&conn->send_lock, NULL);
+    pthread_cond_init(&conn->cond, NULL);
 }
 
-int autrans_set_name(int fd, uint32_t client_id, const char* name)
+int autrans_conn_init(autrans_conn* conn, int fd, uint32_t client_id, size_t rx_size)
 {
-    if (!name)
+    conn_setup(conn, fd, client_id);
+    return autrans_rx_init(&conn->rx, fd, rx_size);
+}
+
+static void request_remove(autrans_conn* conn, autrans_request* req)
+{
+    if (req->next)
+        req->next->prev = req->prev;
+    if (req->prev)
+        req->prev->next = req->next;
+    if (conn->head == req)
+        conn->head = req->next;
+    if (conn->tail == req)
+        conn->tail = req->prev;
+    req->next = req->prev = NULL;
+}
+
+// Takes req off the connection, and hands it the reply, or NULL if the connection failed.
+// conn->lock must be held, and is dropped while the callback runs.
+static void request_complete(autrans_conn* conn, autrans_request* req, const aud_packet* reply)
+{
+    request_remove(conn, req);
+    if (req->callback)
+    {
+        pthread_mutex_unlock(&conn->lock);
+        req->callback(req, reply, req->udata);
+        pthread_mutex_lock(&conn->lock);
+    }
+    if (req->released)
+    {
+        free(req);
+        return;
+    }
+    if (reply)
+    {
+        req->reply = *reply;
+        req->reply.payload = NULL;
+        if (reply->payload_len)
+        {
+            req->reply.payload = malloc(reply->payload_len);
+            assert(req->reply.payload);
+            memcpy(req->reply.payload, reply->payload, reply->payload_len);
+        }
+    }
+    __atomic_store_n(&req->done, true, __ATOMIC_RELEASE);
+    // The request can be freed by another thread as soon as this is cleared.
+    __atomic_store_n(&req->conn, NULL, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&conn->cond);
+}
+
+// conn->lock must be held.
+static void fail_requests(autrans_conn* conn)
+{
+    int err = errno;
+    while (conn->head)
+        request_complete(conn, conn->head, NULL);
+    errno = err;
+}
+
+void autrans_conn_free(autrans_conn* conn)
+{
+    pthread_mutex_lock(&conn->lock);
+    fail_requests(conn);
+    pthread_mutex_unlock(&conn->lock);
+    while (conn->tx_head)
+    {
+        struct autrans_tx_chunk* next = conn->tx_head->next;
+        free(conn->tx_head);
+        conn->tx_head = next;
+    }
+    autrans_rx_free(&conn->rx);
+    pthread_mutex_destroy(&conn->lock);
+    pthread_mutex_destroy(&conn->send_lock);
+    pthread_cond_destroy(&conn->cond);
+    memset(conn, 0, sizeof(*conn));
+    conn->fd = -1;
+}
+
+// Sends as much of the queue as the socket takes.
+// conn->send_lock must be held.
+static bool flush_tx(autrans_conn* conn)
+{
+    while (conn->tx_head)
+    {
+        struct iovec vec[16];
+        size_t len = 0;
+        int nVec = 0;
+        for (struct autrans_tx_chunk* chunk = conn->tx_head; chunk && nVec < 16; chunk = chunk->next)
+        {
+            vec[nVec].iov_base = chunk->data + chunk->off;
+            vec[nVec++].iov_len = chunk->len - chunk->off;
+            len += chunk->len - chunk->off;
+        }
+        struct msghdr msg = {.msg_iov=vec,.msg_iovlen=nVec};
+        ssize_t nSent = send_msg(conn->fd, &msg, len, MSG_DONTWAIT);
+        if (nSent < 0)
+            return false;
+
+        size_t nLeft = nSent;
+        while (conn->tx_head && nLeft >= conn->tx_head->len - conn->tx_head->off)
+        {
+            nLeft -= conn->tx_head->len - conn->tx_head->off;
+            struct autrans_tx_chunk* next = conn->tx_head->next;
+            free(conn->tx_head);
+            if (!(conn->tx_head = next))
+                conn->tx_tail = NULL;
+        }
+        if (conn->tx_head)
+            conn->tx_head->off += nLeft;
+        // The socket is full.
+        if ((size_t)nSent < len)
+            break;
+    }
+    return true;
+}
+
+// Sends what it can of the packet right away, as long as nothing is queued in front of it,
+// and copies the rest onto the queue. conn->send_lock must be held.
+static int submit_nonblock(autrans_conn* conn, aud_packet* pckt, const struct iovec* iov, int iovcnt)
+{
+    aud_header hdr = {};
+    struct iovec local[16];
+    struct msghdr msg = {};
+    ssize_t len = packet_msg(pckt, &hdr, iov, iovcnt, local, &msg);
+    if (len < 0)
         return -1;
+    struct iovec* vec = msg.msg_iov;
+    ssize_t nSent = conn->tx_head ? 0 : send_msg(conn->fd, &msg, len, MSG_DONTWAIT);
+    if (nSent >= 0 && nSent < len)
+    {
+        struct autrans_tx_chunk* chunk = malloc(sizeof(*chunk) + len - nSent);
+        assert(chunk);
+        chunk->len = len - nSent;
+        chunk->off = 0;
+        chunk->next = NULL;
+        size_t off = 0;
+        for (size_t i = 0; i < msg.msg_iovlen; i++)
+        {
+            memcpy(chunk->data + off, msg.msg_iov[i].iov_base, msg.msg_iov[i].iov_len);
+            off += msg.msg_iov[i].iov_len;
+        }
+        if (conn->tx_tail)
+            conn->tx_tail->next = chunk;
+        else
+            conn->tx_head = chunk;
+        conn->tx_tail = chunk;
+    }
+    if (vec != local)
+        free(vec);
+    return nSent < 0 ? -1 : 0;
+}
 
-    size_t payload_len = strlen(name)+1;
-    aud_set_name_payload *payload = malloc(payload_len);
-    payload->resv = 0;
-    memcpy(payload->name, name, payload_len-1);
+autrans_request* autrans_submitv(autrans_conn* conn, aud_packet* pckt, const struct iovec* iov, int iovcnt, autrans_callback callback, void* udata)
+{
+    pckt->client_id = conn->client_id;
+    if (!pckt->transmission_id_valid)
+    {
+        pckt->transmission_id = aud_hton32(__atomic_add_fetch(&conn->next_trans_id, 1, __ATOMIC_RELAXED));
+        pckt->transmission_id_valid = true;
+    }
+
+    autrans_request* req = calloc(1, sizeof(*req));
+    assert(req);
+    req->conn = conn;
+    req->transmission_id = pckt->transmission_id;
+    req->callback = callback;
+    req->udata = udata;
+    // Another thread could receive the reply before this one is done sending.
+    pthread_mutex_lock(&conn->lock);
+    if (conn->tail)
+        conn->tail->next = req;
+    else
+        conn->head = req;
+    req->prev = conn->tail;
+    conn->tail = req;
+    pthread_mutex_unlock(&conn->lock);
+
+    pthread_mutex_lock(&conn->send_lock);
+    int res = conn->nonblocking ?
+        submit_nonblock(conn, pckt, iov, iovcnt) :
+        autrans_transmitv(conn->fd, pckt, iov, iovcnt);
+    pthread_mutex_unlock(&conn->send_lock);
+    if (res >= 0)
+        return req;
+
+    int err = errno;
+    pthread_mutex_lock(&conn->lock);
+    // It may have been failed already, along with the connection.
+    if (!req->done)
+        request_remove(conn, req);
+    pthread_mutex_unlock(&conn->lock);
+    free(req->reply.payload);
+    free(req);
+    errno = err;
+    return NULL;
+}
+
+autrans_request* autrans_submit(autrans_conn* conn, aud_packet* pckt, autrans_callback callback, void* udata)
+{
+    struct iovec iov = { .iov_base=pckt->payload, .iov_len=pckt->payload_len };
+    return autrans_submitv(conn, pckt, &iov, pckt->payload_len ? 1 : 0, callback, udata);
+}
 
+// conn->lock must be held, and is dropped while callbacks run.
+static void dispatch_packet(autrans_conn* conn, const aud_packet* pckt)
+{
+    // Replies mostly come in the order the requests were sent. Events are numbered
+    // by the server, so their ids can match one of ours.
+    autrans_request* req = pckt->opcode == OBOS_AUD_STREAM_CREDIT ? NULL : conn->head;
+    while (req && req->transmission_id != pckt->transmission_id)
+        req = req->next;
+    if (req)
+        request_complete(conn, req, pckt);
+    else if (conn->on_event)
+    {
+        pthread_mutex_unlock(&conn->lock);
+        conn->on_event(NULL, pckt, conn->event_udata);
+        pthread_mutex_lock(&conn->lock);
+    }
+}
+
+// Receives one packet, and dispatches it. conn->lock must be held, and is dropped while
+// receiving. Only one thread receives at a time, the others wait on conn->cond.
+static int receive_one(autrans_conn* conn)
+{
+    conn->receiving = true;
+    pthread_mutex_unlock(&conn->lock);
     aud_packet pckt = {};
-    pckt.client_id = client_id;
-    pckt.opcode = OBOS_AUD_SET_NAME;
-    pckt.payload_len = payload_len;
-    pckt.cpayload = payload;
-    pckt.transmission_id_valid = false;
-    int res = autrans_transmit(fd, &pckt);
+    int res = 0;
+    if (conn->rx.buf)
+        res = autrans_rx_receive(&conn->rx, &pckt, NULL, 0);
+    else
+    {
+        // Without a buffer, file descriptors are still kept in rx for autrans_rx_take_fds.
+        int nFds = sizeof(conn->rx.fds)/sizeof(*conn->rx.fds) - conn->rx.nFds;
+        res = receive(conn->fd, &pckt, NULL, NULL, conn->rx.fds + conn->rx.nFds, &nFds);
+        conn->rx.nFds += nFds;
+    }
+    pthread_mutex_lock(&conn->lock);
     if (res < 0)
+        fail_requests(conn);
+    else
+        dispatch_packet(conn, &pckt);
+    if (!conn->rx.buf)
+        free(pckt.payload);
+    conn->receiving = false;
+    pthread_cond_broadcast(&conn->cond);
+    return res;
+}
+
+int autrans_conn_dispatch(autrans_conn* conn)
+{
+    if (conn->nonblocking)
     {
-        free(payload);
-        return res;
+        errno = EINVAL;
+        return -1;
     }
+    pthread_mutex_lock(&conn->lock);
+    while (conn->receiving)
+        pthread_cond_wait(&conn->cond, &conn->lock);
+    int res = receive_one(conn);
+    pthread_mutex_unlock(&conn->lock);
+    return res;
+}
 
-    aud_packet reply = {};
-    res = autrans_receive(fd, &reply, NULL, NULL);
+int autrans_conn_set_nonblocking(autrans_conn* conn, bool nonblocking)
+{
+    pthread_mutex_lock(&conn->send_lock);
+    int res = -1;
+    // Packets have to be parsed out of whatever was read so far.
+    if (!conn->rx.buf || (!nonblocking && conn->tx_head))
+        errno = EINVAL;
+    else
+    {
+        int flags = fcntl(conn->fd, F_GETFL);
+        flags = nonblocking ? flags|O_NONBLOCK : flags & ~O_NONBLOCK;
+        if (flags >= 0 && fcntl(conn->fd, F_SETFL, flags) == 0)
+        {
+            conn->nonblocking = nonblocking;
+            res = 0;
+        }
+    }
+    pthread_mutex_unlock(&conn->send_lock);
+    return res;
+}
+
+int autrans_conn_events(autrans_conn* conn)
+{
+    pthread_mutex_lock(&conn->send_lock);
+    int events = POLLIN | (conn->tx_head ? POLLOUT : 0);
+    pthread_mutex_unlock(&conn->send_lock);
+    return events;
+}
+
+int autrans_conn_process(autrans_conn* conn, int revents)
+{
+    if (!conn->nonblocking)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    int res = 0;
+    if (revents & (POLLOUT|POLLERR|POLLHUP))
+    {
+        pthread_mutex_lock(&conn->send_lock);
+        if (!flush_tx(conn))
+            res = -1;
+        pthread_mutex_unlock(&conn->send_lock);
+    }
+
+    pthread_mutex_lock(&conn->lock);
+    // Whichever thread is receiving already reads until the socket is empty.
+    if (res == 0 && (revents & (POLLIN|POLLERR|POLLHUP)) && !conn->receiving)
+    {
+        conn->receiving = true;
+        while (1)
+        {
+            aud_packet pckt = {};
+            while ((res = rx_take_buffered(&conn->rx, &pckt)) > 0)
+                dispatch_packet(conn, &pckt);
+            if (res < 0)
+                break;
+            if (rx_read_nonblock(&conn->rx) < 0)
+            {
+                if (errno != EAGAIN && errno != EWOULDBLOCK)
+                    res = -1;
+                break;
+            }
+        }
+        conn->receiving = false;
+        pthread_cond_broadcast(&conn->cond);
+    }
     if (res < 0)
+        fail_requests(conn);
+    pthread_mutex_unlock(&conn->lock);
+    return res;
+}
+
+int autrans_wait(autrans_conn* conn, autrans_request* req)
+{
+    if (conn->nonblocking)
     {
-        free(payload);
-        return res;
+        errno = EINVAL;
+        return -1;
     }
-    free(payload);
+    pthread_mutex_lock(&conn->lock);
+    int res = 0;
+    while (!req->done && res == 0)
+    {
+        if (conn->receiving)
+            pthread_cond_wait(&conn->cond, &conn->lock);
+        else
+            res = receive_one(conn);
+    }
+    pthread_mutex_unlock(&conn->lock);
+    return res < 0 ? -1 : autrans_request_status(req);
+}
+
+bool autrans_request_done(const autrans_request* req)
+{
+    return __atomic_load_n(&req->done, __ATOMIC_ACQUIRE);
+}
+
+const aud_packet* autrans_request_reply(const autrans_request* req)
+{
+    return autrans_request_done(req) && req->reply.opcode ? &req->reply : NULL;
+}
+
+int autrans_request_status(const autrans_request* req)
+{
+    if (!autrans_request_done(req) || !req->reply.opcode)
+        return -1;
+    uint32_t opcode = req->reply.opcode;
+    if (opcode > OBOS_AUD_STATUS_REPLY_OK && opcode < OBOS_AUD_STATUS_REPLY_CEILING)
+        return -1;
+    return 0;
+}
+
+void autrans_request_free(autrans_request* req)
+{
+    if (!req)
+        return;
+    autrans_conn* conn = __atomic_load_n(&req->conn, __ATOMIC_ACQUIRE);
+    if (conn)
+    {
+        pthread_mutex_lock(&conn->lock);
+        bool done = req->done;
+        // Otherwise, it is freed once it is done, and its callback returned.
+        if (!done)
+            req->released = true;
+        pthread_mutex_unlock(&conn->lock);
+        if (!done)
+            return;
+    }
+    free(req->reply.payload);
+    free(req);
+}
+
+// Prints why a request failed, given its reply.
+static void report_reply(const char* what, const aud_packet* reply)
+{
+    if (!reply)
+        perror(what);
+    else if (reply->opcode >= OBOS_AUD_STATUS_REPLY_OK && reply->opcode < OBOS_AUD_STATUS_REPLY_CEILING)
+    {
+        fprintf(stderr, "While %s: %s\n", what, autrans_opcode_to_string(reply->opcode));
+        if (reply->payload_len)
+            fprintf(stderr, "Extra info: %.*s\n", reply->payload_len, (char*)reply->payload);
+    }
+    else
+        fprintf(stderr, "While %s: Unexpected %s from server (payload length=%d)\n", what, autrans_opcode_to_string(reply->opcode), reply->payload_len);
+}
+
+/*
+ * Sends pckt and waits for its reply, which is moved into *reply. Anything else
+ * received in the meantime is held for autrans_receive. Fails, printing why, unless
+ * the reply's opcode is expected. If fds is given, up to *nFds file descriptors
+ * received along the way are moved into it, and *nFds is set to how many.
+ */
+static int transactv(int fd, uint32_t client_id, aud_packet* pckt, const struct iovec* iov, int iovcnt, uint32_t expected, aud_packet* reply, const char* what, int* fds, int* nFds)
+{
+    // Nothing is read ahead, so that other calls on the socket still see what comes after the reply.
+    autrans_conn conn;
+    conn_setup(&conn, fd, client_id);
+    conn.on_event = hold_packet;
+    conn.event_udata = (void*)(intptr_t)fd;
+    // Keeps ids unique across the calls made on the same socket.
+    if (!pckt->transmission_id_valid)
+    {
+        pckt->transmission_id = aud_hton32(next_trans_id());
+        pckt->transmission_id_valid = true;
+    }
+    autrans_request* req = iov ?
+        autrans_submitv(&conn, pckt, iov, iovcnt, NULL, NULL) :
+        autrans_submit(&conn, pckt, NULL, NULL);
+    if (!req)
+    {
+        perror("autrans_transmit");
+        return -1;
+    }
+
+    int res = -1;
+    autrans_wait(&conn, req);
+    const aud_packet* got = autrans_request_reply(req);
+    if (got && got->opcode == expected)
+    {
+        res = 0;
+        if (reply)
+        {
+            *reply = req->reply;
+            req->reply.payload = NULL;
+        }
+    }
+    else
+        report_reply(what, got);
+    if (fds)
+        *nFds = autrans_rx_take_fds(&conn.rx, fds, *nFds);
+    autrans_request_free(req);
+    autrans_conn_free(&conn);
+    return res;
+}
+
+static int transact(int fd, uint32_t client_id, aud_packet* pckt, uint32_t expected, aud_packet* reply, const char* what)
+{
+    return transactv(fd, client_id, pckt, NULL, 0, expected, reply, what, NULL, NULL);
+}
+
+// Credits received while waiting for those of another stream on the same socket.
+typedef struct stashed_credits {
+    int fd;
+    uint32_t client_id;
+    uint16_t stream_id;
+    uint32_t credits;
+    struct stashed_credits *next;
+} stashed_credits;
+static struct {
+    stashed_credits *head;
+    pthread_mutex_t lock;
+} s_stashed_credits = {.lock=PTHREAD_MUTEX_INITIALIZER};
+
+static void stash_credits(int fd, uint32_t client_id, uint16_t stream_id, uint32_t credits)
+{
+    pthread_mutex_lock(&s_stashed_credits.lock);
+    stashed_credits* ent = s_stashed_credits.head;
+    while (ent && (ent->fd != fd || ent->client_id != client_id || ent->stream_id != stream_id))
+        ent = ent->next;
+    if (!ent)
+    {
+        ent = calloc(1, sizeof(*ent));
+        assert(ent);
+        ent->fd = fd;
+        ent->client_id = client_id;
+        ent->stream_id = stream_id;
+        ent->next = s_stashed_credits.head;
+        s_stashed_credits.head = ent;
+    }
+    ent->credits += credits;
+    pthread_mutex_unlock(&s_stashed_credits.lock);
+}
+
+// Takes the credits stashed for a stream. Every stream of the client if all_streams is set.
+static uint32_t take_credits(int fd, uint32_t client_id, uint16_t stream_id, bool all_streams)
+{
+    uint32_t credits = 0;
+    pthread_mutex_lock(&s_stashed_credits.lock);
+    for (stashed_credits** iter = &s_stashed_credits.head; *iter; )
+    {
+        stashed_credits* ent = *iter;
+        if (ent->fd != fd || ent->client_id != client_id || (!all_streams && ent->stream_id != stream_id))
+        {
+            iter = &ent->next;
+            continue;
+        }
+        credits += ent->credits;
+        *iter = ent->next;
+        free(ent);
+    }
+    pthread_mutex_unlock(&s_stashed_credits.lock);
+    return credits;
+}
+
+int autrans_initial_connection_request(int fd)
+{
+    aud_packet pckt = {.opcode=OBOS_AUD_INITIAL_CONNECTION_REQUEST};
+    return autrans_transmit(fd, &pckt);
+}
+
+int autrans_set_name(int fd, uint32_t client_id, const char* name)
+{
+    if (!name)
+        return -1;
+
+    size_t payload_len = strlen(name)+1;
+    aud_set_name_payload *payload = malloc(payload_len);
+    payload->resv = 0;
+    memcpy(payload->name, name, payload_len-1);
 
-    if (__builtin_expect(reply.opcode == OBOS_AUD_STATUS_REPLY_OK, true))
-    {
-        free(reply.payload);
-        return 0;
-    }
-    
-    if (reply.opcode >= OBOS_AUD_STATUS_REPLY_OK && reply.opcode < OBOS_AUD_STATUS_REPLY_CEILING)
-    {
-        fprintf(stderr, "While setting stream flags: %s\n", autrans_opcode_to_string(reply.opcode));
-        if (reply.payload_len)
-            fprintf(stderr, "Extra info: %.*s\n", reply.payload_len, (char*)reply.payload);
-    }
-    else
-        fprintf(stderr, "While setting stream flags: Unexpected %s from server (payload length=%d)\n", autrans_opcode_to_string(reply.opcode), reply.payload_len);
-    free(reply.payload);
-    return -1;
+    aud_packet pckt = {};
+    pckt.opcode = OBOS_AUD_SET_NAME;
+    pckt.payload_len = payload_len;
+    pckt.cpayload = payload;
+    int res = transact(fd, client_id, &pckt, OBOS_AUD_STATUS_REPLY_OK, NULL, "setting name");
+    free(payload);
+    return res;
 }
 
 int autrans_disconnect(int fd, uint32_t client_id)
 {
     aud_packet pckt = {.opcode=OBOS_AUD_DISCONNECT_REQUEST,.client_id=client_id};
+    take_credits(fd, client_id, 0, true);
+    drop_held_packets(fd, client_id);
     return autrans_transmit(fd, &pckt);
 }
 
@@ -259,41 +1186,23 @@ int autrans_query_output_parameters(int fd, uint32_t client_id, uint16_t output_
     aud_query_output_parameters_payload payload = {.output_id=output_id};
     aud_packet pckt = {
         .opcode = OBOS_AUD_QUERY_OUTPUT_PARAMETERS,
-        .client_id = client_id,
         .payload = &payload,
         .payload_len = sizeof(payload),
     };
-    int res = autrans_transmit(fd, &pckt);
-    if (res < 0)
-        return res;
-
     aud_packet reply = {};
-    res = autrans_receive(fd, &reply, NULL, NULL);
-    if (res < 0)
-        return res;
+    if (transact(fd, client_id, &pckt, OBOS_AUD_QUERY_OUTPUT_PARAMETERS_REPLY, &reply, "querying output parameters") < 0)
+        return -1;
 
-    if (__builtin_expect(reply.opcode == OBOS_AUD_QUERY_OUTPUT_PARAMETERS_REPLY, true))
-    {
-        if (reply.payload_len < sizeof(aud_query_output_parameters_reply))
-        {
-            fprintf(stderr, "While opening stream: Invalid reply payload length! (got 0 bytes, expected %ld bytes)\n", sizeof(aud_query_output_parameters_reply));\
-            return -1;
-        }
-        memcpy(oreply, reply.payload, MIN(sizeof(*oreply), reply.payload_len));
-        free(reply.payload);
-        return 0;
-    }
-    
-    if (reply.opcode >= OBOS_AUD_STATUS_REPLY_OK && reply.opcode < OBOS_AUD_STATUS_REPLY_CEILING)
+    int res = 0;
+    if (reply.payload_len < sizeof(aud_query_output_parameters_reply))
     {
-        fprintf(stderr, "While setting stream flags: %s\n", autrans_opcode_to_string(reply.opcode));
-        if (reply.payload_len)
-            fprintf(stderr, "Extra info: %.*s\n", reply.payload_len, (char*)reply.payload);
+        fprintf(stderr, "While querying output parameters: Invalid reply payload length! (got %d bytes, expected %ld bytes)\n", reply.payload_len, sizeof(aud_query_output_parameters_reply));
+        res = -1;
     }
     else
-        fprintf(stderr, "While setting stream flags: Unexpected %s from server (payload length=%d)\n", autrans_opcode_to_string(reply.opcode), reply.payload_len);
+        memcpy(oreply, reply.payload, sizeof(*oreply));
     free(reply.payload);
-    return -1;
+    return res;
 }
 
 int autrans_query_connections(int fd, uint32_t client_id, struct aud_connection_desc** descs, size_t *desc_count)
@@ -301,342 +1210,397 @@ int autrans_query_connections(int fd, uint32_t client_id, struct aud_connection_
     if (!descs || !desc_count)
         return -1;
 
-    aud_packet pckt = {};
-    pckt.client_id = client_id;
-    pckt.opcode = OBOS_AUD_QUERY_CONNECTIONS;
-    pckt.payload_len = 0;
-    pckt.cpayload = NULL;
-    pckt.transmission_id_valid = false;
-    int res = autrans_transmit(fd, &pckt);
-    if (res < 0)
-        return res;
-
+    // The server replies with the request's own opcode.
+    aud_packet pckt = {.opcode=OBOS_AUD_QUERY_CONNECTIONS};
     aud_packet reply = {};
-    res = autrans_receive(fd, &reply, NULL, NULL);
-    if (res < 0)
-        return res;
+    if (transact(fd, client_id, &pckt, OBOS_AUD_QUERY_CONNECTIONS, &reply, "querying connections") < 0)
+        return -1;
 
-    if (__builtin_expect(reply.opcode == OBOS_AUD_QUERY_CONNECTIONS, true))
+    aud_query_connections_reply* payload = reply.payload;
+    if (reply.payload_len < sizeof(aud_query_connections_reply) || payload->arr_offset > reply.payload_len)
     {
-        if (reply.payload_len < sizeof(aud_query_connections_reply))
-        {
-            fprintf(stderr, "While opening stream: Invalid reply payload length! (got 0 bytes, expected at least %ld bytes)\n", sizeof(aud_query_connections_reply));\
-            return -1;
-        }
-        aud_query_connections_reply* payload = reply.payload;
-        *desc_count = payload->desc_count;
-        *descs = malloc(reply.payload_len - payload->arr_offset);
-        memcpy(*descs, ((char*)payload) + payload->arr_offset, reply.payload_len - payload->arr_offset);
+        fprintf(stderr, "While querying connections: Invalid reply payload length! (got %d bytes, expected at least %ld bytes)\n", reply.payload_len, sizeof(aud_query_connections_reply));
         free(payload);
-        return 0;
+        return -1;
     }
-    
-    if (reply.opcode >= OBOS_AUD_STATUS_REPLY_OK && reply.opcode < OBOS_AUD_STATUS_REPLY_CEILING)
+    *desc_count = payload->desc_count;
+    *descs = malloc(reply.payload_len - payload->arr_offset);
+    memcpy(*descs, ((char*)payload) + payload->arr_offset, reply.payload_len - payload->arr_offset);
+    free(payload);
+    return 0;
+}
+
+int autrans_set_default_output(int socket, uint32_t client_id, uint16_t output_id)
+{
+    aud_set_default_output_payload payload = {.output_id=output_id};
+    aud_packet pckt = {};
+    pckt.opcode = OBOS_AUD_SET_DEFAULT_OUTPUT;
+    pckt.payload = &payload;
+    pckt.payload_len = sizeof(payload);
+    return transact(socket, client_id, &pckt, OBOS_AUD_STATUS_REPLY_OK, NULL, "setting the default output");
+}
+
+int autrans_stream_flags(int socket, uint32_t client_id, uint16_t stream_id, uint32_t* flags)
+{
+    aud_stream_set_flags_payload set_payload = {.stream_id=stream_id,.flags=*flags};
+    aud_packet pckt = {};
+    pckt.opcode = OBOS_AUD_STREAM_SET_FLAGS;
+    pckt.payload = &set_payload;
+    pckt.payload_len = sizeof(set_payload);
+    if (transact(socket, client_id, &pckt, OBOS_AUD_STATUS_REPLY_OK, NULL, "setting stream flags") < 0)
+        return -1;
+
+    aud_stream_get_flags_payload get_payload = {.stream_id=stream_id};
+    aud_packet reply = {};
+    pckt = (aud_packet){};
+    pckt.opcode = OBOS_AUD_STREAM_GET_FLAGS;
+    pckt.payload = &get_payload;
+    pckt.payload_len = sizeof(get_payload);
+    if (transact(socket, client_id, &pckt, OBOS_AUD_STREAM_GET_FLAGS_REPLY, &reply, "fetching stream flags") < 0)
     {
-        fprintf(stderr, "While setting stream flags: %s\n", autrans_opcode_to_string(reply.opcode));
-        if (reply.payload_len)
-            fprintf(stderr, "Extra info: %.*s\n", reply.payload_len, (char*)reply.payload);
+        errno = EOPNOTSUPP;
+        return -1;
     }
-    else
-        fprintf(stderr, "While setting stream flags: Unexpected %s from server (payload length=%d)\n", autrans_opcode_to_string(reply.opcode), reply.payload_len);
+    if (reply.payload_len < sizeof(aud_stream_get_flags_reply))
+    {
+        free(reply.payload);
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+    aud_stream_get_flags_reply* reply_payload = reply.payload;
+    *flags = reply_payload->flags;
     free(reply.payload);
-    return -1;
+    errno = 0;
+    return 0;
 }
 
-int autrans_set_default_output(int socket, uint32_t client_id, uint16_t output_id)
+int autrans_stream_datav(int socket, uint32_t client_id, uint16_t stream_id, const struct iovec* iov, int iovcnt)
 {
-    int res = 0;
-    do {
-        aud_set_default_output_payload payload = {};
-        payload.output_id = output_id;
+    aud_data_payload payload = {};
+    payload.stream_id = stream_id;
 
-        aud_packet reply = {};
-        aud_packet pckt = {};
-        pckt.opcode = OBOS_AUD_SET_DEFAULT_OUTPUT;
-        pckt.client_id = client_id;
-        pckt.payload = &payload;
-        pckt.payload_len = sizeof(payload);
-        if (autrans_transmit(socket, &pckt) < 0)
-        {
-            perror("autrans_transmit");
-            return -1;
-        }
-    
-        if ((res = autrans_receive(socket, &reply, NULL, 0)) < 0)
-            break;
-        if (__builtin_expect(reply.opcode == OBOS_AUD_STATUS_REPLY_OK, true))
-            continue;
-    
-        if (reply.opcode >= OBOS_AUD_STATUS_REPLY_OK && reply.opcode < OBOS_AUD_STATUS_REPLY_CEILING)
-        {
-            fprintf(stderr, "While setting stream flags: %s\n", autrans_opcode_to_string(reply.opcode));
-            if (reply.payload_len)
-                fprintf(stderr, "Extra info: %.*s\n", reply.payload_len, (char*)reply.payload);
-        }
-        else
-            fprintf(stderr, "While setting stream flags: Unexpected %s from server (payload length=%d)\n", autrans_opcode_to_string(reply.opcode), reply.payload_len);
-        free(reply.payload);
+    struct iovec local[16];
+    int nVec = iovcnt + 1;
+    struct iovec* vec = nVec <= 16 ? local : malloc(nVec*sizeof(*vec));
+    if (!vec)
         return -1;
-    } while(0);
+    vec[0].iov_base = &payload;
+    vec[0].iov_len = sizeof(payload);
+    if (iovcnt)
+        memcpy(vec + 1, iov, iovcnt*sizeof(*iov));
+
+    aud_packet pckt = {};
+    pckt.opcode = OBOS_AUD_DATA;
+    pckt.data_offset = OBOS_AUD_ALIGNED_DATA_OFFSET(OBOS_AUD_PAYLOAD_ALIGNMENT);
+    int res = transactv(socket, client_id, &pckt, vec, nVec, OBOS_AUD_STATUS_REPLY_OK, NULL, "writing to stream", NULL, NULL);
+    if (vec != local)
+        free(vec);
     return res;
 }
 
-int autrans_stream_flags(int socket, uint32_t client_id, uint16_t stream_id, uint32_t* flags)
+int autrans_stream_data(int socket, uint32_t client_id, uint16_t stream_id, const void* data, size_t len)
 {
-    int res = 0;
-    do {
-        aud_stream_set_flags_payload payload = {};
-        payload.stream_id = stream_id;
-        payload.flags = *flags;
+    struct iovec iov = { .iov_base=(void*)data, .iov_len=len };
+    return autrans_stream_datav(socket, client_id, stream_id, &iov, 1);
+}
 
-        aud_packet reply = {};
-        aud_packet pckt = {};
-        pckt.opcode = OBOS_AUD_STREAM_SET_FLAGS;
-        pckt.client_id = client_id;
-        pckt.payload = &payload;
-        pckt.payload_len = sizeof(payload);
-        if (autrans_transmit(socket, &pckt) < 0)
+int autrans_stream_data_multi(int socket, uint32_t client_id, const autrans_stream_chunk* chunks, size_t count)
+{
+    if (count > OBOS_AUD_DATAV_MAX_ENTRIES)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    char table_buf[sizeof(aud_datav_payload) + OBOS_AUD_DATAV_MAX_ENTRIES*sizeof(aud_datav_entry)];
+    aud_datav_payload* table = (aud_datav_payload*)table_buf;
+    size_t table_len = sizeof(aud_datav_payload) + count*sizeof(aud_datav_entry);
+
+    // The header is padded so that the audio starts aligned, and every chunk is padded to keep the next one so.
+    struct iovec vec[1 + 2*OBOS_AUD_DATAV_MAX_ENTRIES];
+    int nVec = 0;
+    vec[nVec].iov_base = table;
+    vec[nVec++].iov_len = table_len;
+    table->nEntries = count;
+    size_t offset = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        size_t padded = roundup(chunks[i].len, OBOS_AUD_PAYLOAD_ALIGNMENT);
+        if (offset + padded > UINT32_MAX)
         {
-            perror("autrans_transmit");
+            errno = EMSGSIZE;
             return -1;
         }
-    
-        if ((res = autrans_receive(socket, &reply, NULL, 0)) < 0)
-            break;
-        if (__builtin_expect(reply.opcode == OBOS_AUD_STATUS_REPLY_OK, true))
+        table->entries[i].stream_id = chunks[i].stream_id;
+        table->entries[i].offset = offset;
+        table->entries[i].length = chunks[i].len;
+        vec[nVec].iov_base = (void*)chunks[i].data;
+        vec[nVec++].iov_len = chunks[i].len;
+        vec[nVec].iov_base = (void*)s_zeroes;
+        vec[nVec++].iov_len = padded - chunks[i].len;
+        offset += padded;
+    }
+
+    aud_packet pckt = {};
+    pckt.opcode = OBOS_AUD_DATAV;
+    pckt.data_offset = roundup(sizeof(aud_header) + table_len, OBOS_AUD_PAYLOAD_ALIGNMENT) - table_len;
+    return transactv(socket, client_id, &pckt, vec, nVec, OBOS_AUD_STATUS_REPLY_OK, NULL, "writing to streams", NULL, NULL);
+}
+
+int autrans_stream_wait_credits(int socket, uint32_t client_id, uint16_t stream_id, uint32_t* credits)
+{
+    uint32_t stashed = take_credits(socket, client_id, stream_id, false);
+    if (stashed)
+    {
+        *credits += stashed;
+        return 0;
+    }
+
+    while (1)
+    {
+        aud_packet reply = {};
+        if (autrans_receive(socket, &reply, NULL, 0) < 0)
+            return -1;
+        if (reply.opcode == OBOS_AUD_STREAM_CREDIT && reply.payload_len >= sizeof(aud_stream_credit_payload))
+        {
+            aud_stream_credit_payload* payload = reply.payload;
+            // Credits for other streams are kept for whoever waits on them next.
+            bool ours = reply.client_id == client_id && payload->stream_id == stream_id;
+            if (ours)
+                *credits += payload->credits;
+            else
+                stash_credits(socket, reply.client_id, payload->stream_id, payload->credits);
+            free(reply.payload);
+            if (ours)
+                return 0;
             continue;
-    
+        }
+
+        // Only failed writes are replied to.
         if (reply.opcode >= OBOS_AUD_STATUS_REPLY_OK && reply.opcode < OBOS_AUD_STATUS_REPLY_CEILING)
         {
-            fprintf(stderr, "While setting stream flags: %s\n", autrans_opcode_to_string(reply.opcode));
+            fprintf(stderr, "While writing to stream: %s\n", autrans_opcode_to_string(reply.opcode));
             if (reply.payload_len)
                 fprintf(stderr, "Extra info: %.*s\n", reply.payload_len, (char*)reply.payload);
         }
         else
-            fprintf(stderr, "While setting stream flags: Unexpected %s from server (payload length=%d)\n", autrans_opcode_to_string(reply.opcode), reply.payload_len);
+            fprintf(stderr, "While writing to stream: Unexpected %s from server (payload length=%d)\n", autrans_opcode_to_string(reply.opcode), reply.payload_len);
         free(reply.payload);
         return -1;
-    } while(0);
-    do {
-        aud_stream_get_flags_payload payload = {};
-        payload.stream_id = stream_id;
+    }
+}
 
-        aud_packet reply = {};
+int autrans_stream_data_credited(int socket, uint32_t client_id, uint16_t stream_id, const void* data, size_t len, uint32_t* credits)
+{
+    aud_data_payload payload = {};
+    payload.stream_id = stream_id;
+
+    const char* iter = data;
+    while (len)
+    {
+        if (!*credits && autrans_stream_wait_credits(socket, client_id, stream_id, credits) < 0)
+            return -1;
+
+        size_t nToWrite = MIN(len, *credits);
+        struct iovec iov[2] = {
+            { .iov_base=&payload, .iov_len=sizeof(payload) },
+            { .iov_base=(void*)iter, .iov_len=nToWrite },
+        };
         aud_packet pckt = {};
-        pckt.opcode = OBOS_AUD_STREAM_GET_FLAGS;
+        pckt.opcode = OBOS_AUD_DATA;
         pckt.client_id = client_id;
-        pckt.payload = &payload;
-        pckt.payload_len = sizeof(payload);
-        if ((res = autrans_transmit(socket, &pckt)) < 0)
+        pckt.data_offset = OBOS_AUD_ALIGNED_DATA_OFFSET(OBOS_AUD_PAYLOAD_ALIGNMENT);
+        if (autrans_transmitv(socket, &pckt, iov, 2) < 0)
         {
             perror("autrans_transmit");
-            return res;
-        }
-    
-        if ((res = autrans_receive(socket, &reply, NULL, 0)) < 0)
-            return res;
-        
-        res = -1;
-        errno = EOPNOTSUPP;
-
-        if (reply.opcode >= OBOS_AUD_STATUS_REPLY_OK && reply.opcode < OBOS_AUD_STATUS_REPLY_CEILING)
-        {
-            fprintf(stderr, "While fetching stream flags: %s\n", autrans_opcode_to_string(reply.opcode));
-            if (reply.payload_len)
-                fprintf(stderr, "Extra info: %.*s\n", reply.payload_len, (char*)reply.payload);
-        }
-        else if (reply.opcode != OBOS_AUD_STREAM_GET_FLAGS_REPLY)
-            fprintf(stderr, "While fetching stream flags: Unexpected %s from server (payload length=%d)\n", autrans_opcode_to_string(reply.opcode), reply.payload_len);
-        else {
-            aud_stream_get_flags_reply* reply_payload = reply.payload;
-            *flags = reply_payload->flags;
-            errno = 0;
-            res = 0;
+            return -1;
         }
-        
-        free(reply.payload);
-    } while(0);
-    return res;
-
+        *credits -= nToWrite;
+        iter += nToWrite;
+        len -= nToWrite;
+    }
+    return 0;
 }
 
-int autrans_stream_data(int socket, uint32_t client_id, uint16_t stream_id, const void* data, size_t len)
+int autrans_stream_open_ring(int socket, uint32_t client_id, uint16_t stream_id, uint32_t size, autrans_ring* ring)
 {
-    aud_data_payload *payload = malloc(len+2);
-    memcpy(payload->data, data, len);
-    payload->stream_id = stream_id;
+    aud_stream_open_ring_payload payload = {};
+    payload.stream_id = stream_id;
+    payload.size = size;
 
     aud_packet pckt = {};
     aud_packet reply = {};
-    pckt.opcode = OBOS_AUD_DATA;
+    pckt.opcode = OBOS_AUD_STREAM_OPEN_RING;
     pckt.client_id = client_id;
-    pckt.payload = payload;
-    pckt.payload_len = len+sizeof(aud_data_payload);
-    if (autrans_transmit(socket, &pckt) < 0)
+    pckt.payload = &payload;
+    pckt.payload_len = sizeof(payload);
+    int fds[2] = {-1,-1};
+    int nFds = 2;
+    int res = transactv(socket, client_id, &pckt, NULL, 0, OBOS_AUD_STREAM_OPEN_RING_REPLY, &reply, "opening stream ring", fds, &nFds);
+    if (res == 0 && (reply.payload_len < sizeof(aud_stream_open_ring_reply) || nFds != 2))
     {
-        perror("autrans_transmit");
-        return -1;
+        fprintf(stderr, "While opening stream ring: Malformed reply from server (payload length=%d, %d file descriptors)\n", reply.payload_len, nFds);
+        res = -1;
     }
-
-    if (autrans_receive(socket, &reply, NULL, 0) < 0)
-        return -1;
-    if (__builtin_expect(reply.opcode == OBOS_AUD_STATUS_REPLY_OK, true))
-        return 0;
-
-    if (reply.opcode >= OBOS_AUD_STATUS_REPLY_OK && reply.opcode < OBOS_AUD_STATUS_REPLY_CEILING)
+    if (res == 0)
     {
-        fprintf(stderr, "While writing to stream: %s\n", autrans_opcode_to_string(reply.opcode));
-        if (reply.payload_len)
-            fprintf(stderr, "Extra info: %.*s\n", reply.payload_len, (char*)reply.payload);
+        aud_stream_open_ring_reply* reply_payload = reply.payload;
+        ring->map_size = reply_payload->map_size;
+        ring->ring = mmap(NULL, ring->map_size, PROT_READ|PROT_WRITE, MAP_SHARED, fds[0], 0);
+        if (ring->ring != MAP_FAILED)
+        {
+            ring->data = (char*)ring->ring + ring->ring->data_offset;
+            ring->event_fd = fds[1];
+            fds[1] = -1;
+        }
+        else
+        {
+            perror("mmap");
+            ring->ring = NULL;
+            res = -1;
+        }
     }
-    else
-        fprintf(stderr, "While writing to stream: Unexpected %s from server (payload length=%d)\n", autrans_opcode_to_string(reply.opcode), reply.payload_len);
+
+    // The mapping stays valid without the memfd.
+    for (int i = 0; i < 2; i++)
+        if (fds[i] != -1)
+            close(fds[i]);
     free(reply.payload);
-    return -1;
+    return res;
 }
 
-int autrans_stream_open(int socket, const uint32_t client_id, const aud_open_stream_payload* stream_info, uint16_t* stream_id, uint32_t* stream_flags)
+int autrans_ring_write(autrans_ring* ring, const void* data, size_t len)
 {
-    do {
-        aud_packet pckt = {};
-        aud_packet reply = {};
-        pckt.opcode = OBOS_AUD_OPEN_STREAM;
-        pckt.client_id = client_id;
-        pckt.payload = (void*)stream_info /* is not modified on transit */;
-        pckt.payload_len = sizeof(*stream_info);
-        if (autrans_transmit(socket, &pckt) < 0)
-            return -1;
-
-        const uint32_t transmission_id = pckt.transmission_id;
-
-        if (autrans_receive(socket, &reply, NULL, 0) < 0)
-            return -1;
-
-        if (transmission_id != reply.transmission_id)
+    aud_shm_ring* hdr = ring->ring;
+    const uint32_t size = hdr->size;
+    const char* iter = data;
+    uint32_t head = hdr->head;
+    while (len)
+    {
+        if (__atomic_load_n(&hdr->dead, __ATOMIC_ACQUIRE))
         {
-            fprintf(stderr, "Unexpected transmission ID in server reply.\n");
+            errno = EPIPE;
             return -1;
         }
-
-        if (reply.opcode == OBOS_AUD_OPEN_STREAM_REPLY)
+        uint32_t space = size - (head - __atomic_load_n(&hdr->tail, __ATOMIC_ACQUIRE));
+        if (!space)
         {
-            if (reply.payload_len < sizeof(aud_open_stream_reply))
-            {
-                fprintf(stderr, "While opening stream: Invalid reply payload length! (got 0 bytes, expected at least %ld bytes)\n", sizeof(aud_open_stream_reply));\
+            // The server checks writer_waiting after moving tail, so check tail again after setting it.
+            __atomic_store_n(&hdr->writer_waiting, 1, __ATOMIC_RELAXED);
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            if (head - __atomic_load_n(&hdr->tail, __ATOMIC_ACQUIRE) < size || __atomic_load_n(&hdr->dead, __ATOMIC_ACQUIRE))
+                continue;
+            uint64_t count = 0;
+            if (TEMP_FAILURE_RETRY(read(ring->event_fd, &count, sizeof(count))) < 0)
                 return -1;
-            }
-            aud_open_stream_reply *payload = reply.payload;
-            *stream_id = payload->stream_id;
-            free(payload);
-            break;
+            continue;
         }
 
-        if (reply.opcode >= OBOS_AUD_STATUS_REPLY_OK && reply.opcode < OBOS_AUD_STATUS_REPLY_CEILING)
-        {
-            fprintf(stderr, "While opening stream: %s\n", autrans_opcode_to_string(reply.opcode));
-            if (reply.payload_len)
-                fprintf(stderr, "Extra info: %.*s\n", reply.payload_len, (char*)reply.payload);
-        }
-        else
-            fprintf(stderr, "While opening stream: Unexpected %s from server (payload length=%d)\n", autrans_opcode_to_string(reply.opcode), reply.payload_len);
+        uint32_t nToWrite = MIN(len, space);
+        uint32_t off = head & (size - 1);
+        uint32_t first = MIN(nToWrite, size - off);
+        memcpy(ring->data + off, iter, first);
+        memcpy(ring->data, iter + first, nToWrite - first);
+        head += nToWrite;
+        __atomic_store_n(&hdr->head, head, __ATOMIC_RELEASE);
+        iter += nToWrite;
+        len -= nToWrite;
+    }
+    return 0;
+}
+
+void autrans_ring_close(autrans_ring* ring)
+{
+    if (!ring->ring)
+        return;
+    munmap(ring->ring, ring->map_size);
+    close(ring->event_fd);
+    memset(ring, 0, sizeof(*ring));
+    ring->event_fd = -1;
+}
+
+static int open_stream(int socket, const uint32_t client_id, const void* stream_info, size_t info_len, uint16_t* stream_id, uint32_t* stream_flags, uint32_t* credits)
+{
+    aud_packet pckt = {};
+    aud_packet reply = {};
+    pckt.opcode = OBOS_AUD_OPEN_STREAM;
+    pckt.cpayload = stream_info;
+    pckt.payload_len = info_len;
+    if (transact(socket, client_id, &pckt, OBOS_AUD_OPEN_STREAM_REPLY, &reply, "opening stream") < 0)
+        return -1;
+
+    // Older servers don't send credits.
+    if (reply.payload_len < offsetof(aud_open_stream_reply, credits))
+    {
+        fprintf(stderr, "While opening stream: Invalid reply payload length! (got %d bytes, expected at least %ld bytes)\n", reply.payload_len, offsetof(aud_open_stream_reply, credits));
         free(reply.payload);
         return -1;
-    } while(0);
-    int sample_size = 2;
+    }
+    aud_open_stream_reply *payload = reply.payload;
+    *stream_id = payload->stream_id;
+    if (credits)
+        *credits = reply.payload_len >= sizeof(aud_open_stream_reply) ? payload->credits : 0;
+    free(payload);
+
     if (stream_flags && *stream_flags)
         return autrans_stream_flags(socket, client_id, *stream_id, stream_flags);
     return 0;
 }
 
+int autrans_stream_open(int socket, const uint32_t client_id, const aud_open_stream_payload* stream_info, uint16_t* stream_id, uint32_t* stream_flags)
+{
+    return open_stream(socket, client_id, stream_info, sizeof(*stream_info), stream_id, stream_flags, NULL);
+}
+
+int autrans_stream_open_credited(int socket, uint32_t client_id, const aud_open_stream_payload* stream_info, uint16_t* stream_id, uint32_t* stream_flags, uint32_t* credits)
+{
+    aud_open_stream_ex_payload payload = {.info=*stream_info,.options=OBOS_AUD_OPEN_STREAM_CREDITS};
+    int res = open_stream(socket, client_id, &payload, sizeof(payload), stream_id, stream_flags, credits);
+    // Whatever is left over from a stream that had this id before belongs to no one now.
+    if (res == 0)
+        take_credits(socket, client_id, *stream_id, false);
+    return res;
+}
+
+int autrans_stream_close(int socket, uint32_t client_id, uint16_t stream_id)
+{
+    aud_close_stream_payload payload = {.stream_id=stream_id};
+    aud_packet pckt = {};
+    pckt.opcode = OBOS_AUD_CLOSE_STREAM;
+    pckt.payload = &payload;
+    pckt.payload_len = sizeof(payload);
+    int res = transact(socket, client_id, &pckt, OBOS_AUD_STATUS_REPLY_OK, NULL, "closing stream");
+    take_credits(socket, client_id, stream_id, false);
+    return res;
+}
+
 #define volume_set_common(socket, client_id, tgt, prefix, opcode_val, volume) \
 {\
-    do {\
-        aud_set_volume_payload payload = {.obj_id##prefix=tgt,.volume=volume};\
-        aud_packet pckt = {};\
-        aud_packet reply = {};\
-        pckt.opcode = opcode_val;\
-        pckt.client_id = client_id;\
-        pckt.payload = &payload;\
-        pckt.payload_len = sizeof(payload);\
-        if (autrans_transmit(socket, &pckt) < 0)\
-            return -1;\
-\
-        const uint32_t transmission_id = pckt.transmission_id;\
-\
-        if (autrans_receive(socket, &reply, NULL, 0) < 0)\
-            return -1;\
-\
-        if (transmission_id != reply.transmission_id)\
-        {\
-            fprintf(stderr, "Unexpected transmission ID in server reply.\n");\
-            return -1;\
-        }\
-\
-        if (reply.opcode == OBOS_AUD_STATUS_REPLY_OK)\
-            break;\
-\
-        if (reply.opcode >= OBOS_AUD_STATUS_REPLY_OK && reply.opcode < OBOS_AUD_STATUS_REPLY_CEILING)\
-        {\
-            fprintf(stderr, "While opening stream: %s\n", autrans_opcode_to_string(reply.opcode));\
-            if (reply.payload_len)\
-                fprintf(stderr, "Extra info: %.*s\n", reply.payload_len, (char*)reply.payload);\
-        }\
-        else\
-            fprintf(stderr, "While opening stream: Unexpected %s from server (payload length=%d)\n", autrans_opcode_to_string(reply.opcode), reply.payload_len);\
-        free(reply.payload);\
-        return -1;\
-    } while(0);\
-    return 0;\
+    aud_set_volume_payload payload = {.obj_id##prefix=tgt,.volume=volume};\
+    aud_packet pckt = {};\
+    pckt.opcode = opcode_val;\
+    pckt.payload = &payload;\
+    pckt.payload_len = sizeof(payload);\
+    return transact(socket, client_id, &pckt, OBOS_AUD_STATUS_REPLY_OK, NULL, "setting volume");\
 }
 #define volume_get_common(socket, client_id, tgt, prefix, opcode_val, volume) \
 {\
-    do {\
-        aud_get_volume_payload payload = {.obj_id##prefix=tgt};\
-        aud_packet pckt = {};\
-        aud_packet reply = {};\
-        pckt.opcode = opcode_val;\
-        pckt.client_id = client_id;\
-        pckt.payload = &payload;\
-        pckt.payload_len = sizeof(payload);\
-        if (autrans_transmit(socket, &pckt) < 0)\
-            return -1;\
-\
-        const uint32_t transmission_id = pckt.transmission_id;\
-\
-        if (autrans_receive(socket, &reply, NULL, 0) < 0)\
-            return -1;\
-\
-        if (transmission_id != reply.transmission_id)\
-        {\
-            free(reply.payload);\
-            fprintf(stderr, "Unexpected transmission ID in server reply.\n");\
-            return -1;\
-        }\
-\
-        if (reply.opcode == OBOS_AUD_GET_VOLUME_REPLY)\
-        {\
-            if (reply.payload_len != sizeof(aud_get_volume_payload))\
-            {\
-                fprintf(stderr, "While opening stream: Invalid reply payload length! (got 0 bytes, expected %ld bytes)\n", sizeof(aud_get_volume_payload));\
-                return -1;\
-            }\
-            aud_get_volume_reply* reply_payload = reply.payload;\
-            *volume = reply_payload->volume;\
-            free(reply.payload);\
-            break;\
-        }\
-\
-        if (reply.opcode >= OBOS_AUD_STATUS_REPLY_OK && reply.opcode < OBOS_AUD_STATUS_REPLY_CEILING)\
-        {\
-            fprintf(stderr, "While opening stream: %s\n", autrans_opcode_to_string(reply.opcode));\
-            if (reply.payload_len)\
-                fprintf(stderr, "Extra info: %.*s\n", reply.payload_len, (char*)reply.payload);\
-        }\
-        else\
-            fprintf(stderr, "While opening stream: Unexpected %s from server (payload length=%d)\n", autrans_opcode_to_string(reply.opcode), reply.payload_len);\
+    aud_get_volume_payload payload = {.obj_id##prefix=tgt};\
+    aud_packet pckt = {};\
+    aud_packet reply = {};\
+    pckt.opcode = opcode_val;\
+    pckt.payload = &payload;\
+    pckt.payload_len = sizeof(payload);\
+    if (transact(socket, client_id, &pckt, OBOS_AUD_GET_VOLUME_REPLY, &reply, "getting volume") < 0)\
+        return -1;\
+    if (reply.payload_len < sizeof(aud_get_volume_reply))\
+    {\
+        fprintf(stderr, "While getting volume: Invalid reply payload length! (got %d bytes, expected %ld bytes)\n", reply.payload_len, sizeof(aud_get_volume_reply));\
         free(reply.payload);\
         return -1;\
-    } while(0);\
+    }\
+    aud_get_volume_reply* reply_payload = reply.payload;\
+    *volume = reply_payload->volume;\
+    free(reply.payload);\
     return 0;\
 }
 
@@ -657,43 +1621,12 @@ int autrans_connection_get_volume(int socket, uint32_t client_id, uint32_t tgt,
 
 int autrans_output_set_buffer_samples(int socket, uint32_t client_id, uint16_t output_id, int32_t new_sample_count)
 {
-    do {
-        aud_set_output_buffer_samples_payload payload = {.output_id=output_id,.buffer_samples=new_sample_count};
-        aud_packet pckt = {};
-        aud_packet reply = {};
-        pckt.opcode = OBOS_AUD_OUTPUT_SET_BUFFER_SAMPLES;
-        pckt.client_id = client_id;
-        pckt.payload = &payload;
-        pckt.payload_len = sizeof(payload);
-        if (autrans_transmit(socket, &pckt) < 0)
-            return -1;
-
-        const uint32_t transmission_id = pckt.transmission_id;
-
-        if (autrans_receive(socket, &reply, NULL, 0) < 0)
-            return -1;
-
-        if (transmission_id != reply.transmission_id)
-        {
-            fprintf(stderr, "Unexpected transmission ID in server reply.\n");
-            return -1;
-        }
-
-        if (reply.opcode == OBOS_AUD_STATUS_REPLY_OK)
-            break;
-
-        if (reply.opcode >= OBOS_AUD_STATUS_REPLY_OK && reply.opcode < OBOS_AUD_STATUS_REPLY_CEILING)
-        {
-            fprintf(stderr, "While opening stream: %s\n", autrans_opcode_to_string(reply.opcode));
-            if (reply.payload_len)
-                fprintf(stderr, "Extra info: %.*s\n", reply.payload_len, (char*)reply.payload);
-        }
-        else
-            fprintf(stderr, "While opening stream: Unexpected %s from server (payload length=%d)\n", autrans_opcode_to_string(reply.opcode), reply.payload_len);
-        free(reply.payload);
-        return -1;
-    } while(0);
-    return 0;
+    aud_set_output_buffer_samples_payload payload = {.output_id=output_id,.buffer_samples=new_sample_count};
+    aud_packet pckt = {};
+    pckt.opcode = OBOS_AUD_OUTPUT_SET_BUFFER_SAMPLES;
+    pckt.payload = &payload;
+    pckt.payload_len = sizeof(payload);
+    return transact(socket, client_id, &pckt, OBOS_AUD_STATUS_REPLY_OK, NULL, "setting output buffer samples");
 }
 
 int autrans_open()
@@ -889,6 +1822,8 @@ const char* autrans_opcode_to_string(uint32_t opcode)
         case OBOS_AUD_QUERY_OUTPUT_PARAMETERS: return "OBOS_AUD_QUERY_OUTPUT_PARAMETERS";
         case OBOS_AUD_OUTPUT_SET_BUFFER_SAMPLES: return "OBOS_AUD_OUTPUT_SET_BUFFER_SAMPLES";
         case OBOS_AUD_SET_DEFAULT_OUTPUT: return "OBOS_AUD_SET_DEFAULT_OUTPUT";
+        case OBOS_AUD_STREAM_OPEN_RING: return "OBOS_AUD_STREAM_OPEN_RING";
+        case OBOS_AUD_DATAV: return "OBOS_AUD_DATAV";
 
         case OBOS_AUD_REQUEST_REPLY_BEGIN: return "OBOS_AUD_REQUEST_REPLY_BEGIN";
         case OBOS_AUD_INITIAL_CONNECTION_REPLY: return "OBOS_AUD_INITIAL_CONNECTION_REPLY";
@@ -898,6 +1833,7 @@ const char* autrans_opcode_to_string(uint32_t opcode)
         case OBOS_AUD_STREAM_GET_FLAGS_REPLY: return "OBOS_AUD_STREAM_GET_FLAGS_REPLY";
         case OBOS_AUD_QUERY_CONNECTIONS_REPLY: return "OBOS_AUD_QUERY_CONNECTIONS_REPLY";
         case OBOS_AUD_QUERY_OUTPUT_PARAMETERS_REPLY: return "OBOS_AUD_QUERY_OUTPUT_PARAMETERS_REPLY";
+        case OBOS_AUD_STREAM_OPEN_RING_REPLY: return "OBOS_AUD_STREAM_OPEN_RING_REPLY";
         
         case OBOS_AUD_STATUS_REPLY_OK: return "OBOS_AUD_STATUS_REPLY_OK";
         case OBOS_AUD_STATUS_REPLY_UNSUPPORTED: return "OBOS_AUD_STATUS_REPLY_UNSUPPORTED";
@@ -905,6 +1841,9 @@ const char* autrans_opcode_to_string(uint32_t opcode)
         case OBOS_AUD_STATUS_REPLY_DISCONNECTED: return "OBOS_AUD_STATUS_REPLY_DISCONNECTED";
         case OBOS_AUD_STATUS_REPLY_STREAM_DEAD: return "OBOS_AUD_STATUS_REPLY_STREAM_DEAD";
         case OBOS_AUD_STATUS_REPLY_CEILING: return "OBOS_AUD_STATUS_REPLY_CEILING";
+
+        case OBOS_AUD_EVENT_BEGIN: return "OBOS_AUD_EVENT_BEGIN";
+        case OBOS_AUD_STREAM_CREDIT: return "OBOS_AUD_STREAM_CREDIT";
         default: break;
     }
     return "OBOS_AUD_INVALID_OPCODE";
@@ -0,0 +1,377 @@
+/*
+ * libautrans/writer.c
+ *
+ * Copyright (c) 2025 Omar Berrow
+ */
+
+#define _GNU_SOURCE 1
+
+#include <obos-aud/trans.h>
+#include <obos-aud/stream.h>
+#include <obos-aud/compiler.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <sys/param.h>
+#include <sys/eventfd.h>
+
+struct autrans_writer {
+    int fd;
+    uint32_t client_id;
+    uint16_t stream_id;
+    /* bytes of audio the stream plays each second */
+    size_t rate;
+    /* only whole frames are sent at once */
+    size_t frame;
+    /* what the server buffers at most, and how much of that the writer keeps filled */
+    size_t capacity, latency;
+    /* the least sent at once, unless that is all there is */
+    size_t period;
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    /* signalled when audio is buffered, or the writer is closed */
+    pthread_cond_t data_cond;
+    /* signalled when audio is sent, or the thread fails */
+    pthread_cond_t space_cond;
+    /* wakes the thread while it waits on the socket */
+    int wake_fd;
+
+    /* audio waiting to be sent, head and tail count bytes from the start */
+    char* buf;
+    size_t size;
+    uint64_t head, tail;
+
+    uint32_t credits;
+    /* what the server had buffered at last_sync, and what was sent since */
+    size_t synced_fill, sent_since;
+    struct timespec last_sync;
+
+    bool stop : 1;
+    bool failed : 1;
+    /* why the thread failed */
+    int err;
+};
+
+static size_t bytes_per_second(const aud_open_stream_payload* info, uint32_t flags, size_t* frame)
+{
+    size_t sample_size = 2;
+    if (flags & (OBOS_AUD_STREAM_FLAGS_ULAW_DECODE|OBOS_AUD_STREAM_FLAGS_ALAW_DECODE))
+        sample_size = 1;
+    else if (flags & OBOS_AUD_STREAM_FLAGS_PCM24_DECODE)
+        sample_size = 3;
+    else if (flags & (OBOS_AUD_STREAM_FLAGS_PCM32_DECODE|OBOS_AUD_STREAM_FLAGS_F32_DECODE))
+        sample_size = 4;
+    if (flags & OBOS_AUD_STREAM_FLAGS_ADPCM_DECODE)
+    {
+        // Four bits a sample, and the decoder carries its state over between packets.
+        *frame = 1;
+        return MAX((size_t)info->target_sample_rate * info->input_channels / 2, 1);
+    }
+    *frame = sample_size * info->input_channels;
+    return (size_t)info->target_sample_rate * *frame;
+}
+
+static void resync(autrans_writer* w, size_t fill, const struct timespec* now)
+{
+    w->synced_fill = fill;
+    w->sent_since = 0;
+    w->last_sync = *now;
+}
+
+// Guesses how much the server has buffered, from what it had at the last
+// credit grant and how long it has been playing since.
+static size_t estimate_fill(autrans_writer* w)
+{
+    struct timespec now = {};
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    uint64_t elapsed_ns = (now.tv_sec - w->last_sync.tv_sec) * 1000000000ull + now.tv_nsec - w->last_sync.tv_nsec;
+    uint64_t played = elapsed_ns * w->rate / 1000000000ull;
+    size_t fill = w->synced_fill + w->sent_since;
+    if (played >= fill)
+    {
+        // The stream ran dry, or never started, so it plays from whatever is sent next.
+        resync(w, 0, &now);
+        return 0;
+    }
+    return fill - played;
+}
+
+static void writer_fail(autrans_writer* w, int err)
+{
+    w->failed = true;
+    w->err = err;
+    pthread_cond_broadcast(&w->space_cond);
+}
+
+// Waits up to timeout ms for the socket, and takes any credits granted.
+// Called with the lock held, which is dropped while waiting.
+static bool wait_socket(autrans_writer* w, int timeout)
+{
+    pthread_mutex_unlock(&w->lock);
+    struct pollfd fds[2] = {
+        { .fd=w->fd, .events=POLLIN },
+        { .fd=w->wake_fd, .events=POLLIN },
+    };
+    int res = TEMP_FAILURE_RETRY(poll(fds, 2, timeout));
+    aud_packet pckt = {};
+    if (res > 0 && (fds[0].revents & (POLLIN|POLLHUP|POLLERR)))
+        res = autrans_receive(w->fd, &pckt, NULL, NULL);
+    if (fds[1].revents & POLLIN)
+    {
+        uint64_t val = 0;
+        read(w->wake_fd, &val, sizeof(val));
+    }
+    pthread_mutex_lock(&w->lock);
+    if (res < 0)
+        return false;
+    if (!pckt.opcode)
+        return true;
+
+    if (pckt.opcode == OBOS_AUD_STREAM_CREDIT && pckt.payload_len >= sizeof(aud_stream_credit_payload))
+    {
+        aud_stream_credit_payload* payload = pckt.payload;
+        if (payload->stream_id == w->stream_id)
+        {
+            w->credits += payload->credits;
+            // Right as credits are granted, they match the server's free space,
+            // counting whatever is still on its way there.
+            struct timespec now = {};
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            resync(w, w->capacity - MIN(w->credits, w->capacity), &now);
+        }
+    }
+    else if (pckt.opcode > OBOS_AUD_STATUS_REPLY_OK && pckt.opcode < OBOS_AUD_STATUS_REPLY_CEILING)
+    {
+        // Only failed writes are replied to.
+        fprintf(stderr, "While writing to stream: %s\n", autrans_opcode_to_string(pckt.opcode));
+        if (pckt.payload_len)
+            fprintf(stderr, "Extra info: %.*s\n", pckt.payload_len, (char*)pckt.payload);
+        free(pckt.payload);
+        errno = EIO;
+        return false;
+    }
+    free(pckt.payload);
+    return true;
+}
+
+static bool send_audio(autrans_writer* w, size_t len)
+{
+    size_t off = w->tail % w->size;
+    size_t first = MIN(len, w->size - off);
+    aud_data_payload payload = {.stream_id=w->stream_id};
+    struct iovec iov[3] = {
+        { .iov_base=&payload, .iov_len=sizeof(payload) },
+        { .iov_base=w->buf + off, .iov_len=first },
+        { .iov_base=w->buf, .iov_len=len - first },
+    };
+    aud_packet pckt = {};
+    pckt.opcode = OBOS_AUD_DATA;
+    pckt.client_id = w->client_id;
+    pckt.data_offset = OBOS_AUD_ALIGNED_DATA_OFFSET(OBOS_AUD_PAYLOAD_ALIGNMENT);
+    // What is being sent is left alone by writes, so the lock isn't needed.
+    pthread_mutex_unlock(&w->lock);
+    int res = autrans_transmitv(w->fd, &pckt, iov, len > first ? 3 : 2);
+    pthread_mutex_lock(&w->lock);
+    return res >= 0;
+}
+
+static void* writer_thread(void* arg)
+{
+    autrans_writer* w = arg;
+    pthread_mutex_lock(&w->lock);
+    while (!w->stop && !w->failed)
+    {
+        size_t avail = w->head - w->tail;
+        avail -= avail % w->frame;
+        if (!avail)
+        {
+            pthread_cond_wait(&w->data_cond, &w->lock);
+            continue;
+        }
+
+        size_t want = MIN(w->period, avail);
+        size_t fill = estimate_fill(w);
+        size_t room = w->latency > fill ? w->latency - fill : 0;
+        size_t len = MIN(MIN(avail, room), w->credits);
+        len -= len % w->frame;
+        if (len < want)
+        {
+            // Without credits, only the server can say when there is room.
+            int timeout = -1;
+            if (w->credits >= want)
+            {
+                uint64_t excess = fill - (w->latency - want);
+                timeout = (excess * 1000 + w->rate - 1) / w->rate;
+            }
+            if (!wait_socket(w, timeout))
+                writer_fail(w, errno);
+            continue;
+        }
+
+        if (!send_audio(w, len))
+        {
+            writer_fail(w, errno);
+            break;
+        }
+        w->tail += len;
+        w->credits -= len;
+        w->sent_since += len;
+        pthread_cond_broadcast(&w->space_cond);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+autrans_writer* autrans_writer_open(int fd, uint32_t client_id, const aud_open_stream_payload* info, uint32_t* stream_flags, uint32_t latency_ms)
+{
+    autrans_writer* w = calloc(1, sizeof(*w));
+    if (!w)
+        return NULL;
+    w->fd = fd;
+    w->client_id = client_id;
+    w->wake_fd = -1;
+    bool opened = false;
+    if (autrans_stream_open_credited(fd, client_id, info, &w->stream_id, stream_flags, &w->credits) < 0)
+        goto fail;
+    opened = true;
+    if (!w->credits)
+    {
+        // An older server, which can't tell us how much it has played.
+        errno = EOPNOTSUPP;
+        goto fail;
+    }
+
+    w->rate = bytes_per_second(info, stream_flags ? *stream_flags : 0, &w->frame);
+    w->capacity = w->credits;
+    w->latency = MIN((uint64_t)w->rate * (latency_ms ? latency_ms : AUTRANS_WRITER_DEFAULT_LATENCY) / 1000, w->capacity);
+    w->latency = MAX(w->latency - w->latency % w->frame, w->frame);
+    w->period = MAX(w->latency / 4 - w->latency / 4 % w->frame, w->frame);
+    w->size = w->latency * 2;
+    w->buf = malloc(w->size);
+    w->wake_fd = eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK);
+    if (!w->buf || w->wake_fd < 0)
+        goto fail;
+    clock_gettime(CLOCK_MONOTONIC, &w->last_sync);
+
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->data_cond, NULL);
+    pthread_cond_init(&w->space_cond, NULL);
+    int err = pthread_create(&w->thread, NULL, writer_thread, w);
+    if (err)
+    {
+        pthread_mutex_destroy(&w->lock);
+        pthread_cond_destroy(&w->data_cond);
+        pthread_cond_destroy(&w->space_cond);
+        errno = err;
+        goto fail;
+    }
+    return w;
+
+    fail:
+    if (opened)
+    {
+        // Keeps errno for the caller.
+        int err = errno;
+        autrans_stream_close(fd, client_id, w->stream_id);
+        errno = err;
+    }
+    if (w->wake_fd >= 0)
+        close(w->wake_fd);
+    free(w->buf);
+    free(w);
+    return NULL;
+}
+
+uint16_t autrans_writer_stream_id(const autrans_writer* w)
+{
+    return w->stream_id;
+}
+
+int autrans_writer_write(autrans_writer* w, const void* data, size_t len)
+{
+    const char* iter = data;
+    pthread_mutex_lock(&w->lock);
+    while (len)
+    {
+        if (w->failed)
+        {
+            errno = w->err;
+            pthread_mutex_unlock(&w->lock);
+            return -1;
+        }
+        size_t space = w->size - (w->head - w->tail);
+        if (!space)
+        {
+            pthread_cond_wait(&w->space_cond, &w->lock);
+            continue;
+        }
+
+        // The thread only reads what is before head, so this is copied without the lock.
+        size_t n = MIN(len, space);
+        size_t off = w->head % w->size;
+        size_t first = MIN(n, w->size - off);
+        pthread_mutex_unlock(&w->lock);
+        memcpy(w->buf + off, iter, first);
+        memcpy(w->buf, iter + first, n - first);
+        pthread_mutex_lock(&w->lock);
+
+        w->head += n;
+        iter += n;
+        len -= n;
+        pthread_cond_signal(&w->data_cond);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return 0;
+}
+
+int autrans_writer_drain(autrans_writer* w)
+{
+    pthread_mutex_lock(&w->lock);
+    // A trailing partial frame is never sent.
+    while (!w->failed && w->head - w->tail >= w->frame)
+        pthread_cond_wait(&w->space_cond, &w->lock);
+    // Then until it was played, going by the clock.
+    size_t fill = 0;
+    while (!w->failed && (fill = estimate_fill(w)))
+    {
+        pthread_mutex_unlock(&w->lock);
+        usleep(fill * 1000000ull / w->rate + 1);
+        pthread_mutex_lock(&w->lock);
+    }
+    int res = 0;
+    if (w->failed)
+    {
+        errno = w->err;
+        res = -1;
+    }
+    pthread_mutex_unlock(&w->lock);
+    return res;
+}
+
+void autrans_writer_close(autrans_writer* w)
+{
+    if (!w)
+        return;
+    pthread_mutex_lock(&w->lock);
+    w->stop = true;
+    pthread_cond_signal(&w->data_cond);
+    pthread_mutex_unlock(&w->lock);
+    uint64_t val = 1;
+    write(w->wake_fd, &val, sizeof(val));
+    pthread_join(w->thread, NULL);
+
+    pthread_mutex_destroy(&w->lock);
+    pthread_cond_destroy(&w->data_cond);
+    pthread_cond_destroy(&w->space_cond);
+    close(w->wake_fd);
+    free(w->buf);
+    free(w);
+}
@@ -143,6 +143,15 @@ int aud_backend_queue_data(int output_id, const void* buf, int len)
     return 0;
 }
 
+// Queued data is in the fifo by the time aud_backend_queue_data returns,
+// and reconfiguring the output doesn't throw it away.
+int aud_backend_output_drain(int output_id)
+{
+    if (output_id != 1)
+        return -1;
+    return 0;
+}
+
 int aud_backend_output_play(int output_id, bool play)
 {
     if (output_id != 1)
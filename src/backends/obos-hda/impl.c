@@ -15,6 +15,7 @@
 #include <obos/error.h>
 
 #include <fcntl.h>
+#include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -414,6 +415,32 @@ int aud_backend_queue_data(int output_id, const void* buffer, int len)
     return 0;
 }
 
+int aud_backend_output_drain(int output_id)
+{
+    if ((output_id-1) >= s_output_count)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct output* output = &s_outputs[output_id-1];
+
+    int remaining = 0;
+    do {
+        pthread_mutex_lock(&s_mutexes[output->dev_idx]);
+        int ret = select_output_dev(output);
+        if (ret >= 0)
+            ret = ioctl(output->dev, IOCTL_HDA_STREAM_GET_REMAINING, &remaining);
+        pthread_mutex_unlock(&s_mutexes[output->dev_idx]);
+        if (ret < 0)
+            return ret;
+        if (remaining)
+            usleep(1000);
+    } while (remaining);
+
+    return 0;
+}
+
 int aud_backend_output_play(int output_id, bool play)
 {
     if ((output_id-1) >= s_output_count)
@@ -4,6 +4,8 @@
  * Copyright (c) 2025 Omar Berrow
  */
 
+#define _GNU_SOURCE 1
+
 #include <obos-aud/trans.h>
 #include <obos-aud/stream.h>
 #include <obos-aud/priv/con.h>
@@ -16,6 +18,16 @@
 #include <string.h>
 
 #include <sys/poll.h>
+#include <sys/param.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+
+// Bounds on the data size of a shared ring.
+#define RING_DEFAULT_SIZE (256*1024)
+#define RING_MIN_SIZE 4096
+#define RING_MAX_SIZE (16*1024*1024)
+// The header gets a page to itself.
+#define RING_DATA_OFFSET 4096
 
 static uint32_t client_ids = 1;
 
@@ -26,33 +38,20 @@ struct obos_aud_connection_array g_connections = {
 obos_aud_connection* obos_aud_get_client(int fd, uint32_t client_id)
 {
     pthread_mutex_lock(&g_connections.lock);
-    for (obos_aud_connection* curr = g_connections.head; curr;)
-    {
-        if (curr->client_id == client_id && (fd == -1 || curr->fd == fd))
-        {
-            pthread_mutex_unlock(&g_connections.lock);
-            return curr;
-        }
-        curr = curr->next;
-    }
+    obos_aud_hash_node* node = obos_aud_hash_find(&g_connections.by_id, client_id);
+    obos_aud_connection* con = node ? obos_aud_hash_entry(node, obos_aud_connection, id_node) : NULL;
+    if (con && fd != -1 && con->fd != fd)
+        con = NULL;
     pthread_mutex_unlock(&g_connections.lock);
-    return NULL;
+    return con;
 }
 
 obos_aud_connection* obos_aud_get_client_by_fd(int fd)
 {
     pthread_mutex_lock(&g_connections.lock);
-    for (obos_aud_connection* curr = g_connections.head; curr;)
-    {
-        if (curr->fd == fd)
-        {
-            pthread_mutex_unlock(&g_connections.lock);
-            return curr;
-        }
-        curr = curr->next;
-    }
+    obos_aud_hash_node* node = obos_aud_hash_find(&g_connections.by_fd, fd);
     pthread_mutex_unlock(&g_connections.lock);
-    return NULL;
+    return node ? obos_aud_hash_entry(node, obos_aud_connection, fd_node) : NULL;
 }
 
 static int ok_status(obos_aud_connection* client, aud_packet* pckt)
@@ -64,7 +63,7 @@ static int ok_status(obos_aud_connection* client, aud_packet* pckt)
     resp.payload_len = 0;
     resp.transmission_id = pckt ? pckt->transmission_id : 0;
     resp.transmission_id_valid = !!pckt;
-    return autrans_transmit(client->fd, &resp);
+    return obos_aud_socket_transmit(client->sock, &resp);
 }
 static int inval_status(obos_aud_connection* client, aud_packet* pckt, const char* msg)
 {
@@ -75,15 +74,16 @@ static int inval_status(obos_aud_connection* client, aud_packet* pckt, const cha
     resp.payload_len = strlen(msg)+1;
     resp.transmission_id = pckt ? pckt->transmission_id : 0;
     resp.transmission_id_valid = !!pckt;
-    return autrans_transmit(client->fd, &resp);
+    return obos_aud_socket_transmit(client->sock, &resp);
 }
 
-obos_aud_connection* obos_aud_process_initial_connection_request(int fd, aud_packet* pckt)
+obos_aud_connection* obos_aud_process_initial_connection_request(obos_aud_socket* sock, aud_packet* pckt)
 {
     obos_aud_connection* ret = calloc(1, sizeof(obos_aud_connection));
     assert(ret);
-    ret->client_id = client_ids++;
-    ret->fd = fd;
+    ret->client_id = __atomic_fetch_add(&client_ids, 1, __ATOMIC_RELAXED);
+    ret->fd = sock->fd;
+    ret->sock = sock;
     ret->stream_handles.lock = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
     ret->stream_handles.next_stream_id = 1;
     ret->volume = mixer_normalize_volume(100);
@@ -95,6 +95,8 @@ obos_aud_connection* obos_aud_process_initial_connection_request(int fd, aud_pac
         g_connections.tail->next = ret;
     ret->prev = g_connections.tail;
     g_connections.tail = ret;
+    obos_aud_hash_insert(&g_connections.by_id, &ret->id_node, ret->client_id);
+    obos_aud_hash_insert(&g_connections.by_fd, &ret->fd_node, ret->fd);
     pthread_mutex_unlock(&g_connections.lock);
 
     size_t nOutputs = g_output_count;
@@ -112,7 +114,7 @@ obos_aud_connection* obos_aud_process_initial_connection_request(int fd, aud_pac
     resp.payload_len = payload_len;
     resp.transmission_id = pckt->transmission_id;
     resp.transmission_id_valid = true;
-    autrans_transmit(fd, &resp);
+    obos_aud_socket_transmit(sock, &resp);
     free(payload);
 
     return ret;
@@ -162,7 +164,7 @@ do {\
     resp.payload_len = sizeof(reply);\
     resp.transmission_id = pckt ? pckt->transmission_id : 0;\
     resp.transmission_id_valid = !!pckt;\
-    autrans_transmit(client->fd, &resp);\
+    obos_aud_socket_transmit(client->sock, &resp);\
 } while(0)
 
 void obos_aud_process_stream_set_volume(obos_aud_connection* client, aud_packet* pckt)
@@ -172,11 +174,34 @@ void obos_aud_process_stream_set_volume(obos_aud_connection* client, aud_packet*
 #undef get_stream_id
 }
 
+// The connection might belong to another reactor, which could free it
+// as soon as g_connections.lock is dropped.
+static obos_aud_connection* lock_client(uint32_t client_id)
+{
+    pthread_mutex_lock(&g_connections.lock);
+    obos_aud_hash_node* node = obos_aud_hash_find(&g_connections.by_id, client_id);
+    return node ? obos_aud_hash_entry(node, obos_aud_connection, id_node) : NULL;
+}
+
 void obos_aud_process_conn_set_volume(obos_aud_connection* client, aud_packet* pckt)
 {
-#define get_con_id(x) obos_aud_get_client(-1, x)
-    set_volume_common(pckt, client, get_con_id, obos_aud_connection, volume, 32);
-#undef get_con_id
+    if (pckt->payload_len != sizeof(aud_set_volume_payload))
+    {
+        inval_status(client, pckt, "Invalid payload length.");
+        return;
+    }
+    aud_set_volume_payload* payload = pckt->payload;
+    obos_aud_connection* obj = lock_client(payload->obj_id32);
+    if (obj)
+        obj->volume = mixer_normalize_volume(payload->volume);
+    pthread_mutex_unlock(&g_connections.lock);
+    if (!obj)
+    {
+        inval_status(client, pckt, "Invalid object ID.");
+        return;
+    }
+
+    ok_status(client, pckt);
 }
 
 void obos_aud_process_output_set_volume(obos_aud_connection* client, aud_packet* pckt)
@@ -198,18 +223,69 @@ void obos_aud_process_output_get_volume(obos_aud_connection* client, aud_packet*
 
 void obos_aud_process_conn_get_volume(obos_aud_connection* client, aud_packet* pckt)
 {
-#define get_con_id(x) obos_aud_get_client(-1, x)
-    get_volume_common(pckt, client, get_con_id, obos_aud_connection, volume, 32);
-#undef get_con_id
+    if (pckt->payload_len != sizeof(aud_get_volume_payload))
+    {
+        inval_status(client, pckt, "Invalid payload length.");
+        return;
+    }
+    aud_get_volume_payload* payload = pckt->payload;
+    obos_aud_connection* obj = lock_client(payload->obj_id32);
+    aud_get_volume_reply reply = {};
+    if (obj)
+        reply.volume = mixer_get_volume(obj->volume);
+    pthread_mutex_unlock(&g_connections.lock);
+    if (!obj)
+    {
+        inval_status(client, pckt, "Invalid object ID.");
+        return;
+    }
+
+    aud_packet resp = {};
+    resp.opcode = OBOS_AUD_GET_VOLUME_REPLY;
+    resp.client_id = client->client_id;
+    resp.payload = &reply;
+    resp.payload_len = sizeof(reply);
+    resp.transmission_id = pckt->transmission_id;
+    resp.transmission_id_valid = true;
+    obos_aud_socket_transmit(client->sock, &resp);
+}
+
+// Called by the mixer once a stream has room for its deferred packets.
+static void stream_has_space(aud_stream* stream, void* udata)
+{
+    obos_aud_stream_handle* hnd = udata;
+    obos_aud_woken_streams* woken = hnd->woken_streams;
+    pthread_mutex_lock(&woken->lock);
+    if (!hnd->woken)
+    {
+        hnd->woken = true;
+        hnd->next_woken = NULL;
+        if (!woken->head)
+            woken->head = hnd;
+        if (woken->tail)
+            woken->tail->next_woken = hnd;
+        woken->tail = hnd;
+    }
+    pthread_mutex_unlock(&woken->lock);
+    uint64_t one = 1;
+    write(woken->event_fd, &one, sizeof(one));
 }
 
 void obos_aud_process_stream_open(obos_aud_connection* client, aud_packet* pckt)
 {
-    if (pckt->payload_len != sizeof(aud_open_stream_payload))
+    uint32_t options = 0;
+    if (pckt->payload_len == sizeof(aud_open_stream_ex_payload))
+        options = ((aud_open_stream_ex_payload*)pckt->payload)->options;
+    else if (pckt->payload_len != sizeof(aud_open_stream_payload))
     {
         inval_status(client, pckt, "Invalid payload length.");
         return;
     }
+    if (options & ~OBOS_AUD_OPEN_STREAM_CREDITS)
+    {
+        inval_status(client, pckt, "Invalid stream options.");
+        return;
+    }
 
     if (client->stream_handles.next_stream_id == 0)
     {
@@ -220,7 +296,7 @@ void obos_aud_process_stream_open(obos_aud_connection* client, aud_packet* pckt)
         resp.payload_len = 29;
         resp.transmission_id = pckt->transmission_id;
         resp.transmission_id_valid = true;
-        autrans_transmit(client->fd, &resp);
+        obos_aud_socket_transmit(client->sock, &resp);
         return;
     }
 
@@ -240,6 +316,20 @@ void obos_aud_process_stream_open(obos_aud_connection* client, aud_packet* pckt)
     hnd->stream_id = client->stream_handles.next_stream_id++;
     hnd->stream_node = node;
     hnd->dev = dev;
+    hnd->refs = 1;
+    hnd->woken_streams = &client->sock->reactor->woken_streams;
+
+    aud_stream_lock(&node->data);
+    node->data.space_callback = stream_has_space;
+    node->data.space_udata = hnd;
+    aud_stream_unlock(&node->data);
+
+    if (options & OBOS_AUD_OPEN_STREAM_CREDITS)
+    {
+        hnd->credits.enabled = true;
+        hnd->credits.granted = aud_stream_space(&node->data);
+        hnd->credits.threshold = MAX(hnd->credits.granted / 4, 1);
+    }
     
     if (!client->stream_handles.head)
         client->stream_handles.head = hnd;
@@ -247,10 +337,12 @@ void obos_aud_process_stream_open(obos_aud_connection* client, aud_packet* pckt)
         client->stream_handles.tail->next = hnd;
     hnd->prev = client->stream_handles.tail;
     client->stream_handles.tail = hnd;
+    obos_aud_hash_insert(&client->stream_handles.by_id, &hnd->id_node, hnd->stream_id);
     pthread_mutex_unlock(&client->stream_handles.lock);
 
     aud_open_stream_reply reply_payload = {};
     reply_payload.stream_id = hnd->stream_id;
+    reply_payload.credits = hnd->credits.granted;
 
     aud_packet resp = {};
     resp.opcode = OBOS_AUD_OPEN_STREAM_REPLY;
@@ -259,7 +351,7 @@ void obos_aud_process_stream_open(obos_aud_connection* client, aud_packet* pckt)
     resp.payload_len = sizeof(reply_payload);
     resp.transmission_id = pckt->transmission_id;
     resp.transmission_id_valid = true;
-    autrans_transmit(client->fd, &resp);
+    obos_aud_socket_transmit(client->sock, &resp);
 }
 
 void obos_aud_process_stream_close(obos_aud_connection* client, aud_packet* pckt)
@@ -305,7 +397,11 @@ void obos_aud_process_stream_set_flags(obos_aud_connection* client, aud_packet*
         return;
     }
     
-    hnd->stream_node->data.flags = payload->flags & OBOS_AUD_STREAM_VALID_FLAG_MASK;
+    if (!aud_stream_set_flags(&hnd->stream_node->data, payload->flags & OBOS_AUD_STREAM_VALID_FLAG_MASK))
+    {
+        inval_status(client, pckt, "Cannot change the stream format right now.");
+        return;
+    }
 
     ok_status(client, pckt);
 }
@@ -335,11 +431,431 @@ void obos_aud_process_stream_get_flags(obos_aud_connection* client, aud_packet*
     resp.payload_len = sizeof(reply);
     resp.transmission_id = pckt->transmission_id;
     resp.transmission_id_valid = !!pckt;
-    autrans_transmit(client->fd, &resp);
+    obos_aud_socket_transmit(client->sock, &resp);
+}
+
+void obos_aud_process_stream_open_ring(obos_aud_connection* client, aud_packet* pckt)
+{
+    if (pckt->payload_len != sizeof(aud_stream_open_ring_payload))
+    {
+        inval_status(client, pckt, "Invalid payload length.");
+        return;
+    }
+
+    aud_stream_open_ring_payload *payload = pckt->payload;
+    obos_aud_stream_handle* hnd = obos_aud_get_stream_by_id(client, payload->stream_id);
+    if (!hnd)
+    {
+        inval_status(client, pckt, "Invalid stream ID.");
+        return;
+    }
+
+    if (!client->sock->local)
+    {
+        aud_packet resp = {};
+        resp.opcode = OBOS_AUD_STATUS_REPLY_UNSUPPORTED;
+        resp.client_id = client->client_id;
+        resp.cpayload = "Shared rings need a unix: connection.";
+        resp.payload_len = strlen(resp.cpayload)+1;
+        resp.transmission_id = pckt->transmission_id;
+        resp.transmission_id_valid = true;
+        obos_aud_socket_transmit(client->sock, &resp);
+        return;
+    }
+
+    uint32_t size = payload->size ? payload->size : RING_DEFAULT_SIZE;
+    size = MIN(MAX(size, RING_MIN_SIZE), RING_MAX_SIZE);
+    if (size & (size - 1))
+        size = 1u << (32 - __builtin_clz(size));
+    size_t map_size = RING_DATA_OFFSET + size;
+
+    int mem_fd = memfd_create("obos-aud-ring", MFD_CLOEXEC);
+    if (mem_fd == -1)
+    {
+        inval_status(client, pckt, "Could not create the ring.");
+        return;
+    }
+    aud_shm_ring* ring = MAP_FAILED;
+    if (ftruncate(mem_fd, map_size) == 0)
+        ring = mmap(NULL, map_size, PROT_READ|PROT_WRITE, MAP_SHARED, mem_fd, 0);
+    int event_fd = ring != MAP_FAILED ? eventfd(0, EFD_CLOEXEC) : -1;
+    if (event_fd == -1)
+    {
+        if (ring != MAP_FAILED)
+            munmap(ring, map_size);
+        close(mem_fd);
+        inval_status(client, pckt, "Could not create the ring.");
+        return;
+    }
+    ring->size = size;
+    ring->data_offset = RING_DATA_OFFSET;
+
+    // The stream closes its copy of the eventfd, the socket closes the other once it is sent.
+    int fds[2] = { mem_fd, dup(event_fd) };
+    if (fds[1] == -1 || !aud_stream_attach_ring(&hnd->stream_node->data, ring, map_size, event_fd))
+    {
+        munmap(ring, map_size);
+        close(event_fd);
+        close(mem_fd);
+        if (fds[1] != -1)
+            close(fds[1]);
+        inval_status(client, pckt, "Shared rings can't be used with this stream.");
+        return;
+    }
+
+    aud_stream_open_ring_reply reply = {};
+    reply.map_size = map_size;
+
+    aud_packet resp = {};
+    resp.opcode = OBOS_AUD_STREAM_OPEN_RING_REPLY;
+    resp.client_id = client->client_id;
+    resp.payload = &reply;
+    resp.payload_len = sizeof(reply);
+    resp.transmission_id = pckt->transmission_id;
+    resp.transmission_id_valid = true;
+    obos_aud_socket_transmit_fds(client->sock, &resp, fds, 2);
+}
+
+static void data_status(struct packet_node* node, uint32_t opcode, const char* msg)
+{
+    aud_packet resp = {};
+    resp.opcode = opcode;
+    resp.client_id = node->pckt.client_id;
+    resp.cpayload = msg;
+    resp.payload_len = msg ? strlen(msg)+1 : 0;
+    resp.transmission_id = node->pckt.transmission_id;
+    resp.transmission_id_valid = true;
+    obos_aud_socket_transmit(node->sock, &resp);
+}
+
+// Grants a credit-mode stream whatever room it has beyond what the client can already send,
+// and has the mixer wake the stream once there is enough room for another grant.
+static void grant_credits(obos_aud_stream_handle* hnd)
+{
+    // Deferred data has to go in first.
+    if (!hnd->credits.enabled || hnd->deferred.head)
+        return;
+
+    aud_stream* stream = &hnd->stream_node->data;
+    size_t space = aud_stream_space(stream);
+    if (space >= hnd->credits.granted + hnd->credits.threshold)
+    {
+        aud_stream_credit_payload payload = {};
+        payload.stream_id = hnd->stream_id;
+        payload.credits = space - hnd->credits.granted;
+        hnd->credits.granted = space;
+
+        obos_aud_connection* client = hnd->stream_node->owner;
+        aud_packet event = {};
+        event.opcode = OBOS_AUD_STREAM_CREDIT;
+        event.client_id = client->client_id;
+        event.payload = &payload;
+        event.payload_len = sizeof(payload);
+        obos_aud_socket_transmit(client->sock, &event);
+    }
+
+    // If this can't ever fit, the client has more than enough credits
+    // for now, and this is tried again once it uses some of them up.
+    aud_stream_want_space(stream, hnd->credits.granted + hnd->credits.threshold);
+}
+
+// Drops one piece of an OBOS_AUD_DATAV packet, replying to it once it has none left.
+// Returns true if that was the last piece, and the packet can be freed.
+static bool batch_put(struct packet_node* batch)
+{
+    if (--batch->nPieces)
+        return false;
+    if (batch->failed)
+        data_status(batch, OBOS_AUD_STATUS_REPLY_STREAM_DEAD, "Asynchronous write failed after stream died.");
+    else
+        data_status(batch, OBOS_AUD_STATUS_REPLY_OK, NULL);
+    return true;
+}
+
+// Replies to a deferred write, or counts it as done if it is a piece of an OBOS_AUD_DATAV packet.
+static void write_status(struct packet_node* node, uint32_t opcode, const char* msg)
+{
+    if (!node->batch)
+    {
+        data_status(node, opcode, msg);
+        return;
+    }
+    if (opcode != OBOS_AUD_STATUS_REPLY_OK)
+        node->batch->failed = true;
+    if (batch_put(node->batch))
+        obos_aud_packet_free(node->batch);
+    node->batch = NULL;
+}
+
+// Returns false if the stream has no room for the packet yet.
+static bool push_data(struct packet_node* node)
+{
+    obos_aud_stream_handle* hnd = node->stream;
+    if (hnd->closed)
+    {
+        obos_aud_stream_handle_unref(hnd);
+        write_status(node, OBOS_AUD_STATUS_REPLY_STREAM_DEAD, "Asynchronous write failed after stream died.");
+        return true;
+    }
+
+    aud_data_payload* payload = node->pckt.payload;
+    size_t len = node->pckt.payload_len - sizeof(*payload);
+    if (!aud_stream_push(&hnd->stream_node->data, payload->data, len, false))
+        return false;
+    // The connection's reference keeps the handle around for the caller.
+    obos_aud_stream_handle_unref(hnd);
+    if (!hnd->credits.enabled || node->batch)
+        write_status(node, OBOS_AUD_STATUS_REPLY_OK, NULL);
+    return true;
+}
+
+static void defer_data(obos_aud_stream_handle* hnd, struct packet_node* node)
+{
+    node->next = NULL;
+    node->prev = hnd->deferred.tail;
+    if (!hnd->deferred.head)
+        hnd->deferred.head = node;
+    if (hnd->deferred.tail)
+        hnd->deferred.tail->next = node;
+    hnd->deferred.tail = node;
+}
+
+bool obos_aud_process_data(obos_aud_connection* client, struct packet_node* node)
+{
+    aud_packet* pckt = &node->pckt;
+    if (pckt->payload_len < sizeof(aud_data_payload))
+    {
+        inval_status(client, pckt, "Invalid payload length.");
+        return false;
+    }
+
+    aud_data_payload* payload = pckt->payload;
+    obos_aud_stream_handle* hnd = obos_aud_get_stream_by_id(client, payload->stream_id);
+    if (!hnd)
+    {
+        inval_status(client, pckt, "Invalid stream ID.");
+        return false;
+    }
+    if (hnd->credits.enabled)
+    {
+        size_t len = pckt->payload_len - sizeof(*payload);
+        if (len > hnd->credits.granted)
+        {
+            inval_status(client, pckt, "Not enough credits.");
+            return false;
+        }
+        hnd->credits.granted -= len;
+    }
+    node->stream = hnd;
+    obos_aud_stream_handle_ref(hnd);
+
+    // Data must reach the stream in order, so queue up behind whatever is waiting already.
+    if (!hnd->deferred.head && push_data(node))
+    {
+        grant_credits(hnd);
+        return false;
+    }
+
+    defer_data(hnd, node);
+    return true;
+}
+
+bool obos_aud_process_datav(obos_aud_connection* client, struct packet_node* node)
+{
+    aud_packet* pckt = &node->pckt;
+    aud_datav_payload* payload = pckt->payload;
+    size_t table_len = 0;
+    if (pckt->payload_len < sizeof(*payload)
+        || payload->nEntries > OBOS_AUD_DATAV_MAX_ENTRIES
+        || (table_len = sizeof(*payload) + payload->nEntries*sizeof(aud_datav_entry)) > pckt->payload_len)
+    {
+        inval_status(client, pckt, "Invalid payload length.");
+        return false;
+    }
+    const char* audio = (char*)pckt->payload + table_len;
+    size_t audio_len = pckt->payload_len - table_len;
+
+    // Nothing is written unless every entry can be.
+    obos_aud_stream_handle* hnds[OBOS_AUD_DATAV_MAX_ENTRIES];
+    const char* err = NULL;
+    size_t i = 0;
+    for (; i < payload->nEntries; i++)
+    {
+        aud_datav_entry* entry = &payload->entries[i];
+        if ((uint64_t)entry->offset + entry->length > audio_len)
+        {
+            err = "Entry out of bounds.";
+            break;
+        }
+        if (!(hnds[i] = obos_aud_get_stream_by_id(client, entry->stream_id)))
+        {
+            err = "Invalid stream ID.";
+            break;
+        }
+        if (!hnds[i]->credits.enabled)
+            continue;
+        if (entry->length > hnds[i]->credits.granted)
+        {
+            err = "Not enough credits.";
+            break;
+        }
+        hnds[i]->credits.granted -= entry->length;
+    }
+    if (err)
+    {
+        // Give back the credits taken by the entries before the bad one.
+        while (i--)
+        {
+            if (hnds[i]->credits.enabled)
+                hnds[i]->credits.granted += payload->entries[i].length;
+        }
+        inval_status(client, pckt, err);
+        return false;
+    }
+
+    // The packet holds a piece of itself until every entry was written or deferred.
+    node->nPieces = 1;
+    for (i = 0; i < payload->nEntries; i++)
+    {
+        aud_datav_entry* entry = &payload->entries[i];
+        obos_aud_stream_handle* hnd = hnds[i];
+        if (!entry->length)
+            continue;
+        if (!hnd->deferred.head && aud_stream_push(&hnd->stream_node->data, audio + entry->offset, entry->length, false))
+        {
+            grant_credits(hnd);
+            continue;
+        }
+
+        // Entries that don't fit yet wait in line as DATA packets of their own.
+        struct packet_node* piece = obos_aud_packet_alloc_at(sizeof(aud_data_payload) + entry->length, OBOS_AUD_ALIGNED_DATA_OFFSET(OBOS_AUD_PAYLOAD_ALIGNMENT));
+        if (!piece)
+        {
+            node->failed = true;
+            continue;
+        }
+        piece->sock = node->sock;
+        piece->pckt.opcode = OBOS_AUD_DATA;
+        piece->pckt.client_id = pckt->client_id;
+        piece->pckt.transmission_id = pckt->transmission_id;
+        piece->pckt.transmission_id_valid = true;
+        aud_data_payload* piece_payload = piece->pckt.payload;
+        piece_payload->stream_id = entry->stream_id;
+        memcpy(piece_payload->data, audio + entry->offset, entry->length);
+        piece->stream = hnd;
+        obos_aud_stream_handle_ref(hnd);
+        piece->batch = node;
+        node->nPieces++;
+        defer_data(hnd, piece);
+    }
+    return !batch_put(node);
+}
+
+void* obos_aud_begin_direct_data(struct packet_node* node, size_t len, obos_aud_stream_handle** hnd)
+{
+    obos_aud_connection* client = obos_aud_get_client(node->sock->fd, node->pckt.client_id);
+    if (!client)
+        return NULL;
+    aud_data_payload* payload = node->pckt.payload;
+    *hnd = obos_aud_get_stream_by_id(client, payload->stream_id);
+    if (!*hnd || (*hnd)->deferred.head)
+        return NULL;
+    if ((*hnd)->credits.enabled && len > (*hnd)->credits.granted)
+        return NULL;
+    void* ret = aud_stream_reserve(&(*hnd)->stream_node->data, len);
+    if (ret && (*hnd)->credits.enabled)
+        (*hnd)->credits.granted -= len;
+    if (ret)
+        obos_aud_stream_handle_ref(*hnd);
+    return ret;
+}
+
+void obos_aud_end_direct_data(struct packet_node* node, obos_aud_stream_handle* hnd, bool complete)
+{
+    if (hnd->closed)
+    {
+        obos_aud_stream_handle_unref(hnd);
+        return;
+    }
+    aud_stream_unreserve(&hnd->stream_node->data);
+    obos_aud_stream_handle_unref(hnd);
+    if (!complete)
+        return;
+    if (hnd->credits.enabled)
+        grant_credits(hnd);
+    else
+        data_status(node, OBOS_AUD_STATUS_REPLY_OK, NULL);
+}
+
+static void push_deferred(obos_aud_stream_handle* hnd)
+{
+    struct packet_node* curr = NULL;
+    while ((curr = hnd->deferred.head))
+    {
+        if (!push_data(curr))
+            break;
+        hnd->deferred.head = curr->next;
+        if (curr->next)
+            curr->next->prev = NULL;
+        else
+            hnd->deferred.tail = NULL;
+        obos_aud_packet_free(curr);
+    }
+}
+
+void obos_aud_process_woken_streams(obos_aud_woken_streams* woken)
+{
+    uint64_t count = 0;
+    read(woken->event_fd, &count, sizeof(count));
+
+    pthread_mutex_lock(&woken->lock);
+    obos_aud_stream_handle* curr = woken->head;
+    woken->head = woken->tail = NULL;
+    for (obos_aud_stream_handle* iter = curr; iter; iter = iter->next_woken)
+        iter->woken = false;
+    pthread_mutex_unlock(&woken->lock);
+
+    while (curr)
+    {
+        obos_aud_stream_handle* next = curr->next_woken;
+        push_deferred(curr);
+        grant_credits(curr);
+        curr = next;
+    }
 }
 
 void obos_aud_stream_close(obos_aud_connection* client, obos_aud_stream_handle* hnd, bool locked)
 {
+    aud_stream_lock(&hnd->stream_node->data);
+    hnd->stream_node->data.space_callback = NULL;
+    hnd->stream_node->data.space_wanted = 0;
+    aud_stream_unlock(&hnd->stream_node->data);
+
+    obos_aud_woken_streams* woken = hnd->woken_streams;
+    pthread_mutex_lock(&woken->lock);
+    if (hnd->woken)
+    {
+        obos_aud_stream_handle** iter = &woken->head;
+        obos_aud_stream_handle* prev = NULL;
+        for (; *iter != hnd; iter = &(*iter)->next_woken)
+            prev = *iter;
+        *iter = hnd->next_woken;
+        if (woken->tail == hnd)
+            woken->tail = prev;
+        hnd->woken = false;
+    }
+    pthread_mutex_unlock(&woken->lock);
+
+    for (struct packet_node* curr = hnd->deferred.head; curr; )
+    {
+        struct packet_node* next = curr->next;
+        obos_aud_stream_handle_unref(hnd);
+        write_status(curr, OBOS_AUD_STATUS_REPLY_STREAM_DEAD, "Stream closed before the write could complete.");
+        obos_aud_packet_free(curr);
+        curr = next;
+    }
+    hnd->deferred.head = hnd->deferred.tail = NULL;
+
     if (locked)
         pthread_mutex_lock(&client->stream_handles.lock);
     if (client->stream_handles.head == hnd)
@@ -350,24 +866,31 @@ void obos_aud_stream_close(obos_aud_connection* client, obos_aud_stream_handle*
         client->stream_handles.tail = hnd->prev;
     else
         hnd->next->prev = hnd->prev;
+    obos_aud_hash_remove(&client->stream_handles.by_id, &hnd->id_node);
     if (locked)
         pthread_mutex_unlock(&client->stream_handles.lock);
+    hnd->closed = true;
     mixer_output_remove_stream_dev(hnd->dev, hnd->stream_node);
-    if (!hnd->refs)
+    obos_aud_stream_handle_unref(hnd);
+}
+
+void obos_aud_stream_handle_ref(obos_aud_stream_handle* hnd)
+{
+    __atomic_add_fetch(&hnd->refs, 1, __ATOMIC_RELAXED);
+}
+
+void obos_aud_stream_handle_unref(obos_aud_stream_handle* hnd)
+{
+    if (!__atomic_sub_fetch(&hnd->refs, 1, __ATOMIC_ACQ_REL))
         free(hnd);
-    else
-        hnd->should_free = true;
 }
 
 obos_aud_stream_handle* obos_aud_get_stream_by_id(obos_aud_connection* con, uint16_t stream_id)
 {
     pthread_mutex_lock(&con->stream_handles.lock);
-    obos_aud_stream_handle* curr = con->stream_handles.head;
-    for (; curr; curr = curr->next)
-        if (curr->stream_id == stream_id)
-            break;
+    obos_aud_hash_node* node = obos_aud_hash_find(&con->stream_handles.by_id, stream_id);
     pthread_mutex_unlock(&con->stream_handles.lock);
-    return curr;
+    return node ? obos_aud_hash_entry(node, obos_aud_stream_handle, id_node) : NULL;
 }
 
 void obos_aud_process_output_device_query(obos_aud_connection* client, aud_packet* pckt)
@@ -396,7 +919,7 @@ void obos_aud_process_output_device_query(obos_aud_connection* client, aud_packe
     resp.payload_len = sizeof(reply_payload);
     resp.transmission_id = pckt->transmission_id;
     resp.transmission_id_valid = true;
-    autrans_transmit(client->fd, &resp);
+    obos_aud_socket_transmit(client->sock, &resp);
 }
 void obos_aud_process_output_device_query_parameters(obos_aud_connection* client, aud_packet* pckt)
 {
@@ -429,7 +952,7 @@ void obos_aud_process_output_device_query_parameters(obos_aud_connection* client
     resp.payload_len = sizeof(reply_payload);
     resp.transmission_id = pckt->transmission_id;
     resp.transmission_id_valid = true;
-    autrans_transmit(client->fd, &resp);
+    obos_aud_socket_transmit(client->sock, &resp);
 }
 
 void obos_aud_process_output_set_buffer_samples(obos_aud_connection* client, aud_packet* pckt)
@@ -484,8 +1007,15 @@ void obos_aud_process_set_name(obos_aud_connection* client, aud_packet* pckt)
 
     aud_set_name_payload* payload = pckt->payload;
     size_t name_len = pckt->payload_len - sizeof(*payload);
-    client->name = memcpy(malloc(name_len+1), payload->name, name_len);
-    client->name[name_len] = 0;
+    char* name = memcpy(malloc(name_len+1), payload->name, name_len);
+    name[name_len] = 0;
+
+    // Other reactors read names while answering OBOS_AUD_QUERY_CONNECTIONS.
+    pthread_mutex_lock(&g_connections.lock);
+    char* old_name = client->name;
+    client->name = name;
+    pthread_mutex_unlock(&g_connections.lock);
+    free(old_name);
 
     ok_status(client, pckt);    
 }
@@ -535,7 +1065,7 @@ void obos_aud_process_query_connections(obos_aud_connection* client, aud_packet*
     resp.payload_len = len;
     resp.transmission_id = pckt->transmission_id;
     resp.transmission_id_valid = true;
-    autrans_transmit(client->fd, &resp);
+    obos_aud_socket_transmit(client->sock, &resp);
     
     free(reply);
 }
@@ -560,10 +1090,8 @@ void obos_aud_process_disconnect(obos_aud_connection* client, aud_packet* pckt)
     resp.payload_len = 24;
     resp.transmission_id = pckt ? pckt->transmission_id : 0;
     resp.transmission_id_valid = !!pckt;
-    autrans_transmit(client->fd, &resp);
+    obos_aud_socket_transmit(client->sock, &resp);
 
-    shutdown(client->fd, SHUT_RDWR);
-    close(client->fd);
     pthread_mutex_lock(&g_connections.lock);
     if (client->prev)
         client->prev->next = client->next;
@@ -573,7 +1101,10 @@ void obos_aud_process_disconnect(obos_aud_connection* client, aud_packet* pckt)
         g_connections.head = client->next;
     if (g_connections.tail == client)
         g_connections.tail = client->prev;
+    obos_aud_hash_remove(&g_connections.by_id, &client->id_node);
+    obos_aud_hash_remove(&g_connections.by_fd, &client->fd_node);
     pthread_mutex_unlock(&g_connections.lock);
+    obos_aud_hash_free(&client->stream_handles.by_id);
     if (client->name) free(client->name);
     free(client);
 }
\ No newline at end of file
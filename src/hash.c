@@ -0,0 +1,90 @@
+/*
+ * src/hash.c
+ *
+ * Copyright (c) 2025 Omar Berrow
+ */
+
+#include <obos-aud/compiler.h>
+
+#include <obos-aud/priv/hash.h>
+
+#include <stdlib.h>
+
+static size_t bucket_of(size_t nBuckets, uint32_t key)
+{
+    // Fibonacci hashing, so that sequential ids spread out.
+    return (uint32_t)(key * 2654435769u) & (nBuckets - 1);
+}
+
+static void rehash(obos_aud_hash_table* table, size_t nBuckets)
+{
+    obos_aud_hash_node** buckets = calloc(nBuckets, sizeof(*buckets));
+    assert(buckets);
+    for (size_t i = 0; i < table->nBuckets; i++)
+    {
+        for (obos_aud_hash_node* curr = table->buckets[i]; curr; )
+        {
+            obos_aud_hash_node* next = curr->next;
+            size_t bucket = bucket_of(nBuckets, curr->key);
+            curr->next = buckets[bucket];
+            buckets[bucket] = curr;
+            curr = next;
+        }
+    }
+    free(table->buckets);
+    table->buckets = buckets;
+    table->nBuckets = nBuckets;
+}
+
+void obos_aud_hash_insert(obos_aud_hash_table* table, obos_aud_hash_node* node, uint32_t key)
+{
+    if (table->nNodes >= table->nBuckets)
+        rehash(table, table->nBuckets ? table->nBuckets*2 : 16);
+    node->key = key;
+    size_t bucket = bucket_of(table->nBuckets, key);
+    node->next = table->buckets[bucket];
+    table->buckets[bucket] = node;
+    table->nNodes++;
+}
+
+void obos_aud_hash_remove(obos_aud_hash_table* table, obos_aud_hash_node* node)
+{
+    if (!table->nBuckets)
+        return;
+    obos_aud_hash_node** iter = &table->buckets[bucket_of(table->nBuckets, node->key)];
+    for (; *iter; iter = &(*iter)->next)
+    {
+        if (*iter != node)
+            continue;
+        *iter = node->next;
+        node->next = NULL;
+        table->nNodes--;
+        return;
+    }
+}
+
+obos_aud_hash_node* obos_aud_hash_find(const obos_aud_hash_table* table, uint32_t key)
+{
+    if (!table->nBuckets)
+        return NULL;
+    obos_aud_hash_node* curr = table->buckets[bucket_of(table->nBuckets, key)];
+    while (curr && curr->key != key)
+        curr = curr->next;
+    return curr;
+}
+
+obos_aud_hash_node* obos_aud_hash_find_next(const obos_aud_hash_node* node)
+{
+    obos_aud_hash_node* curr = node->next;
+    while (curr && curr->key != node->key)
+        curr = curr->next;
+    return curr;
+}
+
+void obos_aud_hash_free(obos_aud_hash_table* table)
+{
+    free(table->buckets);
+    table->buckets = NULL;
+    table->nBuckets = 0;
+    table->nNodes = 0;
+}
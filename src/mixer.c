@@ -16,6 +16,9 @@
 #include <assert.h>
 #include <errno.h>
 #include <pthread.h>
+#include <math.h>
+
+#include <sys/param.h>
 
 mixer_output_device* g_outputs;
 size_t g_output_count;
@@ -55,9 +58,15 @@ static float clamp(float value, float min, float max)
 }
 
 static void* mixer_worker(void* arg);
+#if OBOS_AUD_MIXER_CHECK
+static void check_rate_groups();
+#endif
 
 void mixer_initialize()
 {
+#if OBOS_AUD_MIXER_CHECK
+    check_rate_groups();
+#endif
     if (!aud_backend_initialize)
     {
         fprintf(stderr, "No backend compiled!\n");
@@ -171,6 +180,62 @@ mixer_output_device* mixer_output_from_id(int output_id)
     return NULL;
 }
 
+// dev->streams.lock must be held.
+static void group_add_stream(mixer_output_device* dev, aud_stream_node* node)
+{
+    mixer_rate_group* group = dev->groups.head;
+    for (; group; group = group->next)
+        if (group->sample_rate == node->data.sample_rate)
+            break;
+    if (!group)
+    {
+        group = calloc(1, sizeof(*group));
+        assert(group);
+        group->sample_rate = node->data.sample_rate;
+        aud_resampler_initialize(&group->resampler, dev->channels);
+        if (!dev->groups.head)
+            dev->groups.head = group;
+        if (dev->groups.tail)
+            dev->groups.tail->next = group;
+        group->prev = dev->groups.tail;
+        dev->groups.tail = group;
+    }
+    if (!group->head)
+        group->head = node;
+    if (group->tail)
+        group->tail->group_next = node;
+    node->group_prev = group->tail;
+    group->tail = node;
+    group->nNodes++;
+    node->group = group;
+}
+
+// dev->streams.lock must be held.
+static void group_remove_stream(mixer_output_device* dev, aud_stream_node* node)
+{
+    mixer_rate_group* group = node->group;
+    if (node->group_next)
+        node->group_next->group_prev = node->group_prev;
+    if (node->group_prev)
+        node->group_prev->group_next = node->group_next;
+    if (group->head == node)
+        group->head = node->group_next;
+    if (group->tail == node)
+        group->tail = node->group_prev;
+    if (--group->nNodes)
+        return;
+    if (group->next)
+        group->next->prev = group->prev;
+    if (group->prev)
+        group->prev->next = group->next;
+    if (dev->groups.head == group)
+        dev->groups.head = group->next;
+    if (dev->groups.tail == group)
+        dev->groups.tail = group->prev;
+    aud_resampler_free(&group->resampler);
+    free(group);
+}
+
 aud_stream_node* mixer_output_add_stream_dev(mixer_output_device* dev, int sample_rate, int channels, float volume, struct obos_aud_connection* owner)
 {
     if (!dev)
@@ -178,7 +243,7 @@ aud_stream_node* mixer_output_add_stream_dev(mixer_output_device* dev, int sampl
     aud_stream_node* node = calloc(1, sizeof(*node));
     assert(node);
     pthread_mutex_lock(&dev->streams.lock);
-    aud_stream_initialize(&node->data, sample_rate, dev->sample_rate, channels);
+    aud_stream_initialize(&node->data, sample_rate, channels);
     node->data.dev = dev;
     node->data.volume = mixer_normalize_volume(volume);
     node->owner = owner;
@@ -188,6 +253,7 @@ aud_stream_node* mixer_output_add_stream_dev(mixer_output_device* dev, int sampl
         dev->streams.tail->next = node;
     node->prev = dev->streams.tail;
     dev->streams.tail = node;
+    group_add_stream(dev, node);
     dev->input_channels += channels;
     if (!dev->streams.nNodes)
         pthread_cond_signal(&dev->streams.evnt);
@@ -215,10 +281,11 @@ void mixer_output_remove_stream_dev_unlocked(mixer_output_device* dev, aud_strea
     if (dev->streams.tail == stream)
         dev->streams.tail = stream->prev;
     dev->streams.nNodes--;
+    group_remove_stream(dev, stream);
     if (stream->input_samples_arr)
         free(stream->input_samples_arr);
     dev->input_channels -= stream->data.channels;
-    free(stream->data.buffer);
+    aud_stream_free(&stream->data);
     free(stream);
 }
 
@@ -258,10 +325,256 @@ float mixer_output_get_volume(mixer_output_device* dev)
     return mixer_get_volume(dev->volume);
 }
 
+static bool sample_rate_rejected(mixer_output_device* dev, int sample_rate)
+{
+    for (int i = 0; i < dev->nRejectedSampleRates; i++)
+        if (dev->rejected_sample_rates[i] == sample_rate)
+            return true;
+    return false;
+}
+
+// Returns the sample rate shared by the most input channels,
+// which is the rate that needs the least resampling.
+// dev->streams.lock must be held.
+static int preferred_sample_rate(mixer_output_device* dev)
+{
+    struct {
+        int sample_rate;
+        int channels;
+    } rates[16] = {};
+    int nRates = 0;
+    int current_channels = 0;
+    for (aud_stream_node* node = dev->streams.head; node; node = node->next)
+    {
+        int sample_rate = node->data.sample_rate;
+        if (sample_rate == dev->sample_rate)
+        {
+            current_channels += node->data.channels;
+            continue;
+        }
+        if (sample_rate <= 0 || sample_rate_rejected(dev, sample_rate))
+            continue;
+        int i = 0;
+        for (; i < nRates; i++)
+            if (rates[i].sample_rate == sample_rate)
+                break;
+        if (i == nRates)
+        {
+            if (nRates == sizeof(rates)/sizeof(*rates))
+                continue;
+            rates[nRates++].sample_rate = sample_rate;
+        }
+        rates[i].channels += node->data.channels;
+    }
+
+    // Ties go to the current sample rate.
+    int best_rate = dev->sample_rate;
+    int best_channels = current_channels;
+    for (int i = 0; i < nRates; i++)
+    {
+        if (rates[i].channels > best_channels)
+        {
+            best_rate = rates[i].sample_rate;
+            best_channels = rates[i].channels;
+        }
+    }
+    return best_rate;
+}
+
+static bool set_sample_rate(mixer_output_device* dev, int sample_rate)
+{
+    aud_backend_configure_output(dev->info.output_id, sample_rate, dev->channels, dev->format_size);
+    if (!settings_match(dev->info.output_id, sample_rate, dev->channels, dev->format_size))
+    {
+        aud_backend_configure_output(dev->info.output_id, dev->sample_rate, dev->channels, dev->format_size);
+        if (dev->nRejectedSampleRates < (int)(sizeof(dev->rejected_sample_rates)/sizeof(*dev->rejected_sample_rates)))
+            dev->rejected_sample_rates[dev->nRejectedSampleRates++] = sample_rate;
+        return false;
+    }
+    dev->sample_rate = sample_rate;
+    printf("mixer: switched output device #%ld to a sample rate of %dhz\n", dev-g_outputs, sample_rate);
+    return true;
+}
+
+// Ramps the volume of nFrames frames up (or down), so a sample
+// rate switch in the middle of playback does not pop.
+static void fade(int16_t* buffer, int channels, size_t nFrames, bool in)
+{
+    for (size_t i = 0; i < nFrames; i++)
+    {
+        float gain = (float)i / nFrames;
+        if (!in)
+            gain = 1 - gain;
+        for (int c = 0; c < channels; c++)
+            buffer[i*channels+c] *= gain;
+    }
+}
+
 #ifdef __obos__
 #   include <obos/syscall.h>
 #endif
 
+// Adds one frame of a stream into out, a frame with the device's channels.
+static void add_stream_frame(mixer_output_device* dev, aud_stream_node* node, const float* i_samples, float* out)
+{
+    aud_stream* const stream = &node->data;
+    float volume = stream->volume * node->owner->volume * dev->volume;
+    for (int i = 0; i < stream->channels; i++)
+    {
+        float res = normalize(i_samples[i], -0x10000, 0x10000) * volume;
+        // Mono streams go to every channel, other streams wrap around the device's channels.
+        if (stream->channels == 1)
+            for (int c = 0; c < dev->channels; c++)
+                out[c] += res;
+        else
+            out[i % dev->channels] += res;
+    }
+}
+
+// Mixes one frame from every stream in the group, at the group's sample rate.
+// dev->streams.lock must be held.
+static void mix_group_frame(mixer_output_device* dev, mixer_rate_group* group, float* out)
+{
+    memset(out, 0, dev->channels*sizeof(*out));
+    for (aud_stream_node* node = group->head; node; node = node->group_next)
+    {
+        float *i_samples = node->input_samples_arr ?
+            node->input_samples_arr :
+            (node->input_samples_arr = calloc(node->data.channels, sizeof(float)));
+        if (aud_stream_read_frame(&node->data, i_samples))
+            add_stream_frame(dev, node, i_samples, out);
+    }
+}
+
+// dev->streams.lock must be held.
+static void reap_dead_streams(mixer_output_device* dev, mixer_rate_group* group)
+{
+    for (aud_stream_node* node = group->head; node; )
+    {
+        aud_stream_node* next = node->group_next;
+        if (node->dead && !node->data.ptr)
+            mixer_output_remove_stream_dev_unlocked(dev, node);
+        node = next;
+    }
+}
+
+struct group_source {
+    mixer_output_device* dev;
+    mixer_rate_group* group;
+};
+
+static bool read_group_frame(void* udata, float* frame)
+{
+    struct group_source* src = udata;
+    mix_group_frame(src->dev, src->group, frame);
+    return true;
+}
+
+// Adds one device frame from the group into mix, using frame (dev->channels floats) as scratch.
+// dev->streams.lock must be held.
+static void mix_group(mixer_output_device* dev, mixer_rate_group* group, float* mix, float* frame)
+{
+    struct group_source src = {.dev=dev,.group=group};
+    aud_resampler_read(&group->resampler, group->sample_rate, dev->sample_rate, read_group_frame, &src, frame);
+    for (int c = 0; c < dev->channels; c++)
+        mix[c] += frame[c];
+}
+
+#if OBOS_AUD_MIXER_CHECK
+static bool read_stream_frame(void* udata, float* frame)
+{
+    return aud_stream_read_frame(udata, frame);
+}
+
+// Mixes a few streams through rate groups and again by resampling every stream on its own,
+// and aborts if the two mixes are half a PCM16 step or more apart.
+static void check_rate_groups()
+{
+    static const struct {
+        int sample_rate, channels;
+        float volume, freq;
+    } streams[] = {
+        {22050, 2, 100, 440},
+        {22050, 1, 50, 1000},
+        {22050, 2, 75, 3000},
+        {44100, 2, 100, 250},
+        {44100, 1, 80, 5000},
+        {48000, 2, 60, 700},
+    };
+    enum { nStreams = sizeof(streams)/sizeof(*streams) };
+
+    mixer_output_device dev = {.sample_rate=48000,.channels=2};
+    dev.volume = mixer_normalize_volume(100);
+    pthread_mutex_init(&dev.streams.lock, NULL);
+    pthread_cond_init(&dev.streams.evnt, NULL);
+    obos_aud_connection* owner = calloc(1, sizeof(*owner));
+    assert(owner);
+    owner->volume = mixer_normalize_volume(100);
+
+    aud_stream_node* nodes[nStreams];
+    aud_stream_node* reference = calloc(nStreams, sizeof(*reference));
+    aud_resampler* resamplers = calloc(nStreams, sizeof(*resamplers));
+    assert(reference && resamplers);
+    for (int i = 0; i < nStreams; i++)
+    {
+        nodes[i] = mixer_output_add_stream_dev(&dev, streams[i].sample_rate, streams[i].channels, streams[i].volume, owner);
+        aud_stream_initialize(&reference[i].data, streams[i].sample_rate, streams[i].channels);
+        reference[i].data.volume = mixer_normalize_volume(streams[i].volume);
+        reference[i].owner = owner;
+        aud_resampler_initialize(&resamplers[i], streams[i].channels);
+
+        // One second of a sine wave, with a different phase on every channel.
+        size_t nSamples = streams[i].sample_rate*streams[i].channels;
+        int16_t* data = malloc(nSamples*sizeof(int16_t));
+        assert(data);
+        for (size_t j = 0; j < nSamples; j++)
+        {
+            size_t frame = j / streams[i].channels;
+            int channel = j % streams[i].channels;
+            data[j] = 12000*sinf(6.2831853f*streams[i].freq*frame/streams[i].sample_rate + channel);
+        }
+        aud_stream_push(&nodes[i]->data, data, nSamples*sizeof(int16_t), true);
+        aud_stream_push(&reference[i].data, data, nSamples*sizeof(int16_t), true);
+        free(data);
+    }
+
+    float mix[2], expected[2], frame[2], i_samples[2];
+    float max_error = 0;
+    // Half a second, so that no stream runs out.
+    for (int i = 0; i < dev.sample_rate/2; i++)
+    {
+        memset(mix, 0, sizeof(mix));
+        memset(expected, 0, sizeof(expected));
+        for (mixer_rate_group* group = dev.groups.head; group; group = group->next)
+            mix_group(&dev, group, mix, frame);
+        for (int j = 0; j < nStreams; j++)
+            if (aud_resampler_read(&resamplers[j], streams[j].sample_rate, dev.sample_rate, read_stream_frame, &reference[j].data, i_samples))
+                add_stream_frame(&dev, &reference[j], i_samples, expected);
+        for (int c = 0; c < dev.channels; c++)
+            max_error = MAX(max_error, fabsf(unnormalize(mix[c], -0x10000, 0x10000) - unnormalize(expected[c], -0x10000, 0x10000)));
+    }
+
+    for (int i = 0; i < nStreams; i++)
+    {
+        mixer_output_remove_stream_dev_unlocked(&dev, nodes[i]);
+        aud_stream_free(&reference[i].data);
+        aud_resampler_free(&resamplers[i]);
+    }
+    free(reference);
+    free(resamplers);
+    free(owner);
+    pthread_cond_destroy(&dev.streams.evnt);
+    pthread_mutex_destroy(&dev.streams.lock);
+
+    if (max_error >= 0.5f)
+    {
+        fprintf(stderr, "Mixing by sample rate is off from resampling every stream on its own by %f. Abort.\n", max_error);
+        abort();
+    }
+    printf("Mixing by sample rate matches resampling every stream on its own (max error %f).\n", max_error);
+}
+#endif
+
 static void* mixer_worker(void* arg)
 {
 #ifdef __obos__
@@ -279,12 +592,13 @@ static void* mixer_worker(void* arg)
     assert(buffer);
     memset(buffer, 0x00, buffer_len);
 
-    float* condensed_samples = calloc(dev->channels, sizeof(float));
-    assert(condensed_samples);
-    int input_channels = dev->input_channels;
-    float *samples = calloc(input_channels, sizeof(float));
-    assert(samples);
+    float* mix = calloc(dev->channels, sizeof(float));
+    assert(mix);
+    float* frame = calloc(dev->channels, sizeof(float));
+    assert(frame);
 
+    bool idle = true;
+    size_t fade_in = 0;
     while (1)
     {
         if (buffer_samples != dev->buffer_samples)
@@ -310,103 +624,55 @@ static void* mixer_worker(void* arg)
             buffer = malloc(buffer_len);
             assert(buffer);
             memset(buffer, 0x00, buffer_len);
+            idle = true;
         }
+        int sample_rate = preferred_sample_rate(dev);
         pthread_mutex_unlock(&dev->streams.lock);
+
+        // Nothing is playing, so the sample rate can be switched right away.
+        // Otherwise, fade this buffer out and switch once it has been played,
+        // as reconfiguring the output throws away anything still queued.
+        if (idle && sample_rate != dev->sample_rate)
+            set_sample_rate(dev, sample_rate);
+        bool fade_out = !idle && sample_rate != dev->sample_rate && aud_backend_output_drain;
+        idle = false;
         
         aud_backend_output_play(dev->info.output_id, true);
-        // struct timespec start = {};
-        // clock_gettime(1, &start);
-        for (int i = 0; i < (buffer_len/dev->channels/sizeof(*buffer)) && dev->input_channels; i++)
+        size_t nFrames = buffer_len/dev->channels/sizeof(*buffer);
+        for (size_t i = 0; i < nFrames && dev->input_channels; i++)
         {
             pthread_mutex_lock(&dev->streams.lock);
-            int j = 0;
-            if (dev->input_channels != input_channels)
-            {
-                input_channels = dev->input_channels;
-                if (samples)
-                    free(samples);
-                samples = calloc(input_channels, sizeof(float));
-                assert(samples);
-            }
-            else
-                memset(samples, 0, sizeof(*samples)*input_channels);
-            for (aud_stream_node* node = dev->streams.head; node; node = node->next)
-            {
-                up:
-                (void)0;
-                if (!node)
-                    break;
-                aud_stream* const stream = &node->data;
-                aud_stream_lock(stream);
-                float volume = stream->volume * node->owner->volume * dev->volume;
-                if (!(stream->ptr - stream->in_ptr))
-                {
-                    // __Do not__ increment j!
-                    memset(&samples[j], 0, stream->channels*sizeof(*samples));
-                    // for (int i = 0; i < stream->channels; i++)
-                    //     samples[j++] = normalize(0, -0x10000, 0x10000);
-                    aud_stream_unlock(stream);
-                    continue;
-                }
-                aud_stream_unlock(stream);
-                int16_t *i_samples = node->input_samples_arr ?
-                    node->input_samples_arr :
-                    (node->input_samples_arr = calloc(stream->channels, sizeof(int16_t)));
-                aud_stream_read(stream, i_samples, stream->channels*sizeof(int16_t), false, false);
-                for (int i = 0; i < stream->channels; i++)
-                {
-                    float res = normalize(i_samples[i], -0x10000, 0x10000) * volume;
-                    if (res)
-                        samples[j++] = res;
-                }
-                if (node->dead && !stream->ptr)
-                {
-                    aud_stream_node* next = node->next;
-                    mixer_output_remove_stream_dev_unlocked(dev, node);
-                    node = next;
-                    goto up;
-                }
-            }
-            if (j <= dev->channels)
-                for (int c = 0; c < dev->channels && j != 0; c++)
-                    buffer[i*dev->channels+c] = (int16_t)unnormalize(samples[c % j], -0x10000, 0x10000);
-            else
+            memset(mix, 0, dev->channels*sizeof(*mix));
+            for (mixer_rate_group* group = dev->groups.head; group; )
             {
-                int samples_per_channel = j / dev->channels;
-                int extra_samples = j % dev->channels;
-                int additional_samples_per_channel = extra_samples / dev->channels;
-                if (!additional_samples_per_channel)
-                    additional_samples_per_channel = 1;
-                int sample_idx = 0;
-                for (int c = 0; c < dev->channels; c++)
-                {
-                    size_t samples_this_channel = samples_per_channel;
-                    if (extra_samples)
-                    {
-                        extra_samples -= additional_samples_per_channel;
-                        samples_per_channel += additional_samples_per_channel;
-                    }
-                    for (int idx = 0; idx < samples_this_channel; idx++)
-                    {
-                        condensed_samples[c] += samples[sample_idx++];
-                        // samples without audio should be ignored in the final division
-                        samples_this_channel--;
-                    }
-                    condensed_samples[c] /= samples_this_channel;
-                    
-                    condensed_samples[c] = clamp(condensed_samples[c], -1, 1);
-                }
-                for (int c = 0; c < dev->channels; c++)
-                    buffer[i*dev->channels+c] = unnormalize(condensed_samples[c], -0x10000, 0x10000);
+                // The group can be freed if its last stream dies.
+                mixer_rate_group* next = group->next;
+                mix_group(dev, group, mix, frame);
+                reap_dead_streams(dev, group);
+                group = next;
             }
+            for (int c = 0; c < dev->channels; c++)
+                buffer[i*dev->channels+c] = (int16_t)clamp(unnormalize(mix[c], -0x10000, 0x10000), INT16_MIN, INT16_MAX);
             pthread_mutex_unlock(&dev->streams.lock);
         }
-        // struct timespec end = {};
-        // clock_gettime(1, &end);
-        // double frame_time = (end.tv_nsec - start.tv_nsec) / 1000000000.0;
+        if (fade_in)
+            fade((int16_t*)buffer, dev->channels, MIN(fade_in, nFrames), true);
+        fade_in = 0;
+        if (fade_out)
+        {
+            size_t fade_len = MIN(dev->sample_rate/200 /* 5ms */, nFrames);
+            fade((int16_t*)buffer + (nFrames-fade_len)*dev->channels, dev->channels, fade_len, false);
+        }
         aud_backend_queue_data(dev->info.output_id, buffer, buffer_len);
         memset(buffer, 0x00, buffer_len);
+        if (fade_out && aud_backend_output_drain(dev->info.output_id) >= 0)
+        {
+            // Even if the switch fails, the buffer was faded out.
+            set_sample_rate(dev, sample_rate);
+            fade_in = dev->sample_rate/200;
+        }
     }
-    free(samples);
+    free(mix);
+    free(frame);
     return NULL;
-}
\ No newline at end of file
+}
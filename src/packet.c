@@ -0,0 +1,82 @@
+/*
+ * src/packet.c
+ *
+ * Copyright (c) 2025 Omar Berrow
+ */
+
+#include <obos-aud/compiler.h>
+
+#include <obos-aud/priv/packet.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/param.h>
+
+// Size classes hold payloads of 256, 1k, 4k, 16k and 64k bytes.
+#define NUM_SIZE_CLASSES 5
+#define class_payload_size(class) ((size_t)256 << (2*(class)))
+
+// The payload follows the node, up to OBOS_AUD_PAYLOAD_ALIGNMENT-1 bytes
+// past the first aligned offset, so there is room for that after it.
+#define HEADER_SIZE roundup(sizeof(struct packet_node), OBOS_AUD_PAYLOAD_ALIGNMENT)
+#define node_size(payload_len) roundup(HEADER_SIZE + (payload_len) + OBOS_AUD_PAYLOAD_ALIGNMENT-1, OBOS_AUD_PAYLOAD_ALIGNMENT)
+
+static _Thread_local struct {
+    struct packet_node* head;
+    size_t count;
+} s_pools[NUM_SIZE_CLASSES];
+
+static int size_class_of(size_t payload_len)
+{
+    if (payload_len > OBOS_AUD_PACKET_POOL_MAX_PAYLOAD)
+        return -1;
+    int class = 0;
+    while (class_payload_size(class) < payload_len)
+        class++;
+    return class;
+}
+
+struct packet_node* obos_aud_packet_alloc(size_t payload_len)
+{
+    return obos_aud_packet_alloc_at(payload_len, 0);
+}
+
+struct packet_node* obos_aud_packet_alloc_at(size_t payload_len, size_t packet_offset)
+{
+    int class = size_class_of(payload_len);
+    struct packet_node* node = NULL;
+    if (class != -1 && s_pools[class].head)
+    {
+        node = s_pools[class].head;
+        s_pools[class].head = node->next;
+        s_pools[class].count--;
+    }
+    else
+    {
+        node = aligned_alloc(OBOS_AUD_PAYLOAD_ALIGNMENT, node_size(class == -1 ? payload_len : class_payload_size(class)));
+        if (!node)
+            return NULL;
+    }
+
+    memset(node, 0, sizeof(*node));
+    node->size_class = class;
+    node->pckt.payload_len = payload_len;
+    node->pckt.payload = payload_len ? (char*)node + HEADER_SIZE + packet_offset % OBOS_AUD_PAYLOAD_ALIGNMENT : NULL;
+    return node;
+}
+
+void obos_aud_packet_free(struct packet_node* node)
+{
+    if (!node)
+        return;
+    int class = node->size_class;
+    if (class == -1 || s_pools[class].count >= OBOS_AUD_PACKET_POOL_DEPTH)
+    {
+        free(node);
+        return;
+    }
+    node->next = s_pools[class].head;
+    s_pools[class].head = node;
+    s_pools[class].count++;
+}
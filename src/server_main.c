@@ -11,6 +11,7 @@
 
 #include <obos-aud/priv/con.h>
 #include <obos-aud/priv/mixer.h>
+#include <obos-aud/priv/reactor.h>
 
 #include <strings.h>
 #include <string.h>
@@ -22,7 +23,10 @@
 #include <signal.h>
 #include <pthread.h>
 
+#include <sys/param.h>
+#include <sys/epoll.h>
 #include <sys/poll.h>
+#include <sys/eventfd.h>
 #include <sys/stat.h>
 
 #include <sys/socket.h>
@@ -31,31 +35,56 @@
 #include <netinet/ip.h>
 #include <arpa/inet.h>
 
-static const char* const usage = "%s [-l connection_mode] [-n connection_mode] [-a address] [-m unix_socket_mode] [-d] [-q]\n'connection_mode' can be either tcp or unix.\n";
-
-struct packet_node {
-    aud_packet pckt;
-    size_t poll_fd_idx;
-    struct {
-        const void* buf;
-        size_t len;
-        obos_aud_stream_handle* stream;
-    } decoded_data;
-    int fd;
-    struct packet_node *next, *prev;
-};
-struct {
-    struct packet_node *head, *tail;
-    struct packet_node *first_deferred;
-    pthread_mutex_t mutex;
-} g_packet_queue = {
-    .mutex = PTHREAD_MUTEX_INITIALIZER
+static const char* const usage = "%s [-l connection_mode] [-n connection_mode] [-a address] [-m unix_socket_mode] [-t threads] [-d] [-q]\n'connection_mode' can be either tcp or unix.\n";
+
+static obos_aud_reactor s_reactors[OBOS_AUD_MAX_REACTORS];
+static int s_nReactors;
+// The reactor run by the calling thread.
+static _Thread_local obos_aud_reactor* s_reactor;
+
+static bool receive_packets(obos_aud_socket* sock);
+static void append_packet(struct packet_node*);
+static void end_direct(obos_aud_socket* sock, bool complete);
+static void drop_packets(obos_aud_socket* sock);
+static void dispatch_packet(struct packet_node* curr);
+static void dispatch_packets();
+
+static obos_aud_socket* add_socket(int fd, bool listener);
+static void close_socket(obos_aud_socket* sock);
+static void close_socket_deferred(obos_aud_socket* sock);
+static void release_socket(obos_aud_socket* sock);
+static bool flush_socket(obos_aud_socket* sock);
+static void update_events(obos_aud_socket* sock);
+static bool poll_epoll(bool wait);
+static bool init_reactor(obos_aud_reactor* reactor, int index, int tcp_fd, int unix_fd);
+static void* run_reactor(void* arg);
+
+#if OBOS_AUD_IO_URING
+// Receives go into provided buffers of this size.
+#define URING_BUFFER_SIZE (16*1024)
+#define URING_BUFFER_COUNT 128
+#define URING_ENTRIES 256
+
+// The low bits of an operation's user_data say what it was, the rest is its socket.
+enum {
+    URING_RECV, /* a multishot recv, or accept for listeners */
+    URING_SEND,
+    URING_WAKE,
+    URING_IGNORE,
 };
+#define uring_user_data(sock, op) ((uint64_t)(uintptr_t)(sock) | (op))
 
-static struct packet_node* receive_packet(int fd);
-static struct packet_node* pop_packet();
-static void mark_done();
-static void append_packet(struct packet_node*, bool is_deferred);
+#define s_use_uring (s_reactor->use_uring)
+static bool poll_uring(bool wait);
+static void uring_arm_wake();
+static void uring_arm_recv(obos_aud_socket* sock);
+static void uring_cancel_recv(obos_aud_socket* sock);
+static void uring_send(obos_aud_socket* sock);
+static void uring_stall(obos_aud_socket* sock, bool send);
+static void uring_release_held(obos_aud_socket* sock);
+#else
+#   define s_use_uring false
+#endif
 
 static void quit(int s)
 {
@@ -78,8 +107,10 @@ int main(int argc, char** argv)
     int unix_socket_mode = 0777;
     bool daemonize = false;
     bool quiet = false;
+    // One reactor per core by default.
+    long nThreads = sysconf(_SC_NPROCESSORS_ONLN);
 
-    while ((opt = getopt(argc, argv, "hl:n:m:aqd")) != -1)
+    while ((opt = getopt(argc, argv, "hl:n:m:t:aqd")) != -1)
     {
         switch (opt)
         {
@@ -124,6 +155,18 @@ int main(int argc, char** argv)
                 }
                 break;
             }
+            case 't':
+            {
+                errno = 0;
+                nThreads = strtol(optarg, NULL, 0);
+                if (errno != 0 || nThreads <= 0)
+                {
+                    fputs("Invalid thread count!\n", stderr);
+                    fprintf(stderr, usage, argv[0]);
+                    return -1;
+                }
+                break;
+            }
             case 'd': daemonize = true; break;
             case 'q': quiet = true; break;
             case 'h':
@@ -149,12 +192,9 @@ int main(int argc, char** argv)
         close(null);
     }
 
-    mixer_initialize();
+    s_nReactors = MIN(MAX(nThreads, 1), OBOS_AUD_MAX_REACTORS);
 
-    struct pollfd *fds = calloc(3, sizeof(struct pollfd));
-    size_t nToPoll = 0;
-    if (!fds)
-        abort();
+    mixer_initialize();
 
     struct sockaddr_in ip_addr = {};
     if (inet_pton(AF_INET, bind_address, &ip_addr) != 1)
@@ -169,59 +209,57 @@ int main(int argc, char** argv)
 
     do if (tcp_listen)
     {
-        struct pollfd* fd = &fds[nToPoll++];
-        tcp_fd = fd->fd = socket(AF_INET, SOCK_STREAM, IPPROTO_IP);
-        if (fd->fd == -1)
+        tcp_fd = socket(AF_INET, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, IPPROTO_IP);
+        if (tcp_fd == -1)
         {
             perror("socket(AF_INET, SOCK_STREAM)");
-            nToPoll--;
             break;
         }
         ip_addr.sin_port = htons(OBOS_AUD_TCP_PORT);
-        if (bind(fd->fd, (struct sockaddr*)&ip_addr, sizeof(ip_addr)) != 0)
+        if (bind(tcp_fd, (struct sockaddr*)&ip_addr, sizeof(ip_addr)) != 0)
         {
             perror("tcp bind");
-            nToPoll--;
+            close(tcp_fd);
+            tcp_fd = -1;
             break;
         }
-        if (listen(fd->fd, 128) != 0)
+        if (listen(tcp_fd, 128) != 0)
         {
             perror("listen");
-            nToPoll--;
+            close(tcp_fd);
+            tcp_fd = -1;
             break;
         }
-        fd->events |= POLLIN;
     } while(0);
     do if (unix_listen)
     {
-        struct pollfd* fd = &fds[nToPoll++];
         mode_t old_mask = umask(0);
         mkdir("/tmp/.obos-aud", unix_socket_mode);
-        unix_fd = fd->fd = socket(AF_UNIX, SOCK_STREAM, IPPROTO_IP);
-        if (fd->fd == -1)
+        unix_fd = socket(AF_UNIX, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, IPPROTO_IP);
+        if (unix_fd == -1)
         {
             perror("socket(AF_UNIX, SOCK_STREAM)");
-            nToPoll--;
             break;
         }
-        if (bind(fd->fd, (struct sockaddr*)&unix_addr, sizeof(unix_addr)) != 0)
+        if (bind(unix_fd, (struct sockaddr*)&unix_addr, sizeof(unix_addr)) != 0)
         {
             perror("unix bind");
-            nToPoll--;
+            close(unix_fd);
+            unix_fd = -1;
             break;
         }
-        if (listen(fd->fd, 128) != 0)
+        if (listen(unix_fd, 128) != 0)
         {
             perror("listen");
-            nToPoll--;
+            close(unix_fd);
+            unix_fd = -1;
             break;
         }
         chmod(unix_addr.sun_path, unix_socket_mode);
         umask(old_mask);
-        fd->events |= POLLIN;
     } while(0);
 
-    if (!nToPoll)
+    if (tcp_fd == -1 && unix_fd == -1)
     {
         fprintf(stderr, "Nothing to listen on. Exiting.\n");
         return -1;
@@ -235,6 +273,128 @@ int main(int argc, char** argv)
     signal(SIGQUIT, quit);
     signal(SIGTERM, quit);
 
+    for (int i = 0; i < s_nReactors; i++)
+    {
+        if (!init_reactor(&s_reactors[i], i, tcp_fd, unix_fd))
+            return -1;
+    }
+    for (int i = 1; i < s_nReactors; i++)
+    {
+        int err = pthread_create(&s_reactors[i].thread, NULL, run_reactor, &s_reactors[i]);
+        if (err != 0)
+        {
+            fprintf(stderr, "pthread_create: %s\n", strerror(err));
+            return -1;
+        }
+    }
+    s_reactors[0].thread = pthread_self();
+    run_reactor(&s_reactors[0]);
+
+    // Only reached if the first reactor failed.
+    if (tcp_fd != -1)
+        close(tcp_fd);
+    if (unix_fd != -1)
+        close(unix_fd);
+    if (unix_listen)
+        remove(unix_addr.sun_path);
+
+    return 0;
+}
+
+// Sets up a reactor's event loop, and has it accept connections on the listening sockets.
+static bool init_reactor(obos_aud_reactor* reactor, int index, int tcp_fd, int unix_fd)
+{
+    s_reactor = reactor;
+    reactor->index = index;
+    reactor->epoll_fd = -1;
+    reactor->woken_streams.lock = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
+#if OBOS_AUD_IO_URING
+    s_use_uring = obos_aud_uring_init(&s_reactor->ring, URING_ENTRIES, URING_BUFFER_COUNT, URING_BUFFER_SIZE);
+    if (!s_use_uring && !index)
+        fprintf(stderr, "io_uring is unavailable, falling back to epoll.\n");
+#endif
+    if (!s_use_uring)
+    {
+        s_reactor->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (s_reactor->epoll_fd == -1)
+        {
+            perror("epoll_create1");
+            return false;
+        }
+    }
+    // Lets the mixer wake us up once deferred packets can be pushed.
+    s_reactor->woken_streams.event_fd = eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK);
+    if (s_reactor->woken_streams.event_fd == -1)
+    {
+        perror("eventfd");
+        return false;
+    }
+#if OBOS_AUD_IO_URING
+    if (s_use_uring)
+        uring_arm_wake();
+#endif
+    struct epoll_event wake_ev = {.events=EPOLLIN, .data.ptr=NULL};
+    if (!s_use_uring && epoll_ctl(s_reactor->epoll_fd, EPOLL_CTL_ADD, s_reactor->woken_streams.event_fd, &wake_ev) != 0)
+    {
+        perror("epoll_ctl");
+        return false;
+    }
+
+    // Every reactor waits on the listening sockets, and the
+    // kernel hands each new connection to one of them.
+    if (tcp_fd != -1)
+        add_socket(tcp_fd, true);
+    obos_aud_socket* sock = unix_fd != -1 ? add_socket(unix_fd, true) : NULL;
+    if (sock)
+        sock->local = true;
+    return true;
+}
+
+// Runs one reactor's event loop, until waiting for events fails.
+static void* run_reactor(void* arg)
+{
+    s_reactor = arg;
+
+    // Main server loop
+    while (1)
+    {
+        // Packets left over from last time only need a look at the sockets.
+        bool wait = !s_reactor->ready.head;
+#if OBOS_AUD_IO_URING
+        if (s_use_uring ? !poll_uring(wait) : !poll_epoll(wait))
+            break;
+#else
+        if (!poll_epoll(wait))
+            break;
+#endif
+
+        dispatch_packets();
+
+        // Send everything queued up by this iteration.
+        while (s_reactor->tx_pending.head)
+            flush_socket(s_reactor->tx_pending.head);
+
+        while (s_reactor->released)
+        {
+            obos_aud_socket* sock = s_reactor->released;
+            s_reactor->released = sock->next_ready;
+            free(sock);
+        }
+    }
+
+#if OBOS_AUD_IO_URING
+    if (s_use_uring)
+        obos_aud_uring_free(&s_reactor->ring);
+#endif
+    if (s_reactor->epoll_fd != -1)
+        close(s_reactor->epoll_fd);
+    close(s_reactor->woken_streams.event_fd);
+    return NULL;
+}
+
+// Handles one packet, and frees it unless it was kept.
+static void dispatch_packet(struct packet_node* curr)
+{
     aud_packet ok_status = {
         .opcode = OBOS_AUD_STATUS_REPLY_OK,
         .client_id = 0,
@@ -252,349 +412,994 @@ int main(int argc, char** argv)
         .transmission_id_valid = true,
     };
 
-    // Main server loop
-    while (1)
+    obos_aud_connection* con = NULL;
+    if (curr->pckt.opcode != OBOS_AUD_INITIAL_CONNECTION_REQUEST)
     {
-        int e = TEMP_FAILURE_RETRY(poll(fds, nToPoll, 1000));
-        if (e < 0)
+        con = obos_aud_get_client(curr->sock->fd, curr->pckt.client_id);
+        if (!con)
         {
-            perror("poll");
+            aud_packet resp = {};
+            resp.opcode = OBOS_AUD_STATUS_REPLY_DISCONNECTED;
+            resp.client_id = curr->pckt.client_id;
+            resp.payload = "Client never seen";
+            resp.payload_len = 18;
+            resp.transmission_id = curr->pckt.transmission_id;
+            resp.transmission_id_valid = true;
+            obos_aud_socket_transmit(curr->sock, &resp);
+
+            // Invalid connection
+            close_socket_deferred(curr->sock);
+            obos_aud_packet_free(curr);
+            return;
+        }
+    }
+
+    bool do_not_free = false;
+
+    switch (curr->pckt.opcode) {
+        case OBOS_AUD_INITIAL_CONNECTION_REQUEST:
+            con = obos_aud_process_initial_connection_request(curr->sock, &curr->pckt);
+            break;
+
+        case OBOS_AUD_NOP:
+            ok_status.client_id = con->client_id;
+            ok_status.transmission_id = curr->pckt.transmission_id;
+            obos_aud_socket_transmit(curr->sock, &ok_status);
+            break;
+
+        case OBOS_AUD_DISCONNECT_REQUEST:
+            obos_aud_process_disconnect(con, &curr->pckt);
+            close_socket_deferred(curr->sock);
+            break;
+
+        case OBOS_AUD_OPEN_STREAM:
+            obos_aud_process_stream_open(con, &curr->pckt);
+            break;
+        case OBOS_AUD_CLOSE_STREAM:
+            obos_aud_process_stream_close(con, &curr->pckt);
+            break;
+        case OBOS_AUD_QUERY_OUTPUT_DEVICE:
+            obos_aud_process_output_device_query(con, &curr->pckt);
+            break;
+        case OBOS_AUD_OUTPUT_SET_BUFFER_SAMPLES:
+            obos_aud_process_output_set_buffer_samples(con, &curr->pckt);
+            break;
+        case OBOS_AUD_DATA:
+            do_not_free = obos_aud_process_data(con, curr);
+            break;
+        case OBOS_AUD_STREAM_SET_FLAGS:
+            obos_aud_process_stream_set_flags(con, &curr->pckt);
+            break;
+        case OBOS_AUD_STREAM_GET_FLAGS:
+            obos_aud_process_stream_get_flags(con, &curr->pckt);
+            break;
+        case OBOS_AUD_STREAM_SET_VOLUME:
+            obos_aud_process_stream_set_volume(con, &curr->pckt);
+            break;
+        case OBOS_AUD_STREAM_GET_VOLUME:
+            obos_aud_process_stream_get_volume(con, &curr->pckt);
+            break;
+        case OBOS_AUD_CONNECTION_GET_VOLUME:
+            obos_aud_process_conn_get_volume(con, &curr->pckt);
+            break;
+        case OBOS_AUD_CONNECTION_SET_VOLUME:
+            obos_aud_process_conn_set_volume(con, &curr->pckt);
+            break;
+        case OBOS_AUD_OUTPUT_GET_VOLUME:
+            obos_aud_process_output_get_volume(con, &curr->pckt);
+            break;
+        case OBOS_AUD_OUTPUT_SET_VOLUME:
+            obos_aud_process_output_set_volume(con, &curr->pckt);
+            break;
+        case OBOS_AUD_SET_NAME:
+            obos_aud_process_set_name(con, &curr->pckt);
+            break;
+        case OBOS_AUD_QUERY_CONNECTIONS:
+            obos_aud_process_query_connections(con, &curr->pckt);
+            break;
+        case OBOS_AUD_QUERY_OUTPUT_PARAMETERS:
+            obos_aud_process_output_device_query_parameters(con, &curr->pckt);
+            break;
+        case OBOS_AUD_SET_DEFAULT_OUTPUT:
+            obos_aud_process_set_default_output(con, &curr->pckt);
+            break;
+        case OBOS_AUD_STREAM_OPEN_RING:
+            obos_aud_process_stream_open_ring(con, &curr->pckt);
+            break;
+        case OBOS_AUD_DATAV:
+            do_not_free = obos_aud_process_datav(con, curr);
+            break;
+
+        case OBOS_AUD_STATUS_REPLY_OK:
+        case OBOS_AUD_STATUS_REPLY_UNSUPPORTED:
+        case OBOS_AUD_STATUS_REPLY_INVAL:
+        case OBOS_AUD_STATUS_REPLY_DISCONNECTED:
+        case OBOS_AUD_REQUEST_REPLY_BEGIN...OBOS_AUD_STREAM_OPEN_RING_REPLY:
+            break;
+
+        // Invalid opcode
+        default:
+        {
+            unsupported_status.client_id = con->client_id;
+            unsupported_status.transmission_id = curr->pckt.transmission_id;
+            obos_aud_socket_transmit(curr->sock, &unsupported_status);
             break;
         }
+    }
+    if (!do_not_free)
+    {
+        assert(!curr->next);
+        assert(!curr->prev);
+        obos_aud_packet_free(curr);
+    }
+
+}
+
+// Waits for, if 'wait' is set, and handles, socket readiness.
+// Returns false if waiting failed.
+static bool poll_epoll(bool wait)
+{
+    struct epoll_event events[64];
+    int nEvents = TEMP_FAILURE_RETRY(epoll_wait(s_reactor->epoll_fd, events, sizeof(events)/sizeof(*events), wait ? -1 : 0));
+    if (nEvents < 0)
+    {
+        perror("epoll_wait");
+        return false;
+    }
 
-        for (int i = 0; i < nToPoll; i++)
+    for (int i = 0; i < nEvents; i++)
+    {
+        obos_aud_socket* sock = events[i].data.ptr;
+        if (!sock)
         {
-            if (!fds[i].revents)
-                continue;
-            if (fds[i].revents & POLLERR || fds[i].revents & POLLNVAL || fds[i].revents & POLLHUP)
+            obos_aud_process_woken_streams(&s_reactor->woken_streams);
+            continue;
+        }
+        if (sock->listener)
+        {
+            // Another reactor might have taken the connection first.
+            int new_fd = accept4(sock->fd, NULL, NULL, SOCK_CLOEXEC|SOCK_NONBLOCK);
+            if (new_fd == -1)
             {
-                obos_aud_process_disconnect(obos_aud_get_client_by_fd(fds[i].fd), NULL);
-                if (i != (nToPoll - 1))
-                    fds[i].fd = -fds[i].fd;
-                else
-                    fds = realloc(fds, --nToPoll * sizeof(*fds));
+                if (errno != EAGAIN && errno != EWOULDBLOCK)
+                    perror("accept");
                 continue;
             }
-            if (fds[i].revents & POLLIN)
+            obos_aud_socket* new_sock = add_socket(new_fd, false);
+            if (new_sock)
+                new_sock->local = sock->local;
+            continue;
+        }
+        if (events[i].events & (EPOLLERR|EPOLLHUP))
+        {
+            close_socket(sock);
+            continue;
+        }
+        if (events[i].events & EPOLLOUT && !flush_socket(sock))
+            continue;
+        if (events[i].events & EPOLLIN && !receive_packets(sock))
+            close_socket(sock);
+    }
+    return true;
+}
+
+static obos_aud_socket* add_socket(int fd, bool listener)
+{
+    obos_aud_socket* sock = calloc(1, sizeof(obos_aud_socket));
+    assert(sock);
+    sock->fd = fd;
+    sock->reactor = s_reactor;
+    sock->listener = listener;
+    sock->events = EPOLLIN;
+
+#if OBOS_AUD_IO_URING
+    if (s_use_uring)
+    {
+        uring_arm_recv(sock);
+        return sock;
+    }
+#endif
+
+    // Only wake one of the reactors for a new connection.
+    struct epoll_event ev = {.events=EPOLLIN|(listener ? EPOLLEXCLUSIVE : 0), .data.ptr=sock};
+    if (epoll_ctl(s_reactor->epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0)
+    {
+        perror("epoll_ctl");
+        // Listening sockets are shared with the other reactors.
+        if (!listener)
+            close(fd);
+        free(sock);
+        return NULL;
+    }
+    return sock;
+}
+
+// Disconnects every client on the socket and closes it.
+static void close_socket(obos_aud_socket* sock)
+{
+    if (!s_use_uring)
+        epoll_ctl(s_reactor->epoll_fd, EPOLL_CTL_DEL, sock->fd, NULL);
+    // Streams are freed as the clients are disconnected.
+    end_direct(sock, false);
+    obos_aud_connection* con = NULL;
+    while ((con = obos_aud_get_client_by_fd(sock->fd)))
+        obos_aud_process_disconnect(con, NULL);
+    shutdown(sock->fd, SHUT_RDWR);
+#if OBOS_AUD_IO_URING
+    if (s_use_uring)
+        uring_cancel_recv(sock);
+#endif
+    close(sock->fd);
+    release_socket(sock);
+}
+
+// Stops reading from the socket, and closes it once its queued replies are sent.
+static void close_socket_deferred(obos_aud_socket* sock)
+{
+    sock->closing = true;
+    drop_packets(sock);
+    flush_socket(sock);
+}
+
+// Frees a socket whose fd was already closed.
+static void release_socket(obos_aud_socket* sock)
+{
+    obos_aud_socket_remove_pending(sock);
+    // Its fd is closed, so dropping its queue mustn't resume reading from it.
+    sock->throttled = false;
+    drop_packets(sock);
+#if OBOS_AUD_IO_URING
+    if (s_use_uring)
+        uring_release_held(sock);
+#endif
+    obos_aud_packet_free(sock->rx.node);
+    sock->rx.node = NULL;
+#if OBOS_AUD_IO_URING
+    // The kernel might still be sending from the queue. The
+    // socket is released again once it has nothing left of ours.
+    if (sock->uring.nPending)
+    {
+        sock->uring.released = true;
+        return;
+    }
+#endif
+    obos_aud_socket_discard(sock);
+    // The loop might still be looking at the socket, so
+    // it is only freed once the loop comes round.
+    sock->next_ready = s_reactor->released;
+    s_reactor->released = sock;
+}
+
+// Sends what it can of the socket's queued replies, and updates its epoll events.
+// Returns false if the socket was closed.
+static bool flush_socket(obos_aud_socket* sock)
+{
+    obos_aud_socket_remove_pending(sock);
+#if OBOS_AUD_IO_URING
+    if (s_use_uring)
+    {
+        if (sock->dead || (sock->closing && !sock->tx.head))
+        {
+            close_socket(sock);
+            return false;
+        }
+        if (sock->tx.head && !sock->uring.send_inflight && !sock->uring.send_stalled)
+            uring_send(sock);
+        return true;
+    }
+#endif
+    if (sock->dead || !obos_aud_socket_flush(sock) || (sock->closing && !sock->tx.head))
+    {
+        close_socket(sock);
+        return false;
+    }
+    update_events(sock);
+    return true;
+}
+
+// Registers the epoll events the socket needs now.
+static void update_events(obos_aud_socket* sock)
+{
+    uint32_t events = (sock->closing || sock->throttled ? 0 : EPOLLIN) | (sock->tx.head ? EPOLLOUT : 0);
+    if (events != sock->events)
+    {
+        struct epoll_event ev = {.events=events, .data.ptr=sock};
+        epoll_ctl(s_reactor->epoll_fd, EPOLL_CTL_MOD, sock->fd, &ev);
+        sock->events = events;
+    }
+}
+
+static bool parse_header(obos_aud_socket* sock)
+{
+    aud_header hdr = {};
+    memcpy(&hdr, sock->rx.buf + sock->rx.start, OBOS_AUD_BASE_PROTOCOL_HEADER_SIZE);
+    sock->rx.start += OBOS_AUD_BASE_PROTOCOL_HEADER_SIZE;
+
+    hdr.magic = aud_ntoh32(hdr.magic);
+    hdr.data_offset = aud_ntoh32(hdr.data_offset);
+    hdr.size = aud_ntoh32(hdr.size);
+    hdr.opcode = aud_ntoh32(hdr.opcode);
+    if (hdr.magic != OBOS_AUD_HEADER_MAGIC)
+        return false;
+    // In no protocol version is the header
+    // size less than this many bytes 
+    if (hdr.data_offset < OBOS_AUD_BASE_PROTOCOL_HEADER_SIZE || hdr.size < hdr.data_offset)
+        return false;
+    if (hdr.size > OBOS_AUD_MAX_PACKET_SIZE)
+        return false;
+
+    // Big DATA packets are first read up to their stream id, to see whether
+    // their audio can go straight into the stream. They can't overtake any
+    // packets still waiting to be dispatched, though.
+    size_t payload_len = hdr.size - hdr.data_offset;
+    sock->rx.data_len = 0;
+    if (hdr.opcode == OBOS_AUD_DATA && payload_len >= sizeof(sock->rx.buf) && !sock->queue.head)
+    {
+        sock->rx.data_len = payload_len;
+        payload_len = sizeof(aud_data_payload);
+    }
+
+    // Keep the payload as aligned as the client made it in the packet.
+    struct packet_node* node = obos_aud_packet_alloc_at(payload_len, hdr.data_offset);
+    if (!node)
+        return false;
+    node->sock = sock;
+    node->pckt.transmission_id = hdr.trans_id;
+    node->pckt.transmission_id_valid = true;
+    node->pckt.client_id = hdr.client_id;
+    node->pckt.opcode = hdr.opcode;
+
+    sock->rx.node = node;
+    sock->rx.skip = hdr.data_offset - OBOS_AUD_BASE_PROTOCOL_HEADER_SIZE;
+    sock->rx.data_offset = hdr.data_offset;
+    sock->rx.payload_off = 0;
+    return true;
+}
+
+// Called once a big DATA packet was received up to its stream id.
+// Returns false if the rest of the packet can't be received.
+static bool begin_direct(obos_aud_socket* sock)
+{
+    struct packet_node* node = sock->rx.node;
+    size_t len = sock->rx.data_len - sizeof(aud_data_payload);
+    obos_aud_stream_handle* hnd = NULL;
+    sock->rx.direct_buf = obos_aud_begin_direct_data(node, len, &hnd);
+    if (sock->rx.direct_buf)
+    {
+        sock->rx.direct = hnd;
+        sock->rx.direct_len = len;
+        sock->rx.direct_off = 0;
+        sock->rx.data_len = 0;
+        return true;
+    }
+
+    // Receive the rest of the packet normally.
+    struct packet_node* full = obos_aud_packet_alloc_at(sock->rx.data_len, sock->rx.data_offset);
+    if (!full)
+        return false;
+    full->sock = sock;
+    full->pckt.transmission_id = node->pckt.transmission_id;
+    full->pckt.transmission_id_valid = true;
+    full->pckt.client_id = node->pckt.client_id;
+    full->pckt.opcode = node->pckt.opcode;
+    memcpy(full->pckt.payload, node->pckt.payload, sizeof(aud_data_payload));
+    obos_aud_packet_free(node);
+    sock->rx.node = full;
+    sock->rx.payload_off = sizeof(aud_data_payload);
+    sock->rx.data_len = 0;
+    return true;
+}
+
+static void end_direct(obos_aud_socket* sock, bool complete)
+{
+    if (!sock->rx.direct)
+        return;
+    obos_aud_end_direct_data(sock->rx.node, sock->rx.direct, complete);
+    obos_aud_packet_free(sock->rx.node);
+    sock->rx.node = NULL;
+    sock->rx.direct = NULL;
+    sock->rx.direct_buf = NULL;
+}
+
+static void direct_received(obos_aud_socket* sock, size_t len)
+{
+    aud_stream_commit(&sock->rx.direct->stream_node->data, len);
+    sock->rx.direct_off += len;
+}
+
+// Moves whatever is buffered of the current packet into it.
+static void consume_buffered(obos_aud_socket* sock)
+{
+    size_t avail = sock->rx.len - sock->rx.start;
+    size_t skip = MIN(avail, sock->rx.skip);
+    sock->rx.skip -= skip;
+    sock->rx.start += skip;
+    avail -= skip;
+
+    size_t left = sock->rx.node->pckt.payload_len - sock->rx.payload_off;
+    size_t nCopy = MIN(avail, left);
+    memcpy((char*)sock->rx.node->pckt.payload + sock->rx.payload_off, sock->rx.buf + sock->rx.start, nCopy);
+    sock->rx.payload_off += nCopy;
+    sock->rx.start += nCopy;
+}
+
+// Moves the receive state along as far as it goes with what is buffered, queueing
+// every packet that was completed, and returns where the next bytes are to go.
+// Returns false if the socket should be closed.
+static bool rx_target(obos_aud_socket* sock, void** into, size_t* count)
+{
+    while (1)
+    {
+        *into = NULL;
+        *count = 0;
+        if (sock->rx.direct)
+        {
+            size_t nCopy = MIN(sock->rx.len - sock->rx.start, sock->rx.direct_len - sock->rx.direct_off);
+            memcpy(sock->rx.direct_buf + sock->rx.direct_off, sock->rx.buf + sock->rx.start, nCopy);
+            sock->rx.start += nCopy;
+            if (nCopy)
+                direct_received(sock, nCopy);
+            if (sock->rx.direct_off == sock->rx.direct_len)
             {
-                struct packet_node* node = NULL;
-                if (fds[i].fd == tcp_fd || fds[i].fd == unix_fd)
-                {
-                    int new_fd = accept(fds[i].fd, NULL, NULL);
-                    if (new_fd == -1)
-                    {
-                        perror("accept");
-                        continue;
-                    }
-                    nToPoll++;
-                    fds = realloc(fds, nToPoll*sizeof(*fds));
-                    memset(&fds[nToPoll-1], 0, sizeof(fds[nToPoll-1]));
-                    fds[nToPoll-1].fd = new_fd;
-                    fds[nToPoll-1].events = POLLIN;
-                }
-                else if (!(node = receive_packet(fds[i].fd)))
-                {
-                    obos_aud_connection* con = obos_aud_get_client_by_fd(fds[i].fd);
-                    obos_aud_process_disconnect(con, NULL);
-                    close(fds[i].fd);
-                    shutdown(fds[i].fd, SHUT_RDWR);
-                    if (i != (nToPoll - 1))
-                        fds[i].fd = -fds[i].fd;
-                    else
-                        fds = realloc(fds, --nToPoll * sizeof(*fds));
-                }
-                if (node)
-                    node->poll_fd_idx = i;
+                end_direct(sock, true);
+                continue;
             }
+            *into = sock->rx.direct_buf + sock->rx.direct_off;
+            *count = sock->rx.direct_len - sock->rx.direct_off;
         }
-
-        struct packet_node* curr = NULL;
-        while((curr = pop_packet()))
+        else if (sock->rx.node)
         {
-            obos_aud_connection* con = NULL;
-            if (curr->pckt.opcode != OBOS_AUD_INITIAL_CONNECTION_REQUEST)
+            consume_buffered(sock);
+            size_t left = sock->rx.node->pckt.payload_len - sock->rx.payload_off;
+            if (!sock->rx.skip && !left)
             {
-                con = obos_aud_get_client(curr->fd, curr->pckt.client_id);
-                if (!con)
+                if (sock->rx.data_len)
                 {
-                    aud_packet resp = {};
-                    resp.opcode = OBOS_AUD_STATUS_REPLY_DISCONNECTED;
-                    resp.client_id = curr->pckt.client_id;
-                    resp.payload = "Client never seen";
-                    resp.payload_len = 18;
-                    resp.transmission_id = curr->pckt.transmission_id;
-                    resp.transmission_id_valid = true;
-                    autrans_transmit(curr->fd, &resp);
-
-                    // Invalid connection
-                    shutdown(curr->fd, SHUT_RDWR);
-                    close(curr->fd);
-                    free(curr);
+                    if (!begin_direct(sock))
+                        return false;
                     continue;
                 }
+                append_packet(sock->rx.node);
+                sock->rx.node = NULL;
+                continue;
             }
-
-
-            bool do_not_free = false;
-            
-            switch (curr->pckt.opcode) {
-                case OBOS_AUD_INITIAL_CONNECTION_REQUEST:
-                    con = obos_aud_process_initial_connection_request(curr->fd, &curr->pckt);
-                    break;
-
-                case OBOS_AUD_NOP:
-                    ok_status.client_id = con->client_id;
-                    ok_status.transmission_id = curr->pckt.transmission_id;
-                    autrans_transmit(curr->fd, &ok_status);
-                    break;
-
-                case OBOS_AUD_DISCONNECT_REQUEST:
-                    obos_aud_process_disconnect(con, &curr->pckt);
-                    if (curr->poll_fd_idx != (nToPoll - 1))
-                        fds[curr->poll_fd_idx].fd = -fds[curr->poll_fd_idx].fd;
-                    else
-                        fds = realloc(fds, --nToPoll * sizeof(*fds));
-                    break;
-
-                case OBOS_AUD_OPEN_STREAM:
-                    obos_aud_process_stream_open(con, &curr->pckt);
-                    break;
-                case OBOS_AUD_CLOSE_STREAM:
-                    obos_aud_process_stream_close(con, &curr->pckt);
-                    break;
-                case OBOS_AUD_QUERY_OUTPUT_DEVICE:
-                    obos_aud_process_output_device_query(con, &curr->pckt);
-                    break;
-                case OBOS_AUD_OUTPUT_SET_BUFFER_SAMPLES:
-                    obos_aud_process_output_set_buffer_samples(con, &curr->pckt);
-                    break;
-                case OBOS_AUD_DATA:
-                {
-                    if (curr->pckt.payload_len < sizeof(aud_data_payload))
-                    {
-                        aud_packet inval_status = {
-                            .opcode = OBOS_AUD_STATUS_REPLY_INVAL,
-                            .client_id = con->client_id,
-                            .payload = "Invalid payload length.",
-                            .payload_len = 24,
-                            .transmission_id = curr->pckt.transmission_id,
-                            .transmission_id_valid = true,
-                        };
-                        autrans_transmit(curr->fd, &inval_status);
-                        break;
-                    }
-
-                    aud_data_payload* payload = curr->pckt.payload;
-                    const void* data = payload->data;
-                    size_t len = curr->pckt.payload_len-sizeof(*payload);
-                    obos_aud_stream_handle* stream = NULL;
-
-                    if (curr->decoded_data.buf)
-                    {
-                        len = curr->decoded_data.len;
-                        data = curr->decoded_data.buf;
-                        stream = curr->decoded_data.stream;
-                    }
-                    else
-                    {
-                        stream = obos_aud_get_stream_by_id(con, payload->stream_id);
-                        if (!stream)
-                        {
-                            aud_packet inval_status = {
-                                .opcode = OBOS_AUD_STATUS_REPLY_INVAL,
-                                .client_id = con->client_id,
-                                .payload = "Invalid stream ID.",
-                                .payload_len = 19,
-                                .transmission_id = curr->pckt.transmission_id,
-                                .transmission_id_valid = true,
-                            };
-                            autrans_transmit(curr->fd, &inval_status);
-                            break;
-                        }
-                        stream->refs++;
-                    }
-                    const void* decoded = NULL;
-                    size_t decoded_len = 0;
-
-                    if (stream->should_free)
-                    {
-                        if (!(--stream->refs))
-                            free(stream);
-                        aud_packet stream_dead_status = {
-                            .opcode = OBOS_AUD_STATUS_REPLY_STREAM_DEAD,
-                            .client_id = con->client_id,
-                            .payload = "Asynchronous write failed after stream died.",
-                            .payload_len = 45,
-                            .transmission_id = curr->pckt.transmission_id,
-                            .transmission_id_valid = true,
-                        };
-                        autrans_transmit(curr->fd, &stream_dead_status);
-                        if (curr->decoded_data.buf)
-                        {
-                            do_not_free = true;
-                            free(curr);
-                            free((void*)data);
-                        }
-                        break;
-                    }
-
-                    bool written = data == curr->decoded_data.buf ? 
-                                    aud_stream_push_no_decode(&stream->stream_node->data, data, len, false) :
-                                    aud_stream_push(&stream->stream_node->data, data, len, false, &decoded, &decoded_len);
-                    if (written)
-                    {
-                        ok_status.client_id = curr->pckt.client_id;
-                        ok_status.transmission_id = curr->pckt.transmission_id;
-                        ok_status.transmission_id_valid = true;
-                        autrans_transmit(curr->fd, &ok_status);
-                        do_not_free = true;
-                        if (data == curr->decoded_data.buf)
-                            free((void*)data);
-                        else
-                            free(payload);
-                        if (!(--stream->refs) && stream->should_free)
-                            free(stream);
-                        free(curr);
-                    }
-                    else
-                    {
-                        append_packet(curr, true);
-                        do_not_free = true;
-                        if (decoded)
-                        {
-                            curr->decoded_data.buf = decoded;
-                            curr->decoded_data.len = decoded_len;
-                            curr->decoded_data.stream = stream;
-                            free(payload);
-                        }
-                    }
-
-                    break;
-                }
-                case OBOS_AUD_STREAM_SET_FLAGS:
-                    obos_aud_process_stream_set_flags(con, &curr->pckt);
-                    break;
-                case OBOS_AUD_STREAM_GET_FLAGS:
-                    obos_aud_process_stream_get_flags(con, &curr->pckt);
-                    break;
-                case OBOS_AUD_STREAM_SET_VOLUME:
-                    obos_aud_process_stream_set_volume(con, &curr->pckt);
-                    break;
-                case OBOS_AUD_STREAM_GET_VOLUME:
-                    obos_aud_process_stream_get_volume(con, &curr->pckt);
-                    break;
-                case OBOS_AUD_CONNECTION_GET_VOLUME:
-                    obos_aud_process_conn_get_volume(con, &curr->pckt);
-                    break;
-                case OBOS_AUD_CONNECTION_SET_VOLUME:
-                    obos_aud_process_conn_set_volume(con, &curr->pckt);
-                    break;
-                case OBOS_AUD_OUTPUT_GET_VOLUME:
-                    obos_aud_process_output_get_volume(con, &curr->pckt);
-                    break;
-                case OBOS_AUD_OUTPUT_SET_VOLUME:
-                    obos_aud_process_output_set_volume(con, &curr->pckt);
-                    break;
-                case OBOS_AUD_SET_NAME:
-                    obos_aud_process_set_name(con, &curr->pckt);
-                    break;
-                case OBOS_AUD_QUERY_CONNECTIONS:
-                    obos_aud_process_query_connections(con, &curr->pckt);
-                    break;
-                case OBOS_AUD_QUERY_OUTPUT_PARAMETERS:
-                    obos_aud_process_output_device_query_parameters(con, &curr->pckt);
-                    break;
-                case OBOS_AUD_SET_DEFAULT_OUTPUT:
-                    obos_aud_process_set_default_output(con, &curr->pckt);
-                    break;
-
-                case OBOS_AUD_STATUS_REPLY_OK:
-                case OBOS_AUD_STATUS_REPLY_UNSUPPORTED:
-                case OBOS_AUD_STATUS_REPLY_INVAL:
-                case OBOS_AUD_STATUS_REPLY_DISCONNECTED:
-                case OBOS_AUD_REQUEST_REPLY_BEGIN...OBOS_AUD_QUERY_OUTPUT_PARAMETERS_REPLY:
-                    break;
-
-                // Invalid opcode
-                default:
-                {
-                    unsupported_status.client_id = con->client_id;
-                    unsupported_status.transmission_id = curr->pckt.transmission_id;
-                    autrans_transmit(curr->fd, &unsupported_status);
-                    break;
-                }
-            }
-            if (!do_not_free)
+            // Large payloads are read in place; everything else goes
+            // through the buffer so that small packets share a recv.
+            if (!sock->rx.skip && left >= sizeof(sock->rx.buf))
             {
-                assert(!curr->next);
-                assert(!curr->prev);
-                free(curr->pckt.payload);
-                free(curr);
+                *into = (char*)sock->rx.node->pckt.payload + sock->rx.payload_off;
+                *count = left;
             }
         }
-        mark_done();
+        else if (sock->rx.len - sock->rx.start >= OBOS_AUD_BASE_PROTOCOL_HEADER_SIZE)
+        {
+            if (!parse_header(sock))
+                return false;
+            continue;
+        }
+        else if (sock->rx.start)
+        {
+            memmove(sock->rx.buf, sock->rx.buf + sock->rx.start, sock->rx.len - sock->rx.start);
+            sock->rx.len -= sock->rx.start;
+            sock->rx.start = 0;
+        }
+
+        if (!*into)
+        {
+            if (sock->rx.start == sock->rx.len)
+                sock->rx.start = sock->rx.len = 0;
+            *into = sock->rx.buf + sock->rx.len;
+            *count = sizeof(sock->rx.buf) - sock->rx.len;
+        }
+        return true;
     }
+}
 
-    // Cleanup
-    free(fds);
-    for (int i = 0; i < nToPoll; i++)
-        close(fds[i].fd);
-    if (unix_listen)
-        remove(unix_addr.sun_path);
+// Accounts for len bytes having been received at into, as returned by rx_target.
+static void rx_received(obos_aud_socket* sock, void* into, size_t len)
+{
+    if (into == sock->rx.buf + sock->rx.len)
+        sock->rx.len += len;
+    else if (sock->rx.direct)
+        direct_received(sock, len);
+    else
+        sock->rx.payload_off += len;
+}
 
-    return 0;
+// Reads as much as is available on the socket without blocking,
+// queueing every packet that was completed.
+// Returns false if the socket should be closed.
+static bool receive_packets(obos_aud_socket* sock)
+{
+    while (1)
+    {
+        void* into = NULL;
+        size_t count = 0;
+        if (!rx_target(sock, &into, &count))
+            return false;
+        if (sock->throttled)
+            return true;
+        ssize_t nRead = TEMP_FAILURE_RETRY(recv(sock->fd, into, count, 0));
+        if (nRead < 0)
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        if (nRead == 0)
+            return false;
+        rx_received(sock, into, nRead);
+    }
 }
 
-static struct packet_node* receive_packet(int fd)
+static void ready_append(obos_aud_socket* sock)
 {
-    struct packet_node* node = calloc(1, sizeof(struct packet_node));
-    if (!node)
-        abort();
-    if (autrans_receive(fd, &node->pckt, NULL, 0) != 0)
+    if (!s_reactor->ready.head)
+        s_reactor->ready.head = sock;
+    if (s_reactor->ready.tail)
+        s_reactor->ready.tail->next_ready = sock;
+    sock->prev_ready = s_reactor->ready.tail;
+    s_reactor->ready.tail = sock;
+}
+
+static void ready_remove(obos_aud_socket* sock)
+{
+    if (sock->prev_ready)
+        sock->prev_ready->next_ready = sock->next_ready;
+    else
+        s_reactor->ready.head = sock->next_ready;
+    if (sock->next_ready)
+        sock->next_ready->prev_ready = sock->prev_ready;
+    else
+        s_reactor->ready.tail = sock->prev_ready;
+    sock->next_ready = sock->prev_ready = NULL;
+}
+
+// Stops reading from the socket until its queue was dispatched.
+static void throttle_socket(obos_aud_socket* sock)
+{
+    sock->throttled = true;
+#if OBOS_AUD_IO_URING
+    // Whatever the recv still completes with is held until the socket is resumed.
+    if (s_use_uring)
     {
-        free(node);
-        return NULL;
+        uring_cancel_recv(sock);
+        return;
     }
-    node->fd = fd;
-    append_packet(node, false);
-    return node;
+#endif
+    update_events(sock);
 }
 
-static struct packet_node* pop_packet()
+static void unthrottle_socket(obos_aud_socket* sock)
 {
-    pthread_mutex_lock(&g_packet_queue.mutex);
-    struct packet_node* ret = g_packet_queue.head;
-    if (!ret || ret == g_packet_queue.first_deferred)
+    sock->throttled = false;
+    if (sock->closing)
+        return;
+#if OBOS_AUD_IO_URING
+    // A recv that is still being cancelled resumes once it completes, otherwise
+    // it does the next time round the loop, as the dispatcher might be running.
+    if (s_use_uring)
     {
-        pthread_mutex_unlock(&g_packet_queue.mutex);
-        return NULL;
+        if (!sock->uring.recv_armed && !sock->uring.recv_stalled)
+            uring_stall(sock, false);
+        return;
     }
-    g_packet_queue.head = ret->next;
-    if (g_packet_queue.tail == ret)
-        g_packet_queue.tail = ret->prev;
+#endif
+    update_events(sock);
+}
+
+// Takes the oldest packet off a socket's queue, which must not be empty.
+static struct packet_node* pop_packet(obos_aud_socket* sock)
+{
+    struct packet_node* ret = sock->queue.head;
+    sock->queue.head = ret->next;
+    if (sock->queue.tail == ret)
+        sock->queue.tail = NULL;
     else
         ret->next->prev = NULL;
     ret->prev = NULL;
     ret->next = NULL;
-    pthread_mutex_unlock(&g_packet_queue.mutex);
+    sock->queue.nBytes -= ret->pckt.payload_len;
+    if (!--sock->queue.count)
+        ready_remove(sock);
+    if (sock->throttled &&
+        sock->queue.count <= OBOS_AUD_SOCKET_QUEUE_MAX_PACKETS/4 &&
+        sock->queue.nBytes <= OBOS_AUD_SOCKET_QUEUE_MAX_BYTES/4)
+        unthrottle_socket(sock);
     return ret;
 }
 
-static void mark_done()
+static void append_packet(struct packet_node* node)
+{
+    obos_aud_socket* sock = node->sock;
+    if (!sock->queue.count++)
+        ready_append(sock);
+    sock->queue.nBytes += node->pckt.payload_len;
+    if (!sock->throttled &&
+        (sock->queue.count >= OBOS_AUD_SOCKET_QUEUE_MAX_PACKETS || sock->queue.nBytes >= OBOS_AUD_SOCKET_QUEUE_MAX_BYTES))
+        throttle_socket(sock);
+    if (!sock->queue.head)
+        sock->queue.head = node;
+    if (sock->queue.tail)
+        sock->queue.tail->next = node;
+    node->prev = sock->queue.tail;
+    sock->queue.tail = node;
+}
+
+// Removes every queued packet that came from 'sock'.
+static void drop_packets(obos_aud_socket* sock)
 {
-    g_packet_queue.first_deferred = NULL;
+    while (sock->queue.head)
+        obos_aud_packet_free(pop_packet(sock));
 }
 
-static void append_packet(struct packet_node* node, bool is_deferred)
+// Control packets are cheap, and usually have someone waiting on their reply.
+static bool is_control(const struct packet_node* node)
 {
-    pthread_mutex_lock(&g_packet_queue.mutex);
-    if (!g_packet_queue.head)
-        g_packet_queue.head = node;
-    if (g_packet_queue.tail)
-        g_packet_queue.tail->next = node;
-    node->prev = g_packet_queue.tail;
-    g_packet_queue.tail = node;
-    if (is_deferred && !g_packet_queue.first_deferred )
-        g_packet_queue.first_deferred = node;
-    pthread_mutex_unlock(&g_packet_queue.mutex);
-}
\ No newline at end of file
+    return node->pckt.opcode != OBOS_AUD_DATA && node->pckt.opcode != OBOS_AUD_DATAV;
+}
+
+// Dispatches some of every socket's queued packets, so that a client
+// flooding the server with audio can't hold up everyone else.
+static void dispatch_packets()
+{
+    // Control packets at the front of a queue go first. Ones behind
+    // audio from the same socket still wait for it, to keep their order.
+    for (obos_aud_socket* sock = s_reactor->ready.head; sock; )
+    {
+        // Packets only ever close their own socket, so the next one stays in the list.
+        obos_aud_socket* next = sock->next_ready;
+        for (int i = 0; i < OBOS_AUD_DISPATCH_QUOTA_PACKETS && sock->queue.head && is_control(sock->queue.head); i++)
+            dispatch_packet(pop_packet(sock));
+        sock = next;
+    }
+
+    // Then every socket gets one quota's worth, taking turns round robin.
+    obos_aud_socket* last = s_reactor->ready.tail;
+    while (s_reactor->ready.head)
+    {
+        obos_aud_socket* sock = s_reactor->ready.head;
+        size_t nBytes = 0;
+        for (int i = 0; i < OBOS_AUD_DISPATCH_QUOTA_PACKETS && nBytes < OBOS_AUD_DISPATCH_QUOTA_BYTES && sock->queue.head; i++)
+        {
+            struct packet_node* curr = pop_packet(sock);
+            nBytes += curr->pckt.payload_len;
+            dispatch_packet(curr);
+        }
+        // Sockets with packets left over go to the back of the line.
+        if (sock->queue.head)
+        {
+            ready_remove(sock);
+            ready_append(sock);
+        }
+        if (sock == last)
+            break;
+    }
+}
+
+#if OBOS_AUD_IO_URING
+// Returns NULL if the submission queue is still full after submitting what was queued,
+// such as when the kernel refuses to take more while completions are overflowing.
+static struct io_uring_sqe* uring_get_sqe()
+{
+    return obos_aud_uring_get_sqe(&s_reactor->ring);
+}
+
+// Has an operation on the socket queued again the next time round the loop.
+static void uring_stall(obos_aud_socket* sock, bool send)
+{
+    if (!sock->uring.recv_stalled && !sock->uring.send_stalled)
+    {
+        sock->uring.next_stalled = s_reactor->stalled;
+        s_reactor->stalled = sock;
+    }
+    if (send)
+        sock->uring.send_stalled = true;
+    else
+        sock->uring.recv_stalled = true;
+    sock->uring.nPending++;
+}
+
+static void uring_arm_wake()
+{
+    struct io_uring_sqe* sqe = uring_get_sqe();
+    if (!sqe)
+    {
+        s_reactor->wake_stalled = true;
+        return;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = s_reactor->woken_streams.event_fd;
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = uring_user_data(NULL, URING_WAKE);
+}
+
+static void uring_arm_recv(obos_aud_socket* sock)
+{
+    struct io_uring_sqe* sqe = uring_get_sqe();
+    if (!sqe)
+    {
+        uring_stall(sock, false);
+        return;
+    }
+    sqe->fd = sock->fd;
+    if (sock->listener)
+    {
+        // Accepted sockets are left blocking, as only the kernel does I/O on them,
+        // and it waits for readiness itself instead of failing with EAGAIN.
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->accept_flags = SOCK_CLOEXEC;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    }
+    else
+    {
+        sqe->opcode = IORING_OP_RECV;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = 0;
+    }
+    sqe->user_data = uring_user_data(sock, URING_RECV);
+    sock->uring.recv_armed = true;
+    sock->uring.recv_cancelled = false;
+    sock->uring.nPending++;
+}
+
+static void uring_cancel_recv(obos_aud_socket* sock)
+{
+    if (!sock->uring.recv_armed || sock->uring.recv_cancelled)
+        return;
+    // Otherwise, either the socket was shut down already, which ends the recv anyway,
+    // or it was throttled, and cancelling is tried again as more is received.
+    struct io_uring_sqe* sqe = uring_get_sqe();
+    if (!sqe)
+        return;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = uring_user_data(sock, URING_RECV);
+    sqe->user_data = uring_user_data(NULL, URING_IGNORE);
+    sock->uring.recv_cancelled = true;
+}
+
+static void uring_send(obos_aud_socket* sock)
+{
+    struct io_uring_sqe* sqe = uring_get_sqe();
+    if (!sqe)
+    {
+        uring_stall(sock, true);
+        return;
+    }
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = sock->fd;
+    obos_aud_socket_tx_msg(sock, &sock->uring.msg, sock->uring.iov, sizeof(sock->uring.iov)/sizeof(*sock->uring.iov), &sock->uring.control);
+    sqe->addr = (uintptr_t)&sock->uring.msg;
+    sqe->len = 1;
+    sqe->user_data = uring_user_data(sock, URING_SEND);
+    sock->uring.send_inflight = true;
+    sock->uring.nPending++;
+}
+
+// Called when the kernel is done with an operation on the socket.
+static void uring_put(obos_aud_socket* sock)
+{
+    if (!--sock->uring.nPending && sock->uring.released)
+        release_socket(sock);
+}
+
+// Runs data the kernel received into a provided buffer through the receive state.
+static bool receive_buffer(obos_aud_socket* sock, const char* data, size_t len)
+{
+    void* into = NULL;
+    size_t count = 0;
+    while (len)
+    {
+        if (!rx_target(sock, &into, &count))
+            return false;
+        size_t nCopy = MIN(len, count);
+        memcpy(into, data, nCopy);
+        rx_received(sock, into, nCopy);
+        data += nCopy;
+        len -= nCopy;
+    }
+    // Queue whatever packet this completed.
+    return rx_target(sock, &into, &count);
+}
+
+struct uring_held_buffer {
+    uint16_t bid;
+    uint32_t len;
+    struct uring_held_buffer* next;
+};
+
+static void uring_hold_buffer(obos_aud_socket* sock, uint16_t bid, uint32_t len)
+{
+    struct uring_held_buffer* buf = calloc(1, sizeof(*buf));
+    assert(buf);
+    buf->bid = bid;
+    buf->len = len;
+    if (sock->uring.held.tail)
+        sock->uring.held.tail->next = buf;
+    else
+        sock->uring.held.head = buf;
+    sock->uring.held.tail = buf;
+}
+
+static void uring_release_held(obos_aud_socket* sock)
+{
+    while (sock->uring.held.head)
+    {
+        struct uring_held_buffer* buf = sock->uring.held.head;
+        sock->uring.held.head = buf->next;
+        obos_aud_uring_recycle_buffer(&s_reactor->ring, buf->bid);
+        free(buf);
+    }
+    sock->uring.held.tail = NULL;
+}
+
+// Reads the buffers held while the socket was throttled, for as long as it isn't,
+// then arms its recv again once none are left. Returns false if the socket was closed.
+static bool uring_resume_recv(obos_aud_socket* sock)
+{
+    while (sock->uring.held.head && !sock->throttled)
+    {
+        struct uring_held_buffer* buf = sock->uring.held.head;
+        sock->uring.held.head = buf->next;
+        if (!buf->next)
+            sock->uring.held.tail = NULL;
+        bool ok = sock->closing || receive_buffer(sock, obos_aud_uring_buffer(&s_reactor->ring, buf->bid), buf->len);
+        obos_aud_uring_recycle_buffer(&s_reactor->ring, buf->bid);
+        free(buf);
+        if (!ok)
+        {
+            close_socket(sock);
+            return false;
+        }
+    }
+    if (!sock->throttled && !sock->uring.recv_armed)
+        uring_arm_recv(sock);
+    return true;
+}
+
+static void uring_received(obos_aud_socket* sock, int res, uint32_t flags)
+{
+    bool closed = sock->uring.released;
+    if (closed)
+        ;
+    else if (sock->listener)
+    {
+        obos_aud_socket* new_sock = res >= 0 ? add_socket(res, false) : NULL;
+        if (new_sock)
+            new_sock->local = sock->local;
+        else if (res < 0 && res != -ECANCELED)
+        {
+            errno = -res;
+            perror("accept");
+        }
+    }
+    else if (res > 0)
+    {
+        // Replies are still sent to closing sockets, but nothing more is read from them.
+        uint16_t bid = flags >> IORING_CQE_BUFFER_SHIFT;
+        if (sock->closing)
+            ;
+        // What arrives while the socket is throttled is held, and read in order once it isn't.
+        else if (sock->throttled || sock->uring.held.head)
+        {
+            uring_hold_buffer(sock, bid, res);
+            flags &= ~IORING_CQE_F_BUFFER;
+            closed = !uring_resume_recv(sock);
+        }
+        else if (!receive_buffer(sock, obos_aud_uring_buffer(&s_reactor->ring, bid), res))
+        {
+            close_socket(sock);
+            closed = true;
+        }
+    }
+    // ENOBUFS only means the kernel ran out of provided buffers for a bit,
+    // and ECANCELED that the socket was throttled.
+    else if (res != -ENOBUFS && res != -ECANCELED)
+    {
+        close_socket(sock);
+        closed = true;
+    }
+
+    if (flags & IORING_CQE_F_BUFFER)
+        obos_aud_uring_recycle_buffer(&s_reactor->ring, flags >> IORING_CQE_BUFFER_SHIFT);
+    if (!closed && sock->throttled && (flags & IORING_CQE_F_MORE))
+        uring_cancel_recv(sock);
+    if (!(flags & IORING_CQE_F_MORE))
+    {
+        sock->uring.recv_armed = false;
+        if (!closed)
+            uring_resume_recv(sock);
+        uring_put(sock);
+    }
+}
+
+static void uring_sent(obos_aud_socket* sock, int res)
+{
+    sock->uring.send_inflight = false;
+    if (sock->uring.released)
+        ;
+    else if (res < 0 && res != -EAGAIN && res != -EINTR)
+        close_socket(sock);
+    else
+    {
+        if (res > 0)
+            obos_aud_socket_tx_advance(sock, res);
+        flush_socket(sock);
+    }
+    uring_put(sock);
+}
+
+// Queues again what couldn't be queued while the submission queue was full.
+static void uring_retry_stalled()
+{
+    if (s_reactor->wake_stalled)
+    {
+        s_reactor->wake_stalled = false;
+        uring_arm_wake();
+    }
+    // Anything that stalls again goes on a new list, and is retried the next time round.
+    obos_aud_socket* sock = s_reactor->stalled;
+    s_reactor->stalled = NULL;
+    while (sock)
+    {
+        obos_aud_socket* next = sock->uring.next_stalled;
+        bool recv = sock->uring.recv_stalled;
+        bool send = sock->uring.send_stalled;
+        sock->uring.recv_stalled = false;
+        sock->uring.send_stalled = false;
+        // Holds the socket until the retries are queued.
+        sock->uring.nPending++;
+        if (recv)
+            uring_put(sock);
+        if (send)
+            uring_put(sock);
+        if (recv && !sock->uring.released)
+            uring_resume_recv(sock);
+        if (send && !sock->uring.released)
+            flush_socket(sock);
+        uring_put(sock);
+        sock = next;
+    }
+}
+
+// Submits everything queued up, then waits for, if 'wait' is set, and handles, completions.
+// Returns false if waiting failed.
+static bool poll_uring(bool wait)
+{
+    // Nothing might complete to wake us up if what stalled was what we would be waiting on.
+    uring_retry_stalled();
+    if (s_reactor->stalled || s_reactor->wake_stalled)
+        wait = false;
+    if (obos_aud_uring_submit(&s_reactor->ring, wait) < 0)
+    {
+        perror("io_uring_enter");
+        return false;
+    }
+
+    struct io_uring_cqe* cqe = NULL;
+    while ((cqe = obos_aud_uring_peek_cqe(&s_reactor->ring)))
+    {
+        uint64_t user_data = cqe->user_data;
+        int res = cqe->res;
+        uint32_t flags = cqe->flags;
+        obos_aud_uring_cqe_seen(&s_reactor->ring);
+
+        obos_aud_socket* sock = (obos_aud_socket*)(uintptr_t)(user_data & ~(uint64_t)3);
+        switch (user_data & 3) {
+            case URING_WAKE:
+                obos_aud_process_woken_streams(&s_reactor->woken_streams);
+                if (!(flags & IORING_CQE_F_MORE))
+                    uring_arm_wake();
+                break;
+            case URING_RECV:
+                uring_received(sock, res, flags);
+                break;
+            case URING_SEND:
+                uring_sent(sock, res);
+                break;
+            default:
+                break;
+        }
+    }
+    return true;
+}
+#endif
@@ -0,0 +1,202 @@
+/*
+ * src/socket.c
+ *
+ * Copyright (c) 2025 Omar Berrow
+ */
+
+#define _GNU_SOURCE 1
+
+#include <obos-aud/trans.h>
+#include <obos-aud/compiler.h>
+
+#include <obos-aud/priv/socket.h>
+#include <obos-aud/priv/reactor.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <sys/uio.h>
+
+static void add_pending(obos_aud_socket* sock)
+{
+    if (sock->tx_pending)
+        return;
+    struct obos_aud_socket_list* const list = &sock->reactor->tx_pending;
+    if (!list->head)
+        list->head = sock;
+    if (list->tail)
+        list->tail->next = sock;
+    sock->prev = list->tail;
+    sock->next = NULL;
+    list->tail = sock;
+    sock->tx_pending = true;
+}
+
+void obos_aud_socket_remove_pending(obos_aud_socket* sock)
+{
+    if (!sock->tx_pending)
+        return;
+    struct obos_aud_socket_list* const list = &sock->reactor->tx_pending;
+    if (sock->prev)
+        sock->prev->next = sock->next;
+    if (sock->next)
+        sock->next->prev = sock->prev;
+    if (list->head == sock)
+        list->head = sock->next;
+    if (list->tail == sock)
+        list->tail = sock->prev;
+    sock->next = sock->prev = NULL;
+    sock->tx_pending = false;
+}
+
+static void free_buffer(obos_aud_tx_buffer* buf)
+{
+    for (int i = 0; i < buf->nFds; i++)
+        close(buf->fds[i]);
+    free(buf);
+}
+
+static void free_tx(obos_aud_socket* sock)
+{
+    for (obos_aud_tx_buffer* curr = sock->tx.head; curr; )
+    {
+        obos_aud_tx_buffer* next = curr->next;
+        free_buffer(curr);
+        curr = next;
+    }
+    sock->tx.head = sock->tx.tail = NULL;
+    sock->tx.nBytes = 0;
+}
+
+int obos_aud_socket_transmit(obos_aud_socket* sock, aud_packet* pckt)
+{
+    return obos_aud_socket_transmit_fds(sock, pckt, NULL, 0);
+}
+
+int obos_aud_socket_transmit_fds(obos_aud_socket* sock, aud_packet* pckt, const int* fds, int nFds)
+{
+    assert(nFds <= OBOS_AUD_SOCKET_MAX_FDS);
+    if (sock->dead)
+    {
+        for (int i = 0; i < nFds; i++)
+            close(fds[i]);
+        errno = ECONNRESET;
+        return -1;
+    }
+
+    size_t len = sizeof(aud_header) + pckt->payload_len;
+    if (sock->tx.head && (sock->tx.nBytes + len) > OBOS_AUD_SOCKET_MAX_BACKLOG)
+    {
+        // The client isn't reading its replies.
+#if OBOS_AUD_IO_URING
+        // The kernel might still be sending from the queue.
+        if (!sock->uring.send_inflight)
+#endif
+        free_tx(sock);
+        for (int i = 0; i < nFds; i++)
+            close(fds[i]);
+        sock->dead = true;
+        add_pending(sock);
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    obos_aud_tx_buffer* buf = malloc(sizeof(*buf) + len);
+    assert(buf);
+    buf->len = len;
+    buf->off = 0;
+    buf->next = NULL;
+    buf->nFds = nFds;
+    if (nFds)
+        memcpy(buf->fds, fds, nFds*sizeof(int));
+    autrans_make_header((aud_header*)buf->data, pckt);
+    if (pckt->payload_len)
+        memcpy(buf->data + sizeof(aud_header), pckt->cpayload, pckt->payload_len);
+
+    if (!sock->tx.head)
+        sock->tx.head = buf;
+    if (sock->tx.tail)
+        sock->tx.tail->next = buf;
+    sock->tx.tail = buf;
+    sock->tx.nBytes += len;
+
+    add_pending(sock);
+    return len;
+}
+
+void obos_aud_socket_tx_msg(obos_aud_socket* sock, struct msghdr* msg, struct iovec* iov, int nIov, obos_aud_tx_control* control)
+{
+    memset(msg, 0, sizeof(*msg));
+    int i = 0;
+    for (obos_aud_tx_buffer* curr = sock->tx.head; curr && i < nIov; curr = curr->next)
+    {
+        // File descriptors go with the first byte of a sendmsg.
+        if (curr->nFds && i)
+            break;
+        iov[i].iov_base = curr->data + curr->off;
+        iov[i].iov_len = curr->len - curr->off;
+        i++;
+    }
+    msg->msg_iov = iov;
+    msg->msg_iovlen = i;
+
+    obos_aud_tx_buffer* head = sock->tx.head;
+    if (head && head->nFds)
+    {
+        msg->msg_control = control->buf;
+        msg->msg_controllen = CMSG_SPACE(sizeof(int)*head->nFds);
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int)*head->nFds);
+        memcpy(CMSG_DATA(cmsg), head->fds, sizeof(int)*head->nFds);
+    }
+}
+
+void obos_aud_socket_tx_advance(obos_aud_socket* sock, size_t nWritten)
+{
+    sock->tx.nBytes -= nWritten;
+    while (nWritten)
+    {
+        obos_aud_tx_buffer* curr = sock->tx.head;
+        size_t left = curr->len - curr->off;
+        if (nWritten < left)
+        {
+            // The file descriptors were sent with the first byte.
+            for (int i = 0; i < curr->nFds; i++)
+                close(curr->fds[i]);
+            curr->nFds = 0;
+            curr->off += nWritten;
+            break;
+        }
+        nWritten -= left;
+        sock->tx.head = curr->next;
+        free_buffer(curr);
+    }
+    if (!sock->tx.head)
+        sock->tx.tail = NULL;
+}
+
+bool obos_aud_socket_flush(obos_aud_socket* sock)
+{
+    while (sock->tx.head)
+    {
+        struct iovec iov[64];
+        struct msghdr msg;
+        obos_aud_tx_control control;
+        obos_aud_socket_tx_msg(sock, &msg, iov, 64, &control);
+        ssize_t nWritten = TEMP_FAILURE_RETRY(sendmsg(sock->fd, &msg, 0));
+        if (nWritten < 0)
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        obos_aud_socket_tx_advance(sock, nWritten);
+    }
+    return true;
+}
+
+void obos_aud_socket_discard(obos_aud_socket* sock)
+{
+    obos_aud_socket_remove_pending(sock);
+    free_tx(sock);
+}
@@ -15,11 +15,18 @@
 #include <errno.h>
 #include <math.h>
 
+#include <unistd.h>
+
 #include <sys/param.h>
+#include <sys/mman.h>
 
 #include <obos-aud/stream.h>
+#include <obos-aud/trans.h>
 #include <obos-aud/priv/mixer.h>
 
+// ADPCM is decoded this many bytes at a time, into adpcm_buffer.
+#define ADPCM_CHUNK_SIZE 2048
+
 // source: just trust me bro
 static int16_t ulaw_decode_table[256] = {
     -32124, -31100, -30076, -29052, -28028, -27004, -25980, -24956,
@@ -92,37 +99,401 @@ static int16_t alaw_decode_table[256] = {
 };
 
 
-void aud_stream_initialize(aud_stream* stream, int sample_rate, int dev_sample_rate, int channels)
+size_t aud_stream_sample_size(uint32_t flags)
+{
+    if (flags & (OBOS_AUD_STREAM_FLAGS_ULAW_DECODE|OBOS_AUD_STREAM_FLAGS_ALAW_DECODE))
+        return 1;
+    else if (flags & OBOS_AUD_STREAM_FLAGS_PCM24_DECODE)
+        return 3;
+    else if (flags & (OBOS_AUD_STREAM_FLAGS_PCM32_DECODE|OBOS_AUD_STREAM_FLAGS_F32_DECODE))
+        return 4;
+    return sizeof(int16_t);
+}
+
+// Ten seconds of audio in the stream's format.
+static size_t buffer_size(aud_stream* stream, uint32_t flags)
+{
+    return aud_stream_sample_size(flags)*stream->sample_rate*stream->channels*10;
+}
+
+static bool is_planar(uint32_t flags)
+{
+    return flags & OBOS_AUD_STREAM_FLAGS_PLANAR_F32_STORAGE;
+}
+
+static float* plane(aud_stream* stream, int channel)
+{
+    return (float*)stream->buffer + channel*stream->plane_stride;
+}
+
+static void allocate_buffer(aud_stream* stream, uint32_t flags)
+{
+    if (is_planar(flags))
+    {
+        // Ten seconds of audio, with every plane aligned to 64 bytes.
+        stream->size = stream->sample_rate*10;
+        stream->plane_stride = (stream->size + 15) & ~15;
+        stream->buffer = aligned_alloc(64, stream->plane_stride*stream->channels*sizeof(float));
+    }
+    else
+    {
+        stream->size = buffer_size(stream, flags);
+        stream->plane_stride = 0;
+        stream->buffer = malloc(stream->size);
+    }
+    assert(stream->buffer);
+}
+
+void aud_stream_initialize(aud_stream* stream, int sample_rate, int channels)
 {
     stream->mut = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
     stream->write_event = (pthread_cond_t)PTHREAD_COND_INITIALIZER;
     stream->sample_rate = sample_rate;
     stream->channels = channels;
-    stream->size = sizeof(int16_t)*dev_sample_rate*channels*10;
-    stream->buffer = malloc(stream->size);
+    allocate_buffer(stream, 0);
+    // Room for a frame of the biggest sample size.
+    stream->partial = malloc(channels*sizeof(int32_t));
+    assert(stream->partial);
+}
+
+void aud_stream_free(aud_stream* stream)
+{
+    free(stream->buffer);
+    free(stream->partial);
+    free(stream->adpcm_buffer);
+    if (stream->adpcm)
+        autrans_adpcm_free(stream->adpcm);
+    if (stream->ring.hdr)
+    {
+        // Let a writer waiting for room know that there won't be any.
+        __atomic_store_n(&stream->ring.hdr->dead, 1, __ATOMIC_RELEASE);
+        uint64_t one = 1;
+        write(stream->ring.event_fd, &one, sizeof(one));
+        munmap(stream->ring.hdr, stream->ring.map_size);
+        close(stream->ring.event_fd);
+    }
+}
+
+// The format data is kept in while it is buffered.
+static uint32_t storage_format(uint32_t flags)
+{
+    return flags & ~OBOS_AUD_STREAM_FLAGS_ADPCM_DECODE;
+}
+
+bool aud_stream_set_flags(aud_stream* stream, uint32_t flags)
+{
+    bool res = true;
+    pthread_mutex_lock(&stream->mut);
+    if (stream->reserved)
+    {
+        res = false;
+        goto done;
+    }
+    // Audio from the ring is copied as it is.
+    if (stream->ring.hdr && (is_planar(flags) || (flags & OBOS_AUD_STREAM_FLAGS_ADPCM_DECODE)))
+    {
+        res = false;
+        goto done;
+    }
+    if (is_planar(flags) != is_planar(stream->flags))
+    {
+        if (stream->ptr != stream->in_ptr || stream->nPendingFormats)
+        {
+            res = false;
+            goto done;
+        }
+        free(stream->buffer);
+        allocate_buffer(stream, flags);
+        stream->ptr = stream->in_ptr = 0;
+        stream->in_flags = flags;
+    }
+    else if (is_planar(flags))
+    {
+        // Data is decoded when pushed, so there is nothing to queue.
+        stream->in_flags = flags;
+    }
+    else
+    {
+        if (stream->ptr == stream->in_ptr && !stream->nPendingFormats)
+            stream->in_flags = flags;
+        else if (storage_format(stream->flags) != storage_format(flags))
+        {
+            if (stream->nPendingFormats == OBOS_AUD_STREAM_MAX_PENDING_FORMATS)
+            {
+                res = false;
+                goto done;
+            }
+            stream->pending_formats[stream->nPendingFormats].flags = flags;
+            stream->pending_formats[stream->nPendingFormats].at = stream->ptr;
+            stream->nPendingFormats++;
+        }
+        size_t new_size = buffer_size(stream, flags);
+        if (new_size > stream->size)
+        {
+            void* new_buffer = realloc(stream->buffer, new_size);
+            if (new_buffer)
+            {
+                stream->buffer = new_buffer;
+                stream->size = new_size;
+            }
+        }
+    }
+
+    // Start a fresh ADPCM stream whenever the client switches to it.
+    if ((flags & OBOS_AUD_STREAM_FLAGS_ADPCM_DECODE) && !(stream->flags & OBOS_AUD_STREAM_FLAGS_ADPCM_DECODE))
+    {
+        if (!stream->adpcm)
+        {
+            stream->adpcm = autrans_adpcm_create(stream->channels);
+            // The decoded chunk, followed by the decoder state from before it.
+            stream->adpcm_buffer = malloc(ADPCM_CHUNK_SIZE*2*sizeof(int16_t) + autrans_adpcm_state_size(stream->channels));
+            assert(stream->adpcm_buffer);
+        }
+        else
+            autrans_adpcm_reset(stream->adpcm);
+        stream->adpcm_off = 0;
+    }
+    // A frame cut off in the old format can't be finished in the new one.
+    if (flags != stream->flags)
+        stream->nPartial = 0;
+    stream->flags = flags;
+
+    done:
+    pthread_mutex_unlock(&stream->mut);
+    return res;
+}
+
+// Applies any format changes that have been reached by in_ptr.
+static void apply_pending_formats(aud_stream* stream)
+{
+    int i = 0;
+    for (; i < stream->nPendingFormats && stream->pending_formats[i].at <= stream->in_ptr; i++)
+        stream->in_flags = stream->pending_formats[i].flags;
+    if (!i)
+        return;
+    stream->nPendingFormats -= i;
+    memmove(stream->pending_formats, &stream->pending_formats[i], stream->nPendingFormats*sizeof(*stream->pending_formats));
+}
+
+// Called once all buffered data was consumed.
+// The stream must be locked.
+static void reset(aud_stream* stream)
+{
+    // A reserved stream is still being written to past ptr.
+    if (!stream->reserved)
+        stream->in_ptr = stream->ptr = 0;
+    stream->nPendingFormats = 0;
+    stream->in_flags = stream->flags;
+    pthread_cond_signal(&stream->write_event);
+}
+
+// Moves unread data to the start of the buffer.
+// The stream must be locked.
+static void compact(aud_stream* stream)
+{
+    size_t unread = stream->ptr - stream->in_ptr;
+    if (is_planar(stream->flags))
+    {
+        for (int i = 0; i < stream->channels; i++)
+            memmove(plane(stream, i), plane(stream, i) + stream->in_ptr, unread*sizeof(float));
+        stream->in_ptr = 0;
+        stream->ptr = unread;
+        return;
+    }
+    memmove(stream->buffer, (char*)stream->buffer + stream->in_ptr, unread);
+    for (int i = 0; i < stream->nPendingFormats; i++)
+        stream->pending_formats[i].at -= stream->in_ptr;
+    stream->in_ptr = 0;
+    stream->ptr = unread;
+}
+
+// Lets a writer that is waiting for room know that its data fits now.
+// The stream must be locked.
+static void check_space(aud_stream* stream)
+{
+    if (!stream->space_wanted)
+        return;
+    if (stream->size - (stream->ptr - stream->in_ptr) < stream->space_wanted)
+        return;
+    stream->space_wanted = 0;
+    if (stream->space_callback)
+        stream->space_callback(stream, stream->space_udata);
+}
+
+static float clamp(float value, float min, float max)
+{
+    return value < min ? min : ((value > max) ? max : value);
+}
+
+// Decodes one sample into the range of PCM16, without truncating it.
+static float decode_sample(uint32_t flags, const uint8_t* data)
+{
+    if (flags & OBOS_AUD_STREAM_FLAGS_ULAW_DECODE)
+        return ulaw_decode_table[*data];
+    else if (flags & OBOS_AUD_STREAM_FLAGS_ALAW_DECODE)
+        return alaw_decode_table[*data];
+    else if (flags & OBOS_AUD_STREAM_FLAGS_PCM32_DECODE)
+    {
+        int32_t sample = 0;
+        memcpy(&sample, data, sizeof(sample));
+        return sample / 65536.f;
+    }
+    else if (flags & OBOS_AUD_STREAM_FLAGS_PCM24_DECODE)
+    {
+        int32_t sample = (int32_t)((uint32_t)data[0] << 8 | (uint32_t)data[1] << 16 | (uint32_t)data[2] << 24);
+        return sample / 65536.f;
+    }
+    else if (flags & OBOS_AUD_STREAM_FLAGS_F32_DECODE)
+    {
+        float sample = 0;
+        memcpy(&sample, data, sizeof(sample));
+        return clamp(sample, -1, 1) * 32767;
+    }
+    int16_t sample = 0;
+    memcpy(&sample, data, sizeof(sample));
+    return sample;
+}
+
+// Deinterleaves plain PCM16 that starts on an OBOS_AUD_PAYLOAD_ALIGNMENT
+// boundary, as DATA audio from clients that pad their headers does.
+static void decode_pcm16_aligned(aud_stream* stream, const void* data, size_t at, size_t frames)
+{
+    const int16_t* src = __builtin_assume_aligned(data, OBOS_AUD_PAYLOAD_ALIGNMENT);
+    const int channels = stream->channels;
+    for (int c = 0; c < channels; c++)
+    {
+        float* out = plane(stream, c) + at;
+        for (size_t i = 0; i < frames; i++)
+            out[i] = src[i*channels + c];
+    }
+}
+
+// Decodes data into the planes at the write pointer. A frame cut off at
+// the end is kept, and finished by the next push.
+static bool push_planar(aud_stream* stream, const void* data, size_t len, bool blocking)
+{
+    const size_t sample_size = aud_stream_sample_size(stream->flags);
+    const size_t frame_size = sample_size*stream->channels;
+    const size_t frames = (stream->nPartial + len) / frame_size;
+    pthread_mutex_lock(&stream->mut);
+    if (frames > (stream->size - stream->ptr) && stream->in_ptr)
+        compact(stream);
+    if (frames > stream->size || stream->split_off)
+    {
+        while (stream->ptr > 0)
+        {
+            if (!blocking)
+            {
+                stream->space_wanted = stream->size;
+                pthread_mutex_unlock(&stream->mut);
+                return false;
+            }
+            pthread_cond_wait(&stream->write_event, &stream->mut);
+        }
+        pthread_mutex_unlock(&stream->mut);
+        // When the push is retried, it carries on from where it had to stop.
+        size_t off = stream->split_off;
+        stream->split_off = 0;
+        while (off < len)
+        {
+            size_t nToWrite = MIN(len - off, stream->size*frame_size - stream->nPartial);
+            if (!push_planar(stream, (const char*)data + off, nToWrite, blocking))
+            {
+                stream->split_off = off;
+                return false;
+            }
+            off += nToWrite;
+        }
+        return true;
+    }
+    while (frames > (stream->size - stream->ptr))
+    {
+        if (!blocking)
+        {
+            stream->space_wanted = frames;
+            pthread_mutex_unlock(&stream->mut);
+            return false;
+        }
+        pthread_cond_wait(&stream->write_event, &stream->mut);
+    }
+    const size_t at = stream->ptr;
+    pthread_mutex_unlock(&stream->mut);
+
+    // Decode without the lock held, so the mixer is never kept waiting on it.
+    const uint8_t* src = data;
+    size_t nDecoded = 0;
+    if (stream->nPartial && frames)
+    {
+        const size_t rest = frame_size - stream->nPartial;
+        memcpy(stream->partial + stream->nPartial, src, rest);
+        for (int c = 0; c < stream->channels; c++)
+            plane(stream, c)[at] = decode_sample(stream->flags, stream->partial + c*sample_size);
+        stream->nPartial = 0;
+        src += rest;
+        len -= rest;
+        nDecoded = 1;
+    }
+    if (!(stream->flags & OBOS_AUD_STREAM_DECODE_MASK) && !((uintptr_t)src % OBOS_AUD_PAYLOAD_ALIGNMENT))
+        decode_pcm16_aligned(stream, src, at + nDecoded, frames - nDecoded);
+    else
+    {
+        const uint8_t* in = src;
+        for (size_t i = nDecoded; i < frames; i++)
+            for (int c = 0; c < stream->channels; c++, in += sample_size)
+                plane(stream, c)[at+i] = decode_sample(stream->flags, in);
+    }
+    src += (frames - nDecoded)*frame_size;
+    len -= (frames - nDecoded)*frame_size;
+    memcpy(stream->partial + stream->nPartial, src, len);
+    stream->nPartial += len;
+
+    pthread_mutex_lock(&stream->mut);
+    // The mixer might have drained the stream, and rewound ptr, in the meantime.
+    if (stream->ptr != at)
+        for (int c = 0; c < stream->channels; c++)
+            memmove(plane(stream, c) + stream->ptr, plane(stream, c) + at, frames*sizeof(float));
+    stream->ptr += frames;
+    pthread_mutex_unlock(&stream->mut);
+    return true;
 }
 
-bool aud_stream_push_no_decode(aud_stream* stream, const void* data, size_t len, bool blocking)
+static bool push_raw(aud_stream* stream, const void* data, size_t len, bool blocking)
 {
-    if (len > (stream->size - stream->ptr))
+    if (len > (stream->size - stream->ptr) || stream->split_off)
     {
         pthread_mutex_lock(&stream->mut);
+        if (stream->in_ptr)
+            compact(stream);
+        if (len <= (stream->size - stream->ptr) && !stream->split_off)
+        {
+            memcpy((char*)stream->buffer + stream->ptr, data, len);
+            stream->ptr += len;
+            pthread_mutex_unlock(&stream->mut);
+            return true;
+        }
         while (stream->ptr > 0)
         {
             if (!blocking)
             {
+                stream->space_wanted = MIN(len, stream->size);
                 pthread_mutex_unlock(&stream->mut);
                 return false;
             }
             pthread_cond_wait(&stream->write_event, &stream->mut);
         }
         pthread_mutex_unlock(&stream->mut);
-        size_t initial_len = len;
-        while (len)
+        // When the push is retried, it carries on from where it had to stop.
+        size_t off = stream->split_off;
+        stream->split_off = 0;
+        while (off < len)
         {
-            size_t nToWrite = len > stream->size ? stream->size : len;
-            aud_stream_push_no_decode(stream, (const char*)data + (initial_len-len), nToWrite, blocking);
-            len -= nToWrite;
+            size_t nToWrite = MIN(len - off, stream->size);
+            if (!push_raw(stream, (const char*)data + off, nToWrite, blocking))
+            {
+                stream->split_off = off;
+                return false;
+            }
+            off += nToWrite;
         }
         return true;
     }
@@ -131,6 +502,7 @@ bool aud_stream_push_no_decode(aud_stream* stream, const void* data, size_t len,
     {
         if (!blocking)
         {
+            stream->space_wanted = MAX(len, 1);
             pthread_mutex_unlock(&stream->mut);
             return false;
         }
@@ -142,115 +514,217 @@ bool aud_stream_push_no_decode(aud_stream* stream, const void* data, size_t len,
     return true;
 }
 
-static int16_t read_sample(const int16_t* buffer, int channel, int channels, size_t buffer_len, float idx)
+bool aud_stream_push(aud_stream* stream, const void* data, size_t len, bool blocking)
+{
+    if (!(stream->flags & OBOS_AUD_STREAM_FLAGS_ADPCM_DECODE) || !stream->adpcm)
+        return is_planar(stream->flags) ?
+            push_planar(stream, data, len, blocking) :
+            push_raw(stream, data, len, blocking);
+
+    // ADPCM is decoded here, as its samples depend on all the ones before them.
+    const size_t state_size = autrans_adpcm_state_size(stream->channels);
+    int16_t* decoded = stream->adpcm_buffer;
+    autrans_adpcm_state* saved = (void*)(decoded + ADPCM_CHUNK_SIZE*2);
+    // When the push is retried, it carries on from the chunk that didn't fit.
+    size_t off = stream->adpcm_off;
+    stream->adpcm_off = 0;
+    while (off < len)
+    {
+        size_t nToDecode = MIN(len - off, ADPCM_CHUNK_SIZE);
+        memcpy(saved, stream->adpcm, state_size);
+        size_t nSamples = autrans_adpcm_decode(stream->adpcm, (const uint8_t*)data + off, nToDecode, decoded);
+        bool res = is_planar(stream->flags) ?
+            push_planar(stream, decoded, nSamples*sizeof(int16_t), blocking) :
+            push_raw(stream, decoded, nSamples*sizeof(int16_t), blocking);
+        if (!res)
+        {
+            // Rewind the decoder, the chunk will be decoded again.
+            memcpy(stream->adpcm, saved, state_size);
+            stream->adpcm_off = off;
+            return false;
+        }
+        off += nToDecode;
+    }
+    return true;
+}
+
+void* aud_stream_reserve(aud_stream* stream, size_t len)
 {
-    assert(buffer);
-    return buffer[((int)idx)*channels + channel];
+    if (is_planar(stream->flags) || (stream->flags & OBOS_AUD_STREAM_FLAGS_ADPCM_DECODE))
+        return NULL;
+    pthread_mutex_lock(&stream->mut);
+    if (len > (stream->size - stream->ptr) && stream->in_ptr)
+        compact(stream);
+    void* ret = NULL;
+    if (!stream->reserved && len <= (stream->size - stream->ptr))
+    {
+        stream->reserved = true;
+        ret = (char*)stream->buffer + stream->ptr;
+    }
+    pthread_mutex_unlock(&stream->mut);
+    return ret;
 }
 
-static float clamp(float value, float min, float max)
+void aud_stream_commit(aud_stream* stream, size_t len)
 {
-    return value < min ? min : ((value > max) ? max : value);
+    pthread_mutex_lock(&stream->mut);
+    stream->ptr += len;
+    pthread_mutex_unlock(&stream->mut);
+}
+
+void aud_stream_unreserve(aud_stream* stream)
+{
+    pthread_mutex_lock(&stream->mut);
+    stream->reserved = false;
+    if (stream->ptr == stream->in_ptr)
+        reset(stream);
+    pthread_mutex_unlock(&stream->mut);
 }
 
-bool aud_stream_push(aud_stream* stream, const void* buf, size_t len, bool blocking, const void** decoded_out, size_t* decoded_data_len)
+bool aud_stream_attach_ring(aud_stream* stream, struct aud_shm_ring* hdr, size_t map_size, int event_fd)
 {
-    if (((stream->flags & OBOS_AUD_STREAM_DECODE_MASK) == 0) && stream->dev->sample_rate == stream->sample_rate)
-        return aud_stream_push_no_decode(stream, buf, len, blocking);
-    size_t newlen = len;
-    if (stream->flags & OBOS_AUD_STREAM_FLAGS_ULAW_DECODE)
-        newlen /=  (8.f/16.f);
-    else if (stream->flags & OBOS_AUD_STREAM_FLAGS_ALAW_DECODE)
-        newlen /=  (8.f/16.f);
-    else if (stream->flags & OBOS_AUD_STREAM_FLAGS_PCM32_DECODE)
-        newlen /= (32.f/16.f);
-    else if (stream->flags & OBOS_AUD_STREAM_FLAGS_PCM24_DECODE)
-        newlen /= (24.f/16.f);
-    else if (stream->flags & OBOS_AUD_STREAM_FLAGS_F32_DECODE)
-        newlen /= (32.f/16.f);
-    int16_t* decoded = malloc(newlen);
-    assert(decoded);
-    if (stream->flags & OBOS_AUD_STREAM_FLAGS_ULAW_DECODE)
+    bool res = false;
+    pthread_mutex_lock(&stream->mut);
+    if (!stream->ring.hdr && !is_planar(stream->flags) && !(stream->flags & OBOS_AUD_STREAM_FLAGS_ADPCM_DECODE))
     {
-        const uint8_t* data = buf;
-        for (size_t i = 0; i < (len / sizeof(*data)); i++)
-            decoded[i] = ulaw_decode_table[data[i]];
+        stream->ring.hdr = hdr;
+        stream->ring.data = (char*)hdr + hdr->data_offset;
+        stream->ring.size = hdr->size;
+        stream->ring.map_size = map_size;
+        stream->ring.event_fd = event_fd;
+        res = true;
     }
-    else if (stream->flags & OBOS_AUD_STREAM_FLAGS_ALAW_DECODE)
+    pthread_mutex_unlock(&stream->mut);
+    return res;
+}
+
+// Moves what the client wrote to the ring since the last call into the buffer.
+// The stream must be locked.
+static void drain_ring(aud_stream* stream)
+{
+    aud_shm_ring* hdr = stream->ring.hdr;
+    if (stream->reserved)
+        return;
+    uint32_t tail = hdr->tail;
+    uint32_t avail = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE) - tail;
+    if (!avail)
+        return;
+    if (avail > (stream->size - stream->ptr) && stream->in_ptr)
+        compact(stream);
+    avail = MIN(MIN(avail, stream->ring.size), stream->size - stream->ptr);
+    if (!avail)
+        return;
+
+    uint32_t off = tail & (stream->ring.size - 1);
+    uint32_t first = MIN(avail, stream->ring.size - off);
+    memcpy((char*)stream->buffer + stream->ptr, stream->ring.data + off, first);
+    memcpy((char*)stream->buffer + stream->ptr + first, stream->ring.data, avail - first);
+    stream->ptr += avail;
+    __atomic_store_n(&hdr->tail, tail + avail, __ATOMIC_RELEASE);
+
+    // Pairs with the writer setting writer_waiting, then checking tail again.
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&hdr->writer_waiting, __ATOMIC_RELAXED))
     {
-        const uint8_t* data = buf;
-        for (size_t i = 0; i < (len / sizeof(*data)); i++)
-            decoded[i] = alaw_decode_table[data[i]];
+        __atomic_store_n(&hdr->writer_waiting, 0, __ATOMIC_RELAXED);
+        uint64_t one = 1;
+        write(stream->ring.event_fd, &one, sizeof(one));
     }
-    else if (stream->flags & OBOS_AUD_STREAM_FLAGS_PCM32_DECODE)
-    {
-        const int32_t* data = buf;
+}
 
-        for (size_t i = 0; i < (len / sizeof(*data)); i++)
-            decoded[i] = (int16_t)(data[i] >> 16);
-    }
-    else if (stream->flags & OBOS_AUD_STREAM_FLAGS_PCM24_DECODE)
-    {
-        struct int24
-        {
-            int32_t data : 24;
-        } PACK;
+// Converts bytes of input in the stream's current format to units of storage, and back.
+static size_t input_to_units(aud_stream* stream, size_t len)
+{
+    // ADPCM is stored as PCM16, two samples per byte.
+    if (stream->flags & OBOS_AUD_STREAM_FLAGS_ADPCM_DECODE)
+        len *= 2*sizeof(int16_t);
+    if (is_planar(stream->flags))
+        len /= aud_stream_sample_size(stream->flags)*stream->channels;
+    return len;
+}
 
-        const struct int24* data = buf;
+static size_t units_to_input(aud_stream* stream, size_t units)
+{
+    if (is_planar(stream->flags))
+        units *= aud_stream_sample_size(stream->flags)*stream->channels;
+    if (stream->flags & OBOS_AUD_STREAM_FLAGS_ADPCM_DECODE)
+        units /= 2*sizeof(int16_t);
+    return units;
+}
 
-        for (size_t i = 0; i < (len / sizeof(*data)); i++)
-            decoded[i] = (int16_t)(data[i].data >> 8);
-    }
-    else if (stream->flags & OBOS_AUD_STREAM_FLAGS_F32_DECODE)
-    {
-        const float* data = buf;
+size_t aud_stream_space(aud_stream* stream)
+{
+    pthread_mutex_lock(&stream->mut);
+    size_t res = units_to_input(stream, stream->size - (stream->ptr - stream->in_ptr));
+    pthread_mutex_unlock(&stream->mut);
+    return res;
+}
 
-        for (size_t i = 0; i < (len / sizeof(*data)); i++)
-            decoded[i] = (int16_t)(clamp(data[i], -1, 1) * 32767);
-    }
-    else
-        memcpy(decoded, buf, len);
-    if (stream->dev->sample_rate != stream->sample_rate)
-    {
-        float isamples_per_osample = (float)stream->sample_rate / (float)stream->dev->sample_rate;
-        float sample_count = floorf((float)newlen / (float)stream->channels / (float)sizeof(int16_t));
-        float new_sample_count = ceilf(sample_count / isamples_per_osample);
-        size_t new_buf_len = new_sample_count * stream->channels * sizeof(int16_t);
-        int16_t* new_buf = malloc(new_buf_len);
-        assert(new_buf);
-        for (int channel = 0; channel < stream->channels; channel++)
-        {
-            for (float i = 0; (i / isamples_per_osample) < new_sample_count; i += isamples_per_osample)
-            {
-                int16_t final_sample = 0;
-                if (isamples_per_osample < 1)
-                    final_sample = read_sample(decoded, channel, stream->channels, newlen, i);
-                else
-                {
-                    float osamples_per_isample = 1/isamples_per_osample;
-                    for (float j = 0; j < osamples_per_isample; j++)
-                        final_sample += read_sample(decoded, channel, stream->channels, newlen, i+j);
-                }
-                new_buf[(int)(i / isamples_per_osample)*stream->channels + channel] = final_sample;
-            }
-        }
-        free(decoded);
-        decoded = new_buf;
-        newlen = new_buf_len;
-    }
-    len = newlen;
-    bool res = aud_stream_push_no_decode(stream, decoded, len, blocking);
+bool aud_stream_want_space(aud_stream* stream, size_t len)
+{
+    pthread_mutex_lock(&stream->mut);
+    size_t units = MAX(input_to_units(stream, len), 1);
+    bool res = units <= stream->size;
     if (res)
     {
-        free(decoded);
-        *decoded_out = NULL;
-        *decoded_data_len = 0;
+        // Whoever wants the least is woken first, and can ask again.
+        if (!stream->space_wanted || units < stream->space_wanted)
+            stream->space_wanted = units;
+        check_space(stream);
     }
-    else
+    pthread_mutex_unlock(&stream->mut);
+    return res;
+}
+
+// Consumes one input frame from the stream.
+// The stream must be locked.
+static bool decode_frame(aud_stream* stream, float* out)
+{
+    if (is_planar(stream->flags))
     {
-        *decoded_out = decoded;
-        *decoded_data_len = len;
+        if (stream->ptr == stream->in_ptr)
+            return false;
+        for (int i = 0; i < stream->channels; i++)
+            out[i] = plane(stream, i)[stream->in_ptr];
+        if (++stream->in_ptr == stream->ptr)
+            reset(stream);
+        check_space(stream);
+        return true;
     }
+    apply_pending_formats(stream);
+    size_t sample_size = aud_stream_sample_size(stream->in_flags);
+    size_t frame_size = sample_size*stream->channels;
+    // Keep up to a ring's worth buffered, so the client has as long as possible to refill it.
+    if (stream->ring.hdr && stream->ptr - stream->in_ptr < stream->ring.size)
+        drain_ring(stream);
+    size_t avail = stream->ptr - stream->in_ptr;
+    if (stream->nPendingFormats)
+        avail = MIN(avail, stream->pending_formats[0].at - stream->in_ptr);
+    if (avail < frame_size)
+    {
+        // Skip a truncated frame before a format change.
+        if (stream->nPendingFormats && stream->ptr - stream->in_ptr >= frame_size)
+        {
+            stream->in_ptr += avail;
+            return decode_frame(stream, out);
+        }
+        return false;
+    }
+    const uint8_t* data = (uint8_t*)stream->buffer + stream->in_ptr;
+    for (int i = 0; i < stream->channels; i++)
+        out[i] = decode_sample(stream->in_flags, data + i*sample_size);
+    stream->in_ptr += frame_size;
+    if (stream->in_ptr == stream->ptr)
+        reset(stream);
+    check_space(stream);
+    return true;
+}
+
+bool aud_stream_read_frame(aud_stream* stream, float* out)
+{
+    aud_stream_lock(stream);
+    bool res = decode_frame(stream, out);
+    aud_stream_unlock(stream);
     return res;
 }
 
@@ -275,10 +749,8 @@ bool aud_stream_read(aud_stream* stream, void* data, size_t len, bool peek, bool
     {
         stream->in_ptr += len;
         if (stream->in_ptr == stream->ptr)
-        {
-            stream->in_ptr = stream->ptr = 0;
-            pthread_cond_signal(&stream->write_event);
-        }
+            reset(stream);
+        check_space(stream);
     }
     aud_stream_unlock(stream);
     return true;
@@ -293,3 +765,50 @@ void aud_stream_unlock(aud_stream* stream)
 {
     pthread_mutex_unlock(&stream->mut);
 }
+
+void aud_resampler_initialize(aud_resampler* rs, int channels)
+{
+    rs->frames = calloc(channels*2, sizeof(float));
+    assert(rs->frames);
+    rs->channels = channels;
+    rs->nFrames = 0;
+    rs->frac = 0;
+}
+
+void aud_resampler_free(aud_resampler* rs)
+{
+    free(rs->frames);
+    rs->frames = NULL;
+}
+
+bool aud_resampler_read(aud_resampler* rs, int in_sample_rate, int out_sample_rate, aud_resampler_source source, void* udata, float* out)
+{
+    if (in_sample_rate == out_sample_rate || in_sample_rate <= 0)
+    {
+        rs->nFrames = 0;
+        rs->frac = 0;
+        return source(udata, out);
+    }
+
+    float* const curr = rs->frames;
+    float* const next = rs->frames + rs->channels;
+    while (1)
+    {
+        while (rs->nFrames < 2)
+        {
+            if (!source(udata, rs->nFrames ? next : curr))
+                return false;
+            rs->nFrames++;
+        }
+        if (rs->frac < 1.f)
+            break;
+        rs->frac -= 1.f;
+        memcpy(curr, next, rs->channels*sizeof(float));
+        rs->nFrames = 1;
+    }
+
+    for (int i = 0; i < rs->channels; i++)
+        out[i] = curr[i] + (next[i] - curr[i]) * rs->frac;
+    rs->frac += (float)in_sample_rate / (float)out_sample_rate;
+    return true;
+}
@@ -0,0 +1,230 @@
+/*
+ * src/uring.c
+ *
+ * Copyright (c) 2025 Omar Berrow
+ */
+
+#define _GNU_SOURCE 1
+
+#include <obos-aud/compiler.h>
+
+#include <obos-aud/priv/uring.h>
+
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <sys/param.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+
+static int uring_setup(unsigned entries, struct io_uring_params* params)
+{
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int uring_register(int fd, unsigned opcode, void* arg, unsigned nr_args)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static bool map_rings(obos_aud_uring* ring, const struct io_uring_params* params)
+{
+    ring->sq_map_len = params->sq_off.array + params->sq_entries*sizeof(unsigned);
+    ring->cq_map_len = params->cq_off.cqes + params->cq_entries*sizeof(struct io_uring_cqe);
+    // Both rings can share one mapping on newer kernels.
+    if (params->features & IORING_FEAT_SINGLE_MMAP)
+        ring->sq_map_len = ring->cq_map_len = MAX(ring->sq_map_len, ring->cq_map_len);
+
+    ring->sq_map = mmap(NULL, ring->sq_map_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_map == MAP_FAILED)
+        return false;
+    if (params->features & IORING_FEAT_SINGLE_MMAP)
+        ring->cq_map = ring->sq_map;
+    else
+    {
+        ring->cq_map = mmap(NULL, ring->cq_map_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_map == MAP_FAILED)
+            return false;
+    }
+
+    ring->sqes_len = params->sq_entries*sizeof(struct io_uring_sqe);
+    ring->sq.sqes = mmap(NULL, ring->sqes_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sq.sqes == MAP_FAILED)
+        return false;
+
+    char* sq = ring->sq_map;
+    ring->sq.head = (unsigned*)(sq + params->sq_off.head);
+    ring->sq.tail = (unsigned*)(sq + params->sq_off.tail);
+    ring->sq.mask = (unsigned*)(sq + params->sq_off.ring_mask);
+    ring->sq.array = (unsigned*)(sq + params->sq_off.array);
+    ring->sq.entries = params->sq_entries;
+    char* cq = ring->cq_map;
+    ring->cq.head = (unsigned*)(cq + params->cq_off.head);
+    ring->cq.tail = (unsigned*)(cq + params->cq_off.tail);
+    ring->cq.mask = (unsigned*)(cq + params->cq_off.ring_mask);
+    ring->cq.cqes = (struct io_uring_cqe*)(cq + params->cq_off.cqes);
+
+    // sqes are always used in order, so the index array never changes.
+    for (unsigned i = 0; i < ring->sq.entries; i++)
+        ring->sq.array[i] = i;
+    return true;
+}
+
+static bool setup_buffers(obos_aud_uring* ring, unsigned nBufs, unsigned buf_size)
+{
+    ring->bufs.count = nBufs;
+    ring->bufs.size = buf_size;
+    ring->bufs.ring_len = nBufs*sizeof(struct io_uring_buf);
+    ring->bufs.ring = mmap(NULL, ring->bufs.ring_len, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (ring->bufs.ring == MAP_FAILED)
+    {
+        ring->bufs.ring = NULL;
+        return false;
+    }
+    ring->bufs.data = mmap(NULL, (size_t)nBufs*buf_size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (ring->bufs.data == MAP_FAILED)
+    {
+        ring->bufs.data = NULL;
+        return false;
+    }
+
+    struct io_uring_buf_reg reg = {};
+    reg.ring_addr = (uintptr_t)ring->bufs.ring;
+    reg.ring_entries = nBufs;
+    reg.bgid = 0;
+    if (uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0)
+        return false;
+
+    for (unsigned i = 0; i < nBufs; i++)
+        obos_aud_uring_recycle_buffer(ring, i);
+    return true;
+}
+
+// There is no feature bit for multishot receives (Linux 6.0), so try one out
+// on a socket that is shut down right away.
+static bool probe_multishot_recv(obos_aud_uring* ring)
+{
+    int fds[2] = {};
+    if (socketpair(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0, fds) != 0)
+        return false;
+    struct io_uring_sqe* sqe = obos_aud_uring_get_sqe(ring);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fds[0];
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    shutdown(fds[1], SHUT_WR);
+
+    bool res = false;
+    struct io_uring_cqe* cqe = NULL;
+    if (obos_aud_uring_submit(ring, 1) >= 0 && (cqe = obos_aud_uring_peek_cqe(ring)))
+    {
+        res = cqe->res == 0;
+        obos_aud_uring_cqe_seen(ring);
+    }
+    close(fds[0]);
+    close(fds[1]);
+    return res;
+}
+
+bool obos_aud_uring_init(obos_aud_uring* ring, unsigned entries, unsigned nBufs, unsigned buf_size)
+{
+    memset(ring, 0, sizeof(*ring));
+    ring->sq_map = ring->cq_map = ring->sq.sqes = MAP_FAILED;
+
+    struct io_uring_params params = {};
+    params.flags = IORING_SETUP_SUBMIT_ALL;
+    ring->fd = uring_setup(entries, &params);
+    if (ring->fd < 0)
+        return false;
+    if (!map_rings(ring, &params) || !setup_buffers(ring, nBufs, buf_size) || !probe_multishot_recv(ring))
+        goto fail;
+    return true;
+
+    fail:
+    obos_aud_uring_free(ring);
+    return false;
+}
+
+void obos_aud_uring_free(obos_aud_uring* ring)
+{
+    if (ring->sq.sqes != MAP_FAILED)
+        munmap(ring->sq.sqes, ring->sqes_len);
+    if (ring->cq_map != MAP_FAILED && ring->cq_map != ring->sq_map)
+        munmap(ring->cq_map, ring->cq_map_len);
+    if (ring->sq_map != MAP_FAILED)
+        munmap(ring->sq_map, ring->sq_map_len);
+    if (ring->bufs.ring)
+        munmap(ring->bufs.ring, ring->bufs.ring_len);
+    if (ring->bufs.data)
+        munmap(ring->bufs.data, (size_t)ring->bufs.count*ring->bufs.size);
+    if (ring->fd >= 0)
+        close(ring->fd);
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+}
+
+struct io_uring_sqe* obos_aud_uring_get_sqe(obos_aud_uring* ring)
+{
+    unsigned head = __atomic_load_n(ring->sq.head, __ATOMIC_ACQUIRE);
+    unsigned tail = *ring->sq.tail + ring->sq.nQueued;
+    if (tail - head >= ring->sq.entries)
+    {
+        obos_aud_uring_submit(ring, 0);
+        head = __atomic_load_n(ring->sq.head, __ATOMIC_ACQUIRE);
+        tail = *ring->sq.tail;
+        if (tail - head >= ring->sq.entries)
+            return NULL;
+    }
+    struct io_uring_sqe* sqe = &ring->sq.sqes[tail & *ring->sq.mask];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq.nQueued++;
+    return sqe;
+}
+
+int obos_aud_uring_submit(obos_aud_uring* ring, unsigned wait_nr)
+{
+    unsigned to_submit = ring->sq.nQueued;
+    if (to_submit)
+        __atomic_store_n(ring->sq.tail, *ring->sq.tail + to_submit, __ATOMIC_RELEASE);
+    ring->sq.nQueued = 0;
+    if (!to_submit && !wait_nr)
+        return 0;
+    return TEMP_FAILURE_RETRY(uring_enter(ring->fd, to_submit, wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0));
+}
+
+struct io_uring_cqe* obos_aud_uring_peek_cqe(obos_aud_uring* ring)
+{
+    unsigned head = *ring->cq.head;
+    if (head == __atomic_load_n(ring->cq.tail, __ATOMIC_ACQUIRE))
+        return NULL;
+    return &ring->cq.cqes[head & *ring->cq.mask];
+}
+
+void obos_aud_uring_cqe_seen(obos_aud_uring* ring)
+{
+    __atomic_store_n(ring->cq.head, *ring->cq.head + 1, __ATOMIC_RELEASE);
+}
+
+void* obos_aud_uring_buffer(obos_aud_uring* ring, uint16_t bid)
+{
+    return ring->bufs.data + (size_t)bid*ring->bufs.size;
+}
+
+void obos_aud_uring_recycle_buffer(obos_aud_uring* ring, uint16_t bid)
+{
+    struct io_uring_buf_ring* br = ring->bufs.ring;
+    uint16_t tail = br->tail;
+    struct io_uring_buf* buf = &br->bufs[tail & (ring->bufs.count - 1)];
+    buf->addr = (uintptr_t)obos_aud_uring_buffer(ring, bid);
+    buf->len = ring->bufs.size;
+    buf->bid = bid;
+    __atomic_store_n(&br->tail, tail + 1, __ATOMIC_RELEASE);
+}
@@ -21,7 +21,7 @@
 #include <sys/socket.h>
 #include <sys/param.h>
 
-const char* usage = "%s [-d display_uri] [-c channels] [-s sample_rate] [-f format] [-o output_id] [-h] input_file\n";
+const char* usage = "%s [-d display_uri] [-c channels] [-s sample_rate] [-f format] [-o output_id] [-p] [-z] [-C] [-r] [-l latency_ms] [-h] input_file\n";
 
 static int get_format(const char* fmt)
 {
@@ -51,8 +51,13 @@ int main(int argc, char** argv)
     float volume = 100.f;
     int format_flags = 0;
     uint16_t output = OBOS_AUD_DEFAULT_OUTPUT_DEV;
+    bool planar = false;
+    bool compress = false;
+    bool credited = false;
+    bool use_ring = false;
+    int latency = 0;
 
-    while ((opt = getopt(argc, argv, "hs:c:v:d:f:o:")) != -1)
+    while ((opt = getopt(argc, argv, "hs:c:v:d:f:o:pzCrl:")) != -1)
     {
         switch (opt)
         {
@@ -103,6 +108,27 @@ int main(int argc, char** argv)
                     return -1;
                 }
                 break;
+            case 'p':
+                planar = true;
+                break;
+            case 'z':
+                compress = true;
+                break;
+            case 'C':
+                credited = true;
+                break;
+            case 'r':
+                use_ring = true;
+                break;
+            case 'l':
+                errno = 0;
+                latency = strtol(optarg, NULL, 0);
+                if (errno != 0 || latency <= 0)
+                {
+                    fprintf(stderr, "Expected positive non-zero integer, got %s\n", optarg);
+                    return -1;
+                }
+                break;
             case 'h':
             default:
                 fprintf(stderr, usage, argv[0]);
@@ -110,6 +136,24 @@ int main(int argc, char** argv)
         }
     }
 
+    if (compress && format_flags != 0)
+    {
+        fprintf(stderr, "-z requires PCM16 input\n");
+        return -1;
+    }
+
+    if (use_ring && (compress || planar || credited))
+    {
+        fprintf(stderr, "-r can't be used with -z, -p, or -C\n");
+        return -1;
+    }
+
+    if (latency && (use_ring || credited))
+    {
+        fprintf(stderr, "-l can't be used with -r or -C\n");
+        return -1;
+    }
+
     if (optind >= argc)
     {
         fprintf(stderr, usage, argv[0]);
@@ -231,6 +275,10 @@ int main(int argc, char** argv)
         printf("Opening stream with %d channels at %dhz\n", channels, sample_rate);
 
     uint32_t stream_flags = format_flags;
+    if (planar)
+        stream_flags |= OBOS_AUD_STREAM_FLAGS_PLANAR_F32_STORAGE;
+    if (compress)
+        stream_flags |= OBOS_AUD_STREAM_FLAGS_ADPCM_DECODE;
     const uint32_t initial_flags = stream_flags;
     aud_open_stream_payload stream_info = {};
     stream_info.input_channels = channels;
@@ -238,12 +286,34 @@ int main(int argc, char** argv)
     stream_info.output_id = output;
     stream_info.volume = volume;
     int sample_size = 2;
-    int res = autrans_stream_open(socket, client_id, &stream_info, &stream, &stream_flags);
+    uint32_t credits = 0;
+    autrans_writer* writer = NULL;
+    int res = 0;
+    if (latency)
+    {
+        // The output mixes buffer_samples at a time, which would starve the stream otherwise.
+        aud_query_output_parameters_reply params = {};
+        if (autrans_query_output_parameters(socket, client_id, output, &params) < 0 ||
+            autrans_output_set_buffer_samples(socket, client_id, output, MAX((int64_t)params.params.sample_rate * latency / 4000, 1)) < 0)
+            goto die;
+        writer = autrans_writer_open(socket, client_id, &stream_info, &stream_flags, latency);
+        if (!writer)
+        {
+            perror("autrans_writer_open");
+            goto die;
+        }
+        stream = autrans_writer_stream_id(writer);
+    }
+    else
+        res = credited ?
+            autrans_stream_open_credited(socket, client_id, &stream_info, &stream, &stream_flags, &credits) :
+            autrans_stream_open(socket, client_id, &stream_info, &stream, &stream_flags);
     if (res < 0)
         goto die;
     if (stream_flags != initial_flags)
     {
         fprintf(stderr, "Server does not support one or more passed flags\n");
+        autrans_writer_close(writer);
         goto die;
     }
 
@@ -261,19 +331,69 @@ int main(int argc, char** argv)
             break;
     }
 
-    size_t buffer_size = stream_info.target_sample_rate * stream_info.input_channels * (sample_size) * 10;
+    autrans_ring ring = {};
+    if (use_ring && autrans_stream_open_ring(socket, client_id, stream, 0, &ring) < 0)
+        goto die;
+
+    // The writer paces itself, so it is fed a tenth of a second at a time.
+    size_t buffer_size = stream_info.target_sample_rate * stream_info.input_channels * (sample_size) * (writer ? 1 : 100) / 10;
     aud_data_payload *payload = malloc(buffer_size+sizeof(aud_data_payload));
     if (!payload)
         abort();
     payload->stream_id = stream;
-    size_t avail = 0;
-    while ((avail = read(input, payload->data, buffer_size)) > 0)
+    // Input is read here first when compressing it.
+    int16_t* samples = NULL;
+    autrans_adpcm_state* adpcm = NULL;
+    if (compress)
     {
+        samples = malloc(buffer_size);
+        adpcm = autrans_adpcm_create(channels);
+        if (!samples || !adpcm)
+            abort();
+    }
+    ssize_t avail = 0;
+    while ((avail = read(input, compress ? (void*)samples : payload->data, buffer_size)) >= 0)
+    {
+        if (compress)
+            avail = avail ?
+                autrans_adpcm_encode(adpcm, samples, avail / sizeof(int16_t), (uint8_t*)payload->data) :
+                autrans_adpcm_flush(adpcm, (uint8_t*)payload->data);
+        if (!avail)
+            break;
+
+        if (use_ring)
+        {
+            if (autrans_ring_write(&ring, payload->data, avail) < 0)
+            {
+                perror("autrans_ring_write");
+                break;
+            }
+            continue;
+        }
+
+        if (writer)
+        {
+            if (autrans_writer_write(writer, payload->data, avail) < 0)
+            {
+                perror("autrans_writer_write");
+                break;
+            }
+            continue;
+        }
+
+        if (credited)
+        {
+            if (autrans_stream_data_credited(socket, client_id, stream, payload->data, avail, &credits) < 0)
+                break;
+            continue;
+        }
+
         aud_packet pckt = {};
         pckt.opcode = OBOS_AUD_DATA;
         pckt.client_id = client_id;
         pckt.payload = payload;
         pckt.payload_len = avail+sizeof(aud_data_payload);
+        pckt.data_offset = OBOS_AUD_ALIGNED_DATA_OFFSET(OBOS_AUD_PAYLOAD_ALIGNMENT);
         if (autrans_transmit(socket, &pckt) < 0)
         {
             shutdown(socket, SHUT_RDWR);
@@ -299,7 +419,16 @@ int main(int argc, char** argv)
     }
     if (avail < 0)
         perror("read");
+    if (writer)
+    {
+        autrans_writer_drain(writer);
+        autrans_writer_close(writer);
+    }
     free(payload);
+    free(samples);
+    if (adpcm)
+        autrans_adpcm_free(adpcm);
+    autrans_ring_close(&ring);
 
     die:
     autrans_disconnect(socket, client_id);